@@ -78,6 +78,50 @@ CR_EXPORT int cr_main(struct cr_plugin *ctx, enum cr_op operation) {
 
 ### Changelog
 
+#### 2026-10-16
+
+- Added event based change detection (Linux only) with `cr_watch_fd`, `cr_watch_dispatch`, `cr_watch_start` and
+`cr_watch_stop`. Once enabled, `cr_plugin_update` doesn't `stat()` the plugin anymore unless it was notified of a change.
+- Plugin timestamps now have nanosecond resolution. An image with the same fingerprint as the loaded one is not
+reloaded anymore, see `cr_set_skip_identical`.
+- Images are only loaded once completely written, avoiding `CR_BAD_IMAGE` retry loops. Optionally a build manifest
+listing completed plugins can be used, see `cr_set_manifest`.
+- Added an opt-in background staging mode that prepares new images in a worker thread, see `cr_set_staging`.
+- Added an opt-in frame budgeted incremental reload, see `cr_set_reload_budget`.
+- Added an opt-in warm standby pool of previous images for instant rollbacks, see `cr_set_standby`.
+- Linux/OSX: crash protection doesn't save the signal mask on every `cr_plugin_update` anymore, saving a syscall per
+call. The mask is only repaired after a crash.
+- Added `cr_plugin_update_n` to call `cr_main` many times with a single reload check and protection frame.
+- Crash protection is now per thread, different plugins can be updated concurrently from different threads. A crash
+outside of a protected call isn't caught anymore.
+- Added `cr_scheduler` to update many plugins in parallel on a work stealing thread pool.
+- Linux: added an opt-in mode transferring large state sections by remapping their pages, see `cr_set_state_remap`.
+- Linux: pages of a large `.bss` that were never touched are not copied during reloads anymore, and checking if a
+`.bss` is empty is faster and works beyond 2GB.
+- Added opt-in periodic state checkpoints restored by crash rollbacks, see `cr_set_checkpoint`.
+- The state is now stored into a ring of reused page allocated snapshots, one copy per unload instead of two. Older
+states can be restored with `cr_plugin_restore`, see `cr_set_snapshots`.
+- Linux: added an opt-in per variable state migration using the image symbol table, allowing variables to be added
+or removed between reloads, see `cr_set_state_migration`.
+- Linux: added `CR_STATE_VAR` to declare typed state variables, reinitialized on reload if their type changed.
+- Added opt-in `CR_STATE_EXPORT` and `CR_STATE_IMPORT` operations to serialize the state when it can't be
+transferred, see `cr_set_state_export`. `cr_plugin` has a new `state` field.
+- Added named data sections (`CR_SECTION`) with a reload policy each: transfer, persist across crashes, reset or
+discard, see `cr_set_section`. The policy of `.state` and `.bss` can be changed too.
+- Added an opt-in state file restored by the first load of a new host process, see `cr_set_state_file`.
+- Linux: added opt-in relocation of the pointers the state and host heap ranges have into the previous image, see
+`cr_set_relocation` and `cr_register_heap_range`.
+- Added an opt-in guest heap arena rolled back with the state after crashes, see `cr_set_arena`. `cr_plugin` has a
+new `arena` field.
+- State copies of `CR_COPY_THRESHOLD` bytes or more are split among `CR_COPY_THREADS` threads and use non-temporal
+stores, keeping the host working set in the caches.
+- Linux, OSX: added an opt-in mode restoring large state sections on demand after a reload, see
+`cr_set_lazy_restore`.
+- Added an opt-in history of delta compressed states older than the snapshots, see `cr_set_history`, and
+`cr_plugin_restore_version` to restore the state of a given version.
+- Linux: added `cr_plugin_state_find` to read state variables by name from the host, consistently if the guest
+declares a `CR_STATE_SEQLOCK`, and `cr_set_state_share` to publish them to other processes.
+
 #### 2025-03-30
 
 - Removed FIPS and moved to pure CMake.
@@ -202,18 +246,368 @@ Arguments
 
 This function will call the plugin `cr_main` function. It should be called as
  frequently as the core logic/application needs.
+ Different plugins can be updated (and crash protected) concurrently from different threads,
+ but a single plugin must only be updated by one thread at a time.
 
 Arguments
 
 - `ctx` the current plugin context data.
-- `reloadCheck` optional: do a disk check (stat()) to see if the dynamic library needs a reload.
+- `reloadCheck` optional: do a disk check (stat()) to see if the dynamic library needs a reload. If the
+ change watcher is enabled (see `cr_watch_fd`), the disk is only checked after a change notification.
 
 Return
 
 - -1 if a failure happened during an update;
-- -2 if a failure happened during a load or unload;
+- -2 if a failure happened during a load or unload, or no image could be loaded yet;
 - anything else is returned directly from the plugin `cr_main`.
 
+#### `int cr_plugin_update_n(cr_plugin &ctx, unsigned int n, int *results, bool reloadCheck = true)`
+
+Same as `cr_plugin_update`, but calls the plugin `cr_main` with `CR_STEP` up to `n` times under a single reload
+ check and crash protection frame. Useful for hosts stepping a plugin in tight loops. It stops at the first negative
+ result returned by `cr_main` or at a crash, which are handled as in `cr_plugin_update` in the next call.
+
+Arguments
+
+- `ctx` the current plugin context data.
+- `n` the maximum number of `cr_main` calls.
+- `results` optional: an array of at least `n` elements receiving each `cr_main` result, including the failed
+ one (-1 for a crash).
+- `reloadCheck` optional: same as in `cr_plugin_update`, done once before all the calls.
+
+Return
+
+- -2 if a failure happened during a load or unload, or no image could be loaded yet;
+- the number of completed iterations otherwise. If less than `n`, the iteration at that index failed and
+ `ctx.failure` has the reason.
+
+#### `void cr_set_skip_identical(cr_plugin &ctx, bool skip)`
+
+By default a change in the plugin file timestamp that doesn't change its fingerprint (a `touch` or a no-op relink)
+ doesn't trigger a reload. The fingerprint is the build id embedded by the linker (ELF `.note.gnu.build-id` or
+ Mach-O `LC_UUID`), or a hash of the image content if there is none.
+
+Arguments
+
+- `ctx` the current plugin context data.
+- `skip` `false` to reload on any timestamp change.
+
+#### `void cr_set_manifest(cr_plugin &ctx, const std::string &path)`
+
+Sets a build manifest (or sentinel) file that the build system writes once it is done. A new image is only loaded
+ after the manifest lists it, one plugin per line by file name and optionally its build id in hexadecimal (as shown
+ by `readelf -n` or `dwarfdump --uuid`):
+
+```
+libgame.so 05b006576d6660641638709629f45cb8a621fd32
+```
+
+Without a build id, the manifest must be newer than the plugin file. Independently of a manifest, `cr` checks that
+ the image headers are completely written before trying to load it, and waits exponentially longer between tries
+ (from `CR_RETRY_MIN_MS` to `CR_RETRY_MAX_MS`) while it is not ready.
+
+Arguments
+
+- `ctx` the current plugin context data.
+- `path` full path to the manifest file.
+
+#### `void cr_set_staging(cr_plugin &ctx, bool staging)`
+
+Enables background staging. Once a change is detected, a worker thread copies, loads and inspects the new image
+ while the current version keeps running. `cr_plugin_update` then only does the final swap (`CR_UNLOAD`, state
+ transfer and `CR_LOAD`). The initial load is always done in place.
+
+Note that the new image static initializers run in the worker thread, before the running version gets `CR_UNLOAD`.
+ If the new image can't be loaded at all, the running version keeps running and the load is retried later instead
+ of failing with `CR_BAD_IMAGE`.
+
+Arguments
+
+- `ctx` the current plugin context data.
+- `staging` `true` to enable background staging.
+
+#### `void cr_set_standby(cr_plugin &ctx, unsigned int depth, size_t max_bytes)`
+
+Keeps the last `depth` known good images loaded after being replaced by a reload, with their data sections
+ already found. A rollback to one of them is then only a pointer swap and a state restore, without any file
+ access or dynamic loader work.
+
+Note that statics not managed by `cr` (ie. not `CR_STATE` or in `.bss`) of a standby image keep the values they
+ had when it was replaced, instead of being reinitialized.
+
+Arguments
+
+- `ctx` the current plugin context data.
+- `depth` number of images to keep, 0 disables the pool (default).
+- `max_bytes` maximum total size of the kept images (file size), 0 for no limit.
+
+#### `void cr_set_reload_budget(cr_plugin &ctx, int64_t microseconds)`
+
+Enables incremental reloads for hosts that can't use threads. The reload is split in stages (detect, copy, load,
+ inspect and swap) and each `cr_plugin_update` advances at least one stage, continuing while the elapsed time is
+ below the budget. The current version keeps running until the final swap stage, which unloads it, transfers the
+ state and calls `CR_LOAD` in the same update. The initial load is always done in place. As with `cr_set_staging`, an
+ image that can't be loaded is retried later.
+
+Arguments
+
+- `ctx` the current plugin context data.
+- `microseconds` time budget per update, 0 advances exactly one stage per update and a negative value disables
+ incremental reloads (default).
+
+#### `void cr_set_state_remap(cr_plugin &ctx, bool remap)`
+
+Linux only. Instead of copying `CR_STATE` and `.bss` sections on every reload, their page aligned parts are kept in a
+ memfd mapped (copy-on-write) over the section of each loaded version, so transferring the state costs a `mmap`
+ instead of a copy. The memfd also keeps the rollback backup; on unload only the pages written since the last load
+ are written back to it. The head and tail of each section (sharing pages with other data) are still copied. If a
+ new version lays out a section differently, it falls back to copying. Should be called right after
+ `cr_plugin_open`; worth it for sections of many pages.
+
+Arguments
+
+- `ctx` the current plugin context data.
+- `remap` `true` to enable.
+
+#### `void cr_set_checkpoint(cr_plugin &ctx, unsigned int steps, unsigned int ms)`
+
+Enables periodic checkpoints of the plugin state (`CR_STATE` and `.bss`), taken after a successful `CR_STEP` every
+ `steps` updates and/or every `ms` milliseconds. When rolling back after a crash, the last checkpoint is restored
+ instead of the state saved at the last unload, if it fits the rolled back version sections.
+
+On Linux only the pages written since the previous checkpoint are copied, tracked with soft-dirty bits
+ (`/proc/self/clear_refs` and `/proc/self/pagemap`). Note that clearing these bits makes the next write to any page of
+ the process take a minor fault, and that it is process wide: checkpoints are serialized and a plugin whose step
+ overlaps another plugin checkpoint does a full copy next time. Without soft-dirty support (and on other platforms)
+ every checkpoint is a full copy. State written by guest threads outside of `cr_main` is not synchronized.
+
+Arguments
+
+- `ctx` the current plugin context data.
+- `steps` take a checkpoint every `steps` updates, 0 to disable.
+- `ms` take a checkpoint every `ms` milliseconds, 0 to disable.
+
+#### `void cr_set_state_export(cr_plugin &ctx, bool enable)`
+
+When a new version can't take the running version state as is (its sections are not compatible accordingly to
+ `cr_mode`), the running version is called with `CR_STATE_EXPORT` before `CR_UNLOAD` to serialize its state into a
+ buffer owned by the host, and the new version with `CR_STATE_IMPORT` before `CR_LOAD` to read it back, instead of
+ failing with `CR_STATE_INVALIDATED`. The new version sections keep their initial values. If the export returns a
+ negative value the reload fails as before, if the import does (or crashes) the previous version is loaded back with
+ its stored state. The buffer is kept between reloads, no copy of it is done. To know if the state fits, a new version
+ is loaded before the running one is unloaded.
+
+Arguments
+
+- `ctx` the current plugin context data.
+- `enable` `true` to enable, the guest must handle both operations.
+
+#### `void cr_set_state_migration(cr_plugin &ctx, bool migrate)`
+
+Linux only. Transfers `CR_STATE` and `.bss` variables by name and size, as found in the image symbol table, when a new
+ version lays them out differently. Variables added keep their initial value and removed ones are dropped, instead of
+ the whole section being copied as is (`CR_UNSAFE`) or rejected with `CR_STATE_INVALIDATED`. A variable whose size
+ changed is treated as a new one. Sections laid out the same way are still copied as a whole. Requires a symbol table
+ (a non stripped image, or exported variables).
+
+Arguments
+
+- `ctx` the current plugin context data.
+- `migrate` `true` to enable.
+
+#### `void cr_set_snapshots(cr_plugin &ctx, unsigned int depth)`
+
+Sets how many states stored by the last unloads are kept, the newest one is used by the next load and by rollbacks.
+ Snapshot buffers are allocated once and reused, so storing the state is a single copy. Default is 2, minimum 1.
+
+Arguments
+
+- `ctx` the current plugin context data.
+- `depth` number of snapshots to keep.
+
+#### `void cr_set_history(cr_plugin &ctx, size_t max_bytes)`
+
+Keeps a history of the states stored by the unloads older than the snapshots, so `cr_plugin_restore_version` can go
+ back further than them. Each state is kept as the difference to the state stored after it (or whole if the sections
+ were laid out differently), computed in the background and compressed, so the history grows with how much of the
+ state changes between unloads, not with its size. The oldest states are dropped to keep the history under
+ `max_bytes`. Needs at least 2 snapshots (the default, see `cr_set_snapshots`), a rollback keeping `CR_SECTION_PERSIST`
+ sections clears it, and it is not kept with state remapping (`cr_set_state_remap`).
+
+Arguments
+
+- `ctx` the current plugin context data.
+- `max_bytes` memory cap of the history, 0 disables it.
+
+#### `void cr_set_state_file(cr_plugin &ctx, const std::string &path)`
+
+Keeps the state stored by each unload (and by `cr_plugin_close`) in a memory mapped file, so a new host process can
+ start warm: the first version it loads gets the state from the file instead of its initial values. The file is only
+ used if it was written for the same image (same fingerprint, see `cr_set_skip_identical`), or on Linux if the
+ sections have the same layout in the symbol table. Pointers kept in the state (heap, host data) are not valid
+ anymore in a new process. The file survives a process restart but is not synced to disk. Each save writes a new file
+ (`path` with a `.tmp` suffix) renamed over the previous one, so a host dying while saving keeps the previous state.
+ On Linux, an inherited memfd can be used with a `/proc/self/fd/N` path, it is rewritten in place.
+
+Arguments
+
+- `ctx` the current plugin context data.
+- `path` the state file, empty to disable.
+
+#### `void cr_set_relocation(cr_plugin &ctx, bool relocate)`
+
+Linux only. After the state is transferred to a new version, pointers it has into the previous image (functions,
+ vtables, string literals, other state variables) are moved to the new image instead of being left dangling. Any
+ aligned pointer sized value inside of the previous image loaded segments is taken as a pointer. It is moved to the
+ same offset if both images are the same, otherwise to the same offset of the symbol with the same name, if there is
+ one (string literals have no symbol). Also applies to the host heap ranges given to `cr_register_heap_range`.
+ Requires a symbol table (a non stripped image, or exported symbols).
+
+Arguments
+
+- `ctx` the current plugin context data.
+- `relocate` `true` to enable.
+
+#### `void cr_register_heap_range(cr_plugin &ctx, void *ptr, size_t size)`
+
+Adds a range of memory whose pointers into the plugin image are moved on reload, see `cr_set_relocation`. It is
+ removed with `void cr_unregister_heap_range(cr_plugin &ctx, void *ptr)`.
+
+Arguments
+
+- `ctx` the current plugin context data.
+- `ptr` the start of the range, usually an allocation of the host shared with the guest.
+- `size` the range size in bytes.
+
+#### `void cr_set_lazy_restore(cr_plugin &ctx, bool lazy)`
+
+Linux and OSX only. Restores the transferred sections of `CR_LAZY_MIN_SIZE` bytes or more on demand: on reload their
+ whole pages are left inaccessible and each one is restored from the stored state the first time it is accessed, by
+ the crash handler, so a reload costs as much as the part of the state the new version touches. Pages never touched
+ are restored by the next unload or checkpoint, and by rollbacks and relocation, which rewrite the state. Sections
+ with pages never touched (`.bss`, see `CR_SPARSE_MIN_SIZE`) or kept in a memfd (`cr_set_state_remap`) are still
+ copied. As with the arena, a system call reading from a page not restored yet fails (`EFAULT`).
+
+Arguments
+
+- `ctx` the current plugin context data.
+- `lazy` `true` to enable.
+
+#### `bool cr_set_arena(cr_plugin &ctx, size_t size)`
+
+Creates a heap for the guest that survives reloads and is rolled back together with the state after a crash, so the
+ state and the data it points to stay consistent. The guest allocates from it with `cr_arena_alloc(ctx, size)` and
+ frees with `cr_arena_free(ctx, ptr)`, the blocks never move. A checkpoint of the arena is taken whenever the state is
+ stored by an unload or by `cr_set_checkpoint`. On Linux and OSX the used pages are then write protected and each page
+ is only copied the first time it is written, elsewhere the whole arena is copied. The arena is not thread safe, and
+ a system call writing to a protected page fails instead of copying it (`EFAULT`).
+
+Arguments
+
+- `ctx` the current plugin context data.
+- `size` the address space reserved for the arena, pages are committed as used.
+
+Return
+
+- `false` if there's an arena already or it couldn't be reserved.
+
+#### `bool cr_set_section(cr_plugin &ctx, const char *name, cr_section_policy policy)`
+
+Sets what happens on reload to a data section: `"state"` (`CR_STATE`), `"bss"` or a section the guest fills with
+ `CR_SECTION(name)`. A large cache that is cheap to rebuild can be moved out of the reload critical path.
+
+- `CR_SECTION_TRANSFER` the section is stored on unload and copied into the new version, the default;
+- `CR_SECTION_PERSIST` as transfer, but when a version crashes the version rolled back to gets the values the
+ section had at the crash instead of the stored ones (nor a checkpoint);
+- `CR_SECTION_RESET` the new version keeps its initial values, also when it is a standby image running again;
+- `CR_SECTION_DISCARD` the section is not tracked at all. A standby image running again keeps its own last values.
+
+Named sections are found in images loaded after the call, at most `CR_MAX_SECTIONS` (`.state` and `.bss` included).
+ On Windows names are up to 7 characters.
+
+Arguments
+
+- `ctx` the current plugin context data.
+- `name` the section name, as given to `CR_SECTION`.
+- `policy` the `cr_section_policy`.
+
+Return
+
+- `false` if there are too many sections.
+
+#### `bool cr_plugin_restore(cr_plugin &ctx, unsigned int depth)`
+
+Restores into the running version the state stored `depth` unloads ago (0 is the newest), without reloading. The
+ snapshot sections must be compatible with the running version ones accordingly to `cr_mode`. With state remapping
+ enabled (`cr_set_state_remap`) only the newest snapshot can be restored.
+
+Arguments
+
+- `ctx` the current plugin context data.
+- `depth` how many unloads ago, must be less than the snapshots kept.
+
+Return
+
+- `true` if restored, `false` if there's no such snapshot or it is not compatible.
+
+#### `bool cr_plugin_restore_version(cr_plugin &ctx, unsigned int version)`
+
+Restores into the running version the state stored by the last unload of `version`, without reloading. It is taken
+ from the snapshots if still there, otherwise rebuilt from the history (see `cr_set_history`). The state must be
+ compatible with the running version as with `cr_plugin_restore`.
+
+Arguments
+
+- `ctx` the current plugin context data.
+- `version` the version that stored the state.
+
+Return
+
+- `true` if restored, `false` if there's no state of that version or it is not compatible.
+
+#### `bool cr_plugin_state_find(cr_plugin &ctx, const char *name, cr_state_view &view)`
+
+Linux only. Finds a variable of the running version state (`CR_STATE`, or `.bss`) by name in the symbol table of its
+ image, so the host can read it without the guest exposing it. C++ names are demangled, a function static is named
+ as in `update(int)::count`. Static variables with the same name in different translation units can't be told
+ apart, the first one is found. The view is valid until the next load
+ (`ctx.version != view.version`) and is read with `cr_state_view_read(view, dst, size)`, or
+ `cr_state_view_read(view, value)` for a value of a type of the same size. Reading doesn't stop the guest, if it
+ declares a `CR_STATE_SEQLOCK` the view retries until it reads a consistent value and fails after
+ `CR_STATE_READ_TRIES` tries (the guest is stuck writing), otherwise a value written concurrently may be torn. A
+ state restored while the guest was writing (it returned or crashed before `CR_STATE_WRITE_END()`) can be read again
+ after the load or rollback.
+
+Arguments
+
+- `ctx` the current plugin context data.
+- `name` the variable name.
+- `view` gets the address and size of the variable.
+
+Return
+
+- `false` if there's no such variable or no symbol table.
+
+#### `bool cr_set_state_share(cr_plugin &ctx, const std::string &path, const std::vector<std::string> &names)`
+
+Linux only. Publishes the variables `names` (see `cr_plugin_state_find`) in a memory mapped file after every
+ successful update, so an external process can watch them: it maps the file and reads a variable with
+ `cr_state_share_read(shared, name, dst, size)`, which retries while the host is publishing. The room of each
+ variable is its size when first published; a variable missing or grown in a later version can't be read until
+ `cr_set_state_share` is called again. A variable that can't be read consistently keeps its last published value.
+ The file is replaced, not rewritten, when the variables are laid out again, so a process still mapping the old one
+ has to map it again to see new values. On Linux `/dev/shm` keeps the file in memory.
+
+Arguments
+
+- `ctx` the current plugin context data.
+- `path` the file to publish to, an empty path stops publishing.
+- `names` the variables to publish, shorter than 56 characters.
+
+Return
+
+- `false` if a name is too long.
+
 #### `void cr_plugin_close(cr_plugin &ctx)`
 
 Cleanup internal states once the plugin is not required anymore.
@@ -222,6 +616,57 @@ Arguments
 
 - `ctx` the current plugin context data.
 
+#### `int cr_watch_fd()`
+
+Enables event based change detection for all plugins (Linux only, uses inotify). A single watcher is shared by
+ all open plugins and the reload check in `cr_plugin_update` becomes a simple counter comparison.
+
+Return
+
+- A pollable file descriptor that becomes readable when any plugin file changes, add it to your own poll/epoll
+ loop and call `cr_watch_dispatch()` when it is readable. -1 if not supported.
+
+#### `void cr_watch_dispatch()`
+
+Drains pending change notifications without blocking, flagging the changed plugins to be reloaded in their next
+ `cr_plugin_update`.
+
+#### `bool cr_watch_start()`
+
+Enables event based change detection like `cr_watch_fd`, but a background thread takes care of dispatching the
+ notifications. Returns `false` if not supported.
+
+#### `void cr_watch_stop()`
+
+Stops the background thread started with `cr_watch_start`. The watcher is still enabled, so the host must call
+ `cr_watch_dispatch()` from now on.
+
+#### `void cr_scheduler_open(cr_scheduler &sched, unsigned int threads = 0)`
+
+Creates a scheduler that updates a set of plugins in parallel, using a work stealing pool of `threads` workers (the
+ thread calling `cr_scheduler_update` is one of them). `0` uses one worker per hardware thread. Plugins are added
+ with `int cr_scheduler_add(cr_scheduler &sched, cr_plugin &ctx)`, which returns the plugin index in the update
+ results, and `bool cr_scheduler_depends(cr_scheduler &sched, cr_plugin &ctx, cr_plugin &dependency)` makes `ctx`
+ always update after `dependency` (failing for dependency cycles). `void cr_scheduler_close(cr_scheduler &sched)`
+ stops the workers, the plugins must still be closed by the host.
+
+Reloads and crash handling happen in the worker updating the plugin, exactly as in `cr_plugin_update`, so the plugins
+ static initializers and `CR_LOAD` may run in any worker thread.
+
+#### `int cr_scheduler_update(cr_scheduler &sched, int *results = nullptr, bool reloadCheck = true)`
+
+Updates every plugin once with `cr_plugin_update`, in parallel while respecting the declared dependencies.
+
+Arguments
+
+- `sched` the scheduler.
+- `results` optional: an array with one element per added plugin receiving each `cr_plugin_update` result.
+- `reloadCheck` optional: passed to each `cr_plugin_update`.
+
+Return
+
+- the number of plugins that failed (negative `cr_plugin_update` result).
+
 #### `cr_op`
 
 Enum indicating the kind of step that is being executed by the `host`:
@@ -233,6 +678,10 @@ Enum indicating the kind of step that is being executed by the `host`:
  application one chance to store any required data;
 - `CR_CLOSE` Used when closing the plugin, This works like `CR_UNLOAD` but no `CR_LOAD`
  should be expected afterwards;
+- `CR_STATE_EXPORT` The running version state can't be transferred to the new one, serialize it into `ctx->state`
+ with `cr_buffer_write` (called before `CR_UNLOAD`, see `cr_set_state_export`);
+- `CR_STATE_IMPORT` Deserialize the state exported by the previous version from `ctx->state` with
+ `cr_buffer_read` (called before `CR_LOAD`);
 
 #### `cr_plugin`
 
@@ -244,6 +693,8 @@ The plugin instance context struct.
  first load. **The version will change during a crash handling process**;
 - `failure` used by the crash protection system, will hold the last failure error
  code that caused a rollback. See `cr_failure` for more info on possible values;
+- `state` the buffer to serialize to or from during `CR_STATE_EXPORT` and `CR_STATE_IMPORT`, null otherwise;
+- `arena` the plugin arena used by `cr_arena_alloc` and `cr_arena_free`, null if not enabled (see `cr_set_arena`);
 
 #### `cr_failure`
 
@@ -262,7 +713,8 @@ If a crash in the loadable binary happens, the crash handler will indicate the
 - `CR_STACKOVERFLOW` Is `EXCEPTION_STACK_OVERFLOW`, Windows only;
 - `CR_STATE_INVALIDATED` Static `CR_STATE` management safety failure;
 - `CR_BAD_IMAGE` The plugin is not a valid image (i.e. the compiler may still
-writing it);
+writing it). With `cr_set_staging` or `cr_set_reload_budget` a new image that can't be loaded is retried later
+instead;
 - `CR_OTHER` Other signal, Linux only;
 - `CR_USER` User error (for negative values returned from `cr_main`);
 
@@ -294,6 +746,43 @@ Usage
 
 `static bool CR_STATE bInitialized = false;`
 
+#### `CR_STATE_VAR` macro
+
+Declares a static `CR_STATE` variable with a record of its name, type, size and alignment in the `.state_meta`
+ section (Linux only, elsewhere it is a plain `CR_STATE` variable). When a new version lays out the state
+ differently, the host then transfers each variable by name (as `cr_set_state_migration` does, without needing to
+ enable it) and a variable whose type spelling, size or alignment changed is reinitialized instead of getting the
+ old bytes. An initializer is required and array types need a typedef. Names should be unique within the plugin.
+ The type is only known by its spelling, size and alignment, not by its members: reordering or retyping members of
+ the same size goes unnoticed and the old bytes are kept, so rename the type (or the variable) when doing so.
+
+Usage
+
+`CR_STATE_VAR(int, counter, 0);`
+
+`CR_STATE_VAR(struct config, cfg, {1, 2});`
+
+#### `CR_SECTION` macro
+
+Places a global or local static variable in a named data section, its reload policy is set by the host with
+ `cr_set_section`. Variables in a section without a policy set are not tracked.
+
+Usage
+
+`static char CR_SECTION(cache) glyphs[1 << 20];`
+
+#### `CR_STATE_SEQLOCK` macro
+
+Declares a sequence counter in the plugin state (once per plugin), so the host reads its state consistently with
+ `cr_plugin_state_find`. The guest brackets its writes to variables the host reads with `CR_STATE_WRITE_BEGIN()` and
+ `CR_STATE_WRITE_END()`, each costing an atomic store.
+
+Usage
+
+`CR_STATE_SEQLOCK;`
+
+`CR_STATE_WRITE_BEGIN(); pos.x = x; pos.y = y; CR_STATE_WRITE_END();`
+
 #### Overridable macros
 
 You can define these macros before including cr.h in host (CR_HOST) to customize cr.h
@@ -304,6 +793,17 @@ You can define these macros before including cr.h in host (CR_HOST) to customize
 - `CR_REALLOC`: override libc's realloc. default: #define CR_REALLOC(ptr, size) ::realloc(ptr, size)
 - `CR_MALLOC`: override libc's malloc. default: #define CR_MALLOC(size) ::malloc(size)
 - `CR_FREE`: override libc's free. default: #define CR_FREE(ptr) ::free(ptr)
+- `CR_RETRY_MIN_MS`: first delay before checking again an image that is not ready. default: 10
+- `CR_RETRY_MAX_MS`: maximum delay before checking again an image that is not ready. default: 1000
+- `CR_SPARSE_MIN_SIZE`: minimum `.bss` size in bytes to only transfer its pages that were ever touched (Linux only). default: 1MB
+- `CR_HUGEPAGE_MIN_SIZE`: minimum state snapshot size in bytes to ask for transparent huge pages (Linux only). default: 4MB
+- `CR_MAX_SECTIONS`: maximum number of data sections tracked, see `cr_set_section`. default: 8
+- `CR_COPY_THRESHOLD`: minimum size in bytes of a state copy to split among threads, using non-temporal stores where
+ available (SSE2). default: 64MB
+- `CR_COPY_THREADS`: number of threads copying a large state, the update thread included. default: 4
+- `CR_LAZY_MIN_SIZE`: minimum section size in bytes to restore on demand, see `cr_set_lazy_restore`. default: 1MB
+- `CR_STATE_READ_TRIES`: times a state variable is read before giving up while it is being written, see
+ `cr_plugin_state_find` and `cr_set_state_share`. default: 1000
 - `CR_DEBUG`: outputs debug messages in CR_ERROR, CR_LOG and CR_TRACE
 - `CR_ERROR`: logs debug messages to stderr. default (CR_DEBUG only): #define CR_ERROR(...) fprintf(stderr, __VA_ARGS__)
 - `CR_LOG`: logs debug messages. default (CR_DEBUG only): #define CR_LOG(...) fprintf(stdout, __VA_ARGS__)
@@ -415,6 +915,8 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #ifndef __CR_H__
 #define __CR_H__
 
+#include <stddef.h>
+
 //
 // Global OS specific defines/customizations
 //
@@ -484,6 +986,18 @@ enum cr_op {
     CR_STEP = 1,
     CR_UNLOAD = 2,
     CR_CLOSE = 3,
+    CR_STATE_EXPORT = 4, // see cr_set_state_export
+    CR_STATE_IMPORT = 5,
+};
+
+// cr_section_policy tells what happens to a data section on reload, see
+// cr_set_section
+enum cr_section_policy {
+    CR_SECTION_TRANSFER = 0, // copied into the new version (the default)
+    CR_SECTION_PERSIST = 1,  // as transfer, but a crash keeps the values of
+                             // the version that crashed
+    CR_SECTION_RESET = 2,    // the new version keeps its initial values
+    CR_SECTION_DISCARD = 3   // not tracked at all, no copy is ever done
 };
 
 enum cr_failure {
@@ -521,6 +1035,114 @@ struct cr_plugin {
     enum cr_failure failure;
     unsigned int next_version;
     unsigned int last_working_version;
+    struct cr_buffer *state;
+    struct cr_arena *arena;
+};
+
+// a growable buffer owned by the host, passed as `cr_plugin::state` during
+// CR_STATE_EXPORT and CR_STATE_IMPORT, see cr_buffer_write/cr_buffer_read.
+struct cr_buffer {
+    char *data;
+    size_t size;
+    size_t capacity;
+    size_t offset; // read position
+    char *(*grow)(struct cr_buffer *buf, size_t capacity);
+};
+
+// Appends `size` bytes to the buffer, returns where to write them or NULL if
+// it couldn't grow.
+static inline void *cr_buffer_write(struct cr_buffer *buf, size_t size) {
+    char *p;
+    if (buf->size + size > buf->capacity &&
+        !buf->grow(buf, buf->size + size)) {
+        return 0;
+    }
+    p = buf->data + buf->size;
+    buf->size += size;
+    return p;
+}
+
+// Consumes the next `size` bytes of the buffer, NULL if there isn't as many.
+static inline const void *cr_buffer_read(struct cr_buffer *buf, size_t size) {
+    const char *p;
+    if (size > buf->size - buf->offset) {
+        return 0;
+    }
+    p = buf->data + buf->offset;
+    buf->offset += size;
+    return p;
+}
+
+// a heap owned by the host that survives reloads and is rolled back with the
+// state after a crash, see cr_set_arena and cr_arena_alloc. Blocks are
+// bumped from `base` and recycled by power of two size classes, the last
+// classes are unused where size_t can't hold them.
+#define CR_ARENA_CLASSES 40
+#define CR_ARENA_HEADER 16
+#define CR_ARENA_CLASS_LIMIT                                                  \
+    (sizeof(size_t) * 8 - 5 < CR_ARENA_CLASSES ? sizeof(size_t) * 8 - 5       \
+                                               : CR_ARENA_CLASSES)
+struct cr_arena {
+    char *base;
+    size_t used;
+    size_t committed;
+    void *free_lists[CR_ARENA_CLASSES];
+    int (*grow)(struct cr_arena *arena, size_t size);
+};
+
+// Allocates `size` bytes (16 bytes aligned) from the plugin arena, NULL if
+// there is no arena or it is full.
+static inline void *cr_arena_alloc(struct cr_plugin *ctx, size_t size) {
+    struct cr_arena *a = ctx->arena;
+    unsigned int c = 0;
+    size_t block;
+    char *p;
+    if (size > (size_t)-1 - CR_ARENA_HEADER) {
+        return 0;
+    }
+    while (c < CR_ARENA_CLASS_LIMIT &&
+           ((size_t)32 << c) < size + CR_ARENA_HEADER) {
+        ++c;
+    }
+    if (!a || c >= CR_ARENA_CLASS_LIMIT) {
+        return 0;
+    }
+    block = (size_t)32 << c;
+    if (a->free_lists[c]) {
+        p = (char *)a->free_lists[c];
+        a->free_lists[c] = *(void **)p;
+    } else {
+        if (a->used + block > a->committed && !a->grow(a, a->used + block)) {
+            return 0;
+        }
+        p = a->base + a->used;
+        a->used += block;
+    }
+    *(size_t *)p = c;
+    return p + CR_ARENA_HEADER;
+}
+
+// Returns a block to the plugin arena.
+static inline void cr_arena_free(struct cr_plugin *ctx, void *ptr) {
+    struct cr_arena *a = ctx->arena;
+    char *p = (char *)ptr - CR_ARENA_HEADER;
+    size_t c;
+    if (!ptr) {
+        return;
+    }
+    c = *(size_t *)p;
+    *(void **)p = a->free_lists[c];
+    a->free_lists[c] = p;
+}
+
+// a typed state variable, emitted by `CR_STATE_VAR` into the `.state_meta`
+// section of the guest and read by the host after loading it (Linux).
+struct cr_state_meta {
+    const char *name;
+    const char *type;
+    void *ptr;
+    unsigned int size;
+    unsigned int align;
 };
 
 #ifndef CR_HOST
@@ -539,6 +1161,50 @@ struct cr_plugin {
 #endif // defined(__GNUC__)
 #endif
 
+#if defined(CR_LINUX) && defined(__GNUC__)
+#if defined(__cplusplus)
+#define CR_ALIGNOF(type) alignof(type)
+#else
+#define CR_ALIGNOF(type) _Alignof(type)
+#endif
+#define CR_STATE_VAR(type, name, ...)                                        \
+    static type CR_STATE name = __VA_ARGS__;                                 \
+    static struct cr_state_meta cr_state_meta_##name __attribute__((        \
+        used, section(".state_meta"), aligned(sizeof(void *)))) = {          \
+            #name, #type, (void *)&name, sizeof(type), CR_ALIGNOF(type)}
+#else
+#define CR_STATE_VAR(type, name, ...) static type CR_STATE name = __VA_ARGS__
+#endif
+
+// places a static variable in a named data section, see cr_set_section
+#if defined(_MSC_VER)
+#define CR_SECTION(name)                                                     \
+    __pragma(section("." #name, read, write)) __declspec(allocate("." #name))
+#elif defined(CR_OSX)
+#define CR_SECTION(name) __attribute__((used, section("__DATA,__" #name)))
+#elif defined(__GNUC__)
+#define CR_SECTION(name) __attribute__((section("." #name)))
+#endif
+
+// a sequence counter the guest increments around its writes to the state,
+// odd while writing, see cr_plugin_state_find
+#define CR_STATE_SEQLOCK static volatile unsigned int CR_STATE cr_state_seq = 0
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CR_STATE_WRITE_BEGIN()                                               \
+    _InterlockedIncrement((volatile long *)&cr_state_seq)
+#define CR_STATE_WRITE_END()                                                 \
+    _InterlockedIncrement((volatile long *)&cr_state_seq)
+#else
+#define CR_STATE_WRITE_BEGIN()                                               \
+    do {                                                                     \
+        __atomic_store_n(&cr_state_seq, cr_state_seq + 1, __ATOMIC_RELAXED); \
+        __atomic_thread_fence(__ATOMIC_RELEASE);                             \
+    } while (0)
+#define CR_STATE_WRITE_END()                                                 \
+    __atomic_store_n(&cr_state_seq, cr_state_seq + 1, __ATOMIC_RELEASE)
+#endif
+
 #else // #ifndef CR_HOST
 
 // Overridable macros
@@ -593,25 +1259,75 @@ struct cr_plugin {
 #   define CR_MALLOC(size)         ::malloc(size)
 #endif
 
-#if defined(_MSC_VER)
-// we should probably push and pop this
-#   pragma warning(disable:4003) // not enough actual parameters for macro 'identifier'
+#ifndef CR_RETRY_MIN_MS
+#   define CR_RETRY_MIN_MS         10
 #endif
 
-#define CR_DO_EXPAND(x) x##1337
-#define CR_EXPAND(x) CR_DO_EXPAND(x)
+#ifndef CR_RETRY_MAX_MS
+#   define CR_RETRY_MAX_MS         1000
+#endif
 
-#if CR_EXPAND(CR_HOST) == 1337
-#define CR_OP_MODE CR_UNSAFE
-#else
+#ifndef CR_SPARSE_MIN_SIZE
+#   define CR_SPARSE_MIN_SIZE      (1024 * 1024)
+#endif
+
+#ifndef CR_HUGEPAGE_MIN_SIZE
+#   define CR_HUGEPAGE_MIN_SIZE    (4 * 1024 * 1024)
+#endif
+
+#ifndef CR_MAX_SECTIONS
+#   define CR_MAX_SECTIONS         8
+#endif
+
+#ifndef CR_COPY_THRESHOLD
+#   define CR_COPY_THRESHOLD       (64 * 1024 * 1024)
+#endif
+
+#ifndef CR_COPY_THREADS
+#   define CR_COPY_THREADS         4
+#endif
+
+#ifndef CR_LAZY_MIN_SIZE
+#   define CR_LAZY_MIN_SIZE        (1024 * 1024)
+#endif
+
+#ifndef CR_STATE_READ_TRIES
+#   define CR_STATE_READ_TRIES     1000
+#endif
+
+#if defined(_MSC_VER)
+// we should probably push and pop this
+#   pragma warning(disable:4003) // not enough actual parameters for macro 'identifier'
+#endif
+
+#define CR_DO_EXPAND(x) x##1337
+#define CR_EXPAND(x) CR_DO_EXPAND(x)
+
+#if CR_EXPAND(CR_HOST) == 1337
+#define CR_OP_MODE CR_UNSAFE
+#else
 #define CR_OP_MODE CR_HOST
 #endif
 
 #include <algorithm>
+#include <atomic>  // watcher generation counters
+#include <cctype>
 #include <chrono>  // duration for sleep
+#include <condition_variable>
+#include <cstdio>  // manifest parsing
 #include <cstring> // memcpy
+#include <deque>
+#include <memory>  // shared symbol tables
+#include <mutex>
 #include <string>
 #include <thread> // this_thread::sleep_for
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h> // non-temporal stores for large state copies
+#define CR_STREAM_STORES
+#endif
 
 #if defined(CR_WINDOWS)
 #define CR_PATH_SEPARATOR '\\'
@@ -669,13 +1385,30 @@ static std::string cr_version_path(const std::string &basepath,
     return folder + fname + ver + ext;
 }
 
+// the first sections are always .state and .bss, the others are named by
+// cr_set_section
 namespace cr_plugin_section_type {
-enum e { state, bss, count };
+enum e { state, bss, count = CR_MAX_SECTIONS };
 }
 
-namespace cr_plugin_section_version {
-enum e { backup, current, count };
-}
+// a variable in a data section, see cr_set_state_migration. Variables with
+// the same name are told apart by their order in the section (`index`).
+struct cr_symbol {
+    std::string name = {};
+    unsigned int index = 0;
+    int64_t offset = 0;
+    int64_t size = 0;
+    // fingerprint of a `CR_STATE_VAR` type, 0 for other symbols
+    uint64_t type = 0;
+};
+
+// the variables of a data section sorted by name and index, `layout` is a
+// hash of all of them. `typed` if the guest declared any with CR_STATE_VAR.
+struct cr_symbol_table {
+    std::vector<cr_symbol> symbols = {};
+    uint64_t layout = 0;
+    bool typed = false;
+};
 
 struct cr_plugin_section {
     cr_plugin_section_type::e type = {};
@@ -683,6 +1416,13 @@ struct cr_plugin_section {
     char *ptr = 0;
     int64_t size = 0;
     void *data = nullptr;
+    // pages populated when data was stored, if empty data is all valid. The
+    // first page starts `sparse_lead` bytes before the section.
+    std::vector<uint8_t> sparse = {};
+    int64_t sparse_lead = 0;
+    int64_t sparse_page = 0;
+    // variables in the section, if the image has a symbol table (Linux)
+    std::shared_ptr<const cr_symbol_table> symbols = nullptr;
 };
 
 struct cr_plugin_segment {
@@ -690,39 +1430,600 @@ struct cr_plugin_segment {
     int64_t size = 0;
 };
 
+// the loaded segments and the code and data symbols of an image, to move
+// pointers to it into another image, see cr_set_relocation (Linux)
+struct cr_image_map {
+    intptr_t bias = 0;
+    uint64_t fingerprint = 0;
+    std::vector<cr_plugin_segment> segments = {};
+    // sorted by name and index, `offset` is the symbol address in the file
+    std::vector<cr_symbol> symbols = {};
+    // the symbols sorted by address
+    std::vector<uint32_t> by_addr = {};
+};
+
+// a loaded image ready to take over a plugin, with the location of its data
+// sections (only ptr, base and size are used).
+struct cr_image {
+    std::string file = {};
+    unsigned int version = 0;
+    void *handle = nullptr;
+    cr_plugin_main_func main = nullptr;
+    uint64_t fingerprint = 0;
+    // last write time of the plugin file when copied, 0 if not a copy
+    int64_t timestamp = 0;
+    size_t size = 0;
+    cr_failure failure = CR_NONE;
+    cr_plugin_segment seg = {};
+    cr_plugin_section sections[cr_plugin_section_type::count] = {};
+    // names of the sections to find, see cr_set_section
+    std::vector<std::string> names = {};
+    // the image ran before, it came from the standby pool
+    bool reused = false;
+    // initial values of the CR_SECTION_RESET sections of a standby image
+    std::shared_ptr<const std::vector<char>>
+        initial[cr_plugin_section_type::count] = {};
+    // find the image map, see cr_set_relocation
+    bool relocate = false;
+    std::shared_ptr<cr_image_map> map = nullptr;
+};
+
+// the data sections of a version as stored during its unload, see
+// cr_set_snapshots. Buffers are kept and reused as the ring turns.
+struct cr_snapshot {
+    unsigned int version = 0;
+    // part of the state was left in a memfd, see cr_set_state_remap
+    bool partial = false;
+    cr_plugin_section sections[cr_plugin_section_type::count] = {};
+    size_t capacity[cr_plugin_section_type::count] = {};
+    // the image of the version, see cr_set_relocation
+    std::shared_ptr<const cr_image_map> map = nullptr;
+};
+
+// a state stored by an unload kept in the history, see cr_set_history. Each
+// section is kept as a delta (cr_delta_encode) to the section stored by the
+// next unload, or to zero (`whole`) if they are laid out differently.
+// Sections have no data.
+struct cr_history_entry {
+    unsigned int version = 0;
+    size_t bytes = 0;
+    cr_plugin_section sections[cr_plugin_section_type::count] = {};
+    bool whole[cr_plugin_section_type::count] = {};
+    std::vector<uint8_t> delta[cr_plugin_section_type::count] = {};
+    std::shared_ptr<const cr_image_map> map = nullptr;
+};
+
+// oldest entries first, the newest entry is a delta to the newest snapshot.
+// Entries are added by `worker`, joined before anything else touches them.
+struct cr_history {
+    size_t max_bytes = 0;
+    size_t bytes = 0;
+    std::vector<cr_history_entry> entries = {};
+    std::thread worker = {};
+};
+
+// a variable of the running version state read by the host, see
+// cr_plugin_state_find. `seq` is the guest CR_STATE_SEQLOCK, if any.
+struct cr_state_view {
+    const char *ptr = nullptr;
+    size_t size = 0;
+    unsigned int version = 0;
+    const volatile unsigned int *seq = nullptr;
+};
+
+// the start of a file the state variables are published to, followed by the
+// variables and their values, see cr_set_state_share. The magic is written
+// last.
+#define CR_STATE_SHARE_MAGIC "CRSHARE1"
+struct cr_state_share_header {
+    char magic[8];
+    uint32_t count;
+    // odd while publishing
+    std::atomic<uint32_t> seq;
+};
+
+// `size` is 0 while the variable can't be read
+struct cr_state_share_var {
+    char name[56];
+    uint64_t offset;
+    uint64_t size;
+};
+
+// the start of a state file, see cr_set_state_file. Each section data
+// follows at a page aligned offset. The magic is written last.
+#define CR_STATE_FILE_MAGIC "CRSTATE1"
+struct cr_state_file_header {
+    char magic[8];
+    uint64_t fingerprint;
+    uint32_t count;
+    struct {
+        uint64_t offset;
+        int64_t size;
+        // cr_symbol_table layout, if known
+        uint64_t layout;
+    } sections[cr_plugin_section_type::count];
+};
+
+// a page aligned range of a data section (offset from the section start)
+// backed by a memfd, see cr_set_state_remap
+struct cr_state_map {
+    int fd = -1;
+    int64_t offset = 0;
+    int64_t size = 0;
+};
+
+// internal
+// Calls `fn(from, to, populated)` for each run of pages of a stored section
+// that were (or not) populated, in section offsets up to `len`.
+template <typename F>
+static void cr_sparse_runs(const cr_plugin_section &sec, int64_t len, F &&fn) {
+    if (sec.sparse.empty()) {
+        fn(0, len, true);
+        return;
+    }
+    const int64_t count = (int64_t)sec.sparse.size();
+    const int64_t page = sec.sparse_page;
+    int64_t from = 0;
+    for (int64_t i = 0; i < count && from < len;) {
+        const bool populated = sec.sparse[i] != 0;
+        while (i < count && (sec.sparse[i] != 0) == populated) {
+            ++i;
+        }
+        const int64_t to = std::min(len, i * page - sec.sparse_lead);
+        fn(from, to, populated);
+        from = to;
+    }
+    if (from < len) {
+        fn(from, len, false);
+    }
+}
+
+// periodic snapshots of the running version state, see cr_set_checkpoint.
+// `sections` ptr and size are the live sections, data is their snapshot.
+struct cr_checkpoint {
+    unsigned int steps = 0;
+    unsigned int ms = 0;
+    unsigned int counter = 0;
+    std::chrono::steady_clock::time_point due = {};
+    bool valid = false;
+    // the next checkpoint must copy everything, soft-dirty bits were lost
+    std::atomic<bool> full{true};
+    // dirty tracking epoch when the last step started
+    unsigned int epoch = 0;
+    cr_plugin_section sections[cr_plugin_section_type::count] = {};
+    // pages dirtied before another plugin checkpoint cleared the bits
+    std::vector<uint8_t> dirty[cr_plugin_section_type::count] = {};
+};
+
+// incremental reload stages, see cr_set_reload_budget
+namespace cr_reload_stage {
+enum e { idle, copy, open, inspect, swap };
+}
+
+struct cr_watch;
+
+// internal
+// The arena of a plugin, see cr_set_arena. Its address space is reserved
+// once, so it never moves, and committed as it is used. Since the last
+// checkpoint its used pages are write protected, and the first write to each
+// one keeps a copy of it in `shadow`, so it can be rolled back.
+struct cr_arena_state {
+    cr_arena arena = {};
+    // the arena as of the last checkpoint
+    cr_arena saved = {};
+    size_t reserved = 0;
+    size_t page = 0;
+    char *shadow = nullptr;
+    // pages written since the checkpoint, for the `tracked` bytes
+    std::atomic<uint8_t> *written = nullptr;
+    std::atomic<size_t> tracked{0};
+    // pages can't be protected, checkpoints copy the arena instead
+    bool copy = false;
+    // `saved` is the arena as of the last unload, not a periodic checkpoint
+    bool saved_unload = true;
+    // the arena as of the last unload, kept by the first periodic checkpoint
+    // after it for rollbacks that can't restore the state checkpoint
+    char *unload = nullptr;
+    cr_arena unloaded = {};
+    bool unload_kept = false;
+
+    ~cr_arena_state() {
+        CR_FREE(written);
+        CR_FREE(unload);
+    }
+};
+
+// the arenas checked by the crash handler for copy-on-write faults
+static std::atomic<cr_arena_state *> cr_arena_list[64];
+
+// internal
+// A section restored on demand, see cr_set_lazy_restore. Its whole pages are
+// left inaccessible by the reload and restored from the snapshot by the crash
+// handler on their first access, or all at once by cr_lazy_finish.
+struct cr_lazy_section {
+    char *ptr = nullptr;
+    const char *data = nullptr;
+    size_t size = 0;
+    size_t page = 0;
+    // see cr_lazy_fill
+    int mem = -1;
+    // per page, 0: not restored, 1: being restored, 2: restored
+    std::atomic<uint8_t> *pages = nullptr;
+
+    ~cr_lazy_section() { CR_FREE(pages); }
+};
+
+// the sections checked by the crash handler for pages to restore
+static std::atomic<cr_lazy_section *> cr_lazy_list[64];
+// crash handlers looking at cr_lazy_list, a section taken out of it is only
+// released once none may still be using it
+static std::atomic<unsigned int> cr_lazy_users{0};
+
 // keep track of some internal state about the plugin, should not be messed
 // with by user
 struct cr_internal {
     std::string fullname = {};
     std::string temppath = {};
-    time_t timestamp = {};
+    int64_t timestamp = {};
+    uint64_t fingerprint = 0;
+    bool skip_identical = true;
+    std::string manifest = {};
+    std::chrono::steady_clock::time_point retry_at = {};
+    int retry_delay = 0;
+    cr_watch *watch = nullptr;
+    unsigned int watch_generation = 0;
+    bool staging = false;
+    cr_image staged = {};
+    std::thread stager = {};
+    std::atomic<bool> staged_ready{false};
+    int64_t reload_budget = -1;
+    cr_reload_stage::e stage = cr_reload_stage::idle;
     void *handle = nullptr;
     cr_plugin_main_func main = nullptr;
-    cr_plugin_segment seg = {};
-    cr_plugin_section data[cr_plugin_section_type::count]
-                          [cr_plugin_section_version::count] = {};
+    cr_image image = {};
+    std::vector<cr_image> standby = {};
+    unsigned int standby_depth = 0;
+    size_t standby_max_bytes = 0;
+    // sections of the running version, only ptr, base and size are used
+    cr_plugin_section sections[cr_plugin_section_type::count] = {};
+    // ring of the states stored by the last unloads, newest at head
+    std::vector<cr_snapshot> snapshots = {};
+    unsigned int snapshot_depth = 2;
+    unsigned int snapshot_head = 0;
+    unsigned int snapshot_count = 0;
+    cr_history history = {};
+    // see cr_set_state_share
+    std::string share_path = {};
+    std::vector<std::string> share_names = {};
+    std::vector<cr_state_view> share_views = {};
+    char *share = nullptr;
+    size_t share_size = 0;
+    // a sample is read here first, so one that isn't consistent is skipped
+    std::vector<char> share_sample = {};
+    bool state_remap = false;
+    bool migrate = false;
+    bool state_export = false;
+    cr_buffer buffer = {};
+    std::string state_file = {};
+    bool relocate = false;
+    std::vector<cr_plugin_segment> heap_ranges = {};
+    cr_arena_state *arena = nullptr;
+    bool lazy_restore = false;
+    cr_lazy_section *lazy[cr_plugin_section_type::count] = {};
+    // names and policies of the sections, see cr_set_section
+    std::string section_names[cr_plugin_section_type::count] = {"state",
+                                                                 "bss"};
+    cr_section_policy section_policy[cr_plugin_section_type::count] = {};
+    cr_state_map remap[cr_plugin_section_type::count] = {};
+    cr_checkpoint checkpoint = {};
     cr_mode mode = CR_SAFEST;
 };
 
 static bool cr_plugin_section_validate(cr_plugin &ctx,
-                                       cr_plugin_section_type::e type,
+                                       const cr_plugin_section &stored,
                                        intptr_t vaddr, intptr_t ptr,
                                        int64_t size);
-static void cr_plugin_sections_reload(cr_plugin &ctx,
-                                      cr_plugin_section_version::e version);
+static void cr_plugin_sections_reload(cr_plugin &ctx, cr_snapshot &snap);
 static void cr_plugin_sections_store(cr_plugin &ctx);
-static void cr_plugin_sections_backup(cr_plugin &ctx);
+static void cr_state_file_save(cr_plugin &ctx, const cr_snapshot &snap);
+static bool cr_state_file_restore(cr_plugin &ctx, const cr_image &image);
+static int cr_plugin_state_export(cr_plugin &ctx, const cr_image &image);
+static bool cr_plugin_state_import(cr_plugin &ctx);
+static void cr_snapshot_resize(cr_internal *p, unsigned int depth);
+static void cr_history_wait(cr_internal *p);
+static void cr_state_share_close(cr_internal *p);
+static void cr_state_share_publish(cr_plugin &ctx);
+static void cr_state_seq_reset(cr_internal *p);
+static void cr_history_trim(cr_history &h);
+static void *cr_pages_alloc(size_t size);
+static void cr_pages_free(void *ptr, size_t size);
+static char *cr_arena_reserve(size_t size);
+static bool cr_arena_commit(char *ptr, size_t size);
+static bool cr_arena_protect(char *ptr, size_t size, bool write);
+static void cr_arena_release(char *ptr, size_t size);
+static size_t cr_arena_page_size();
+static bool cr_arena_fault(void *addr);
+static bool cr_lazy_protect(char *ptr, size_t size);
+static void cr_lazy_fill(int mem, char *dst, const char *src, size_t size);
+static int cr_lazy_mem();
+static bool cr_lazy_fault(void *addr);
+static void cr_lazy_finish(cr_internal *p);
+static void cr_arena_checkpoint(cr_internal *p, bool unload);
+static void cr_arena_rollback(cr_internal *p, bool checkpoint);
+static void cr_arena_destroy(cr_plugin &ctx);
 static void cr_plugin_reload(cr_plugin &ctx);
 static int cr_plugin_unload(cr_plugin &ctx, bool rollback, bool close);
 static bool cr_plugin_changed(cr_plugin &ctx);
+static void cr_plugin_backoff(cr_plugin &ctx);
 static bool cr_plugin_rollback(cr_plugin &ctx);
 static int cr_plugin_main(cr_plugin &ctx, cr_op operation);
+static unsigned int cr_plugin_main_n(cr_plugin &ctx, unsigned int n,
+                                     int *results);
+static bool cr_image_sections(cr_image &image);
+static void cr_state_remap_setup(cr_plugin &ctx);
+static bool cr_state_remap_map(const cr_state_map &map, char *ptr,
+                               int64_t size);
+static void cr_state_remap_writeback(const cr_state_map &map,
+                                     const char *ptr, bool all);
+static bool cr_state_remap_read(const cr_state_map &map, void *dst);
+static void cr_state_remap_close(cr_state_map &map);
+static bool cr_pages_populated(const char *ptr, int64_t len,
+                               cr_plugin_section &sec);
+static void cr_pages_zero(char *ptr, int64_t len);
+static bool cr_pages_soft_dirty(const char *ptr, int64_t len,
+                                cr_plugin_section &sec);
+static bool cr_soft_dirty_clear();
+static bool cr_soft_dirty_probe();
+static void cr_plugin_checkpoint_register(cr_plugin &ctx);
+static void cr_plugin_checkpoint_reset(cr_plugin &ctx, bool rollback);
+static bool cr_plugin_checkpoint_restore(cr_plugin &ctx);
+static void cr_plugin_relocate(cr_plugin &ctx, const cr_image_map *sections,
+                               const cr_image_map *heap,
+                               const cr_image_map &to);
 
 void cr_set_temporary_path(cr_plugin &ctx, const std::string &path) {
     auto pimpl = (cr_internal *)ctx.p;
     pimpl->temppath = path;
 }
 
+void cr_set_skip_identical(cr_plugin &ctx, bool skip) {
+    auto pimpl = (cr_internal *)ctx.p;
+    pimpl->skip_identical = skip;
+}
+
+void cr_set_manifest(cr_plugin &ctx, const std::string &path) {
+    auto pimpl = (cr_internal *)ctx.p;
+    pimpl->manifest = path;
+}
+
+void cr_set_staging(cr_plugin &ctx, bool staging) {
+    auto pimpl = (cr_internal *)ctx.p;
+    pimpl->staging = staging;
+}
+
+void cr_set_standby(cr_plugin &ctx, unsigned int depth, size_t max_bytes) {
+    auto pimpl = (cr_internal *)ctx.p;
+    pimpl->standby_depth = depth;
+    pimpl->standby_max_bytes = max_bytes;
+}
+
+void cr_set_reload_budget(cr_plugin &ctx, int64_t microseconds) {
+    auto pimpl = (cr_internal *)ctx.p;
+    pimpl->reload_budget = microseconds;
+}
+
+void cr_set_state_remap(cr_plugin &ctx, bool remap) {
+    auto pimpl = (cr_internal *)ctx.p;
+    pimpl->state_remap = remap;
+}
+
+void cr_set_checkpoint(cr_plugin &ctx, unsigned int steps, unsigned int ms) {
+    auto pimpl = (cr_internal *)ctx.p;
+    pimpl->checkpoint.steps = steps;
+    pimpl->checkpoint.ms = ms;
+    cr_plugin_checkpoint_register(ctx);
+}
+
+void cr_set_state_export(cr_plugin &ctx, bool enable) {
+    auto pimpl = (cr_internal *)ctx.p;
+    pimpl->state_export = enable;
+}
+
+void cr_set_state_migration(cr_plugin &ctx, bool migrate) {
+    auto pimpl = (cr_internal *)ctx.p;
+    pimpl->migrate = migrate;
+}
+
+void cr_set_snapshots(cr_plugin &ctx, unsigned int depth) {
+    auto pimpl = (cr_internal *)ctx.p;
+    cr_snapshot_resize(pimpl, std::max(depth, 1u));
+}
+
+void cr_set_history(cr_plugin &ctx, size_t max_bytes) {
+    auto pimpl = (cr_internal *)ctx.p;
+    cr_history_wait(pimpl);
+    pimpl->history.max_bytes = max_bytes;
+    cr_history_trim(pimpl->history);
+}
+
+bool cr_set_state_share(cr_plugin &ctx, const std::string &path,
+                        const std::vector<std::string> &names) {
+    auto pimpl = (cr_internal *)ctx.p;
+    for (const auto &name : names) {
+        if (name.size() >= sizeof(cr_state_share_var::name)) {
+            return false;
+        }
+    }
+    cr_state_share_close(pimpl);
+    pimpl->share_path = path;
+    pimpl->share_names = path.empty() ? std::vector<std::string>() : names;
+    return true;
+}
+
+void cr_set_state_file(cr_plugin &ctx, const std::string &path) {
+    auto pimpl = (cr_internal *)ctx.p;
+    pimpl->state_file = path;
+}
+
+void cr_set_relocation(cr_plugin &ctx, bool relocate) {
+    auto pimpl = (cr_internal *)ctx.p;
+    pimpl->relocate = relocate;
+}
+
+void cr_set_lazy_restore(cr_plugin &ctx, bool lazy) {
+    auto pimpl = (cr_internal *)ctx.p;
+    pimpl->lazy_restore = lazy;
+}
+
+void cr_register_heap_range(cr_plugin &ctx, void *ptr, size_t size) {
+    auto pimpl = (cr_internal *)ctx.p;
+    cr_plugin_segment range;
+    range.ptr = (char *)ptr;
+    range.size = (int64_t)size;
+    pimpl->heap_ranges.push_back(range);
+}
+
+void cr_unregister_heap_range(cr_plugin &ctx, void *ptr) {
+    auto pimpl = (cr_internal *)ctx.p;
+    auto &ranges = pimpl->heap_ranges;
+    ranges.erase(std::remove_if(ranges.begin(), ranges.end(),
+                                [&](const cr_plugin_segment &r) {
+        return r.ptr == ptr;
+    }), ranges.end());
+}
+
+// internal
+// Commits the arena (and its shadow) up to `size`, called by cr_arena_alloc.
+static int cr_arena_grow(cr_arena *arena, size_t size) {
+    cr_arena_state *a = nullptr;
+    for (auto &slot : cr_arena_list) {
+        auto cur = slot.load(std::memory_order_acquire);
+        if (cur && &cur->arena == arena) {
+            a = cur;
+        }
+    }
+    const size_t step = std::max(a ? a->page : 0, (size_t)1024 * 1024);
+    const size_t committed = (size + step - 1) / step * step;
+    if (!a || size > a->reserved) {
+        return 0;
+    }
+    const size_t from = arena->committed;
+    const size_t to = std::min(committed, a->reserved);
+    if (!cr_arena_commit(arena->base + from, to - from) ||
+        !cr_arena_commit(a->shadow + from, to - from)) {
+        return 0;
+    }
+    arena->committed = to;
+    return 1;
+}
+
+bool cr_set_arena(cr_plugin &ctx, size_t size) {
+    auto pimpl = (cr_internal *)ctx.p;
+    if (pimpl->arena || !size) {
+        return false;
+    }
+    auto mem = CR_MALLOC(sizeof(cr_arena_state));
+    if (!mem) {
+        CR_ERROR("Couldn't create arena\n");
+        return false;
+    }
+    auto a = new(mem) cr_arena_state;
+    a->page = cr_arena_page_size();
+    const size_t step = std::max(a->page, (size_t)1024 * 1024);
+    a->reserved = (size + step - 1) / step * step;
+    a->arena.base = cr_arena_reserve(a->reserved);
+    a->shadow = cr_arena_reserve(a->reserved);
+    const size_t pages = a->reserved / a->page;
+    a->written = (std::atomic<uint8_t> *)CR_MALLOC(pages);
+    for (size_t n = 0; a->written && n < pages; ++n) {
+        new(&a->written[n]) std::atomic<uint8_t>(0);
+    }
+    a->arena.grow = cr_arena_grow;
+    bool listed = false;
+    for (auto &slot : cr_arena_list) {
+        cr_arena_state *none = nullptr;
+        if (a->arena.base && a->shadow && a->written &&
+            slot.compare_exchange_strong(none, a)) {
+            listed = true;
+            break;
+        }
+    }
+    if (!listed) {
+        CR_ERROR("Couldn't create arena\n");
+        cr_arena_release(a->arena.base, a->reserved);
+        cr_arena_release(a->shadow, a->reserved);
+        a->~cr_arena_state();
+        CR_FREE(a);
+        return false;
+    }
+    pimpl->arena = a;
+    ctx.arena = &a->arena;
+    cr_arena_checkpoint(pimpl, true);
+    return true;
+}
+
+bool cr_set_section(cr_plugin &ctx, const char *name,
+                    cr_section_policy policy) {
+    CR_ASSERT(name && *name);
+    auto pimpl = (cr_internal *)ctx.p;
+    int slot = -1;
+    for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+        const auto &cur = pimpl->section_names[i];
+        if (cur == name) {
+            slot = i;
+            break;
+        }
+        if (cur.empty() && slot < 0) {
+            slot = i;
+        }
+    }
+    if (slot < 0) {
+        CR_ERROR("Too many sections, see CR_MAX_SECTIONS\n");
+        return false;
+    }
+    pimpl->section_names[slot] = name;
+    pimpl->section_policy[slot] = policy;
+    return true;
+}
+
+// internal
+// A fast non-cryptographic 64bit hash (MurmurHash64A), used to fingerprint
+// images when they don't carry a build id.
+static uint64_t cr_hash(const void *data, size_t len, uint64_t seed = 0) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = seed ^ (len * m);
+
+    auto ptr = (const unsigned char *)data;
+    const size_t words = len / sizeof(uint64_t);
+    for (size_t i = 0; i < words; ++i) {
+        uint64_t k;
+        std::memcpy(&k, ptr + i * sizeof(uint64_t), sizeof(k));
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    ptr += words * sizeof(uint64_t);
+    switch (len & 7) {
+    case 7: h ^= uint64_t(ptr[6]) << 48; // fallthrough
+    case 6: h ^= uint64_t(ptr[5]) << 40; // fallthrough
+    case 5: h ^= uint64_t(ptr[4]) << 32; // fallthrough
+    case 4: h ^= uint64_t(ptr[3]) << 24; // fallthrough
+    case 3: h ^= uint64_t(ptr[2]) << 16; // fallthrough
+    case 2: h ^= uint64_t(ptr[1]) << 8;  // fallthrough
+    case 1: h ^= uint64_t(ptr[0]);
+            h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
 #if defined(CR_WINDOWS)
 
 // clang-format off
@@ -760,7 +2061,8 @@ static std::wstring cr_utf8_to_wstring(const std::string &str) {
 #   define CR_WINDOWS_ConvertPath(_newpath, _path)     const std::string &_newpath = _path
 #endif  // UNICODE
 
-static time_t cr_last_write_time(const std::string &path) {
+// Returns the last write time in nanoseconds since epoch.
+static int64_t cr_last_write_time(const std::string &path) {
     CR_WINDOWS_ConvertPath(_path, path);
     WIN32_FILE_ATTRIBUTE_DATA fad;
     if (!GetFileAttributesEx(_path.c_str(), GetFileExInfoStandard, &fad)) {
@@ -775,7 +2077,46 @@ static time_t cr_last_write_time(const std::string &path) {
     time.HighPart = fad.ftLastWriteTime.dwHighDateTime;
     time.LowPart = fad.ftLastWriteTime.dwLowDateTime;
 
-    return static_cast<time_t>(time.QuadPart / 10000000 - 11644473600LL);
+    // 100ns intervals since 1601-01-01
+    return static_cast<int64_t>(time.QuadPart - 116444736000000000LL) * 100;
+}
+
+// The linker keeps the image locked while writing it, so if we can see it it
+// is complete.
+static bool cr_image_complete(const std::string &path) {
+    (void)path;
+    return true;
+}
+
+// Fingerprint of an image file. PE files don't carry a build id that would
+// be reliable for this, so we hash its content.
+static uint64_t cr_image_fingerprint(const std::string &path) {
+    CR_WINDOWS_ConvertPath(_path, path);
+    HANDLE fp = CreateFile(_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (fp == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+
+    uint64_t result = 0;
+    LARGE_INTEGER size;
+    HANDLE filemap = nullptr;
+    LPVOID mem = nullptr;
+    if (GetFileSizeEx(fp, &size) && size.QuadPart > 0) {
+        filemap = CreateFileMapping(fp, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    }
+    if (filemap != nullptr) {
+        mem = MapViewOfFile(filemap, FILE_MAP_READ, 0, 0, 0);
+    }
+    if (mem != nullptr) {
+        result = cr_hash(mem, (size_t)size.QuadPart);
+        UnmapViewOfFile(mem);
+    }
+    if (filemap != nullptr) {
+        CloseHandle(filemap);
+    }
+    CloseHandle(fp);
+    return result;
 }
 
 static bool cr_exists(const std::string &path) {
@@ -794,6 +2135,72 @@ static void cr_del(const std::string& path) {
     DeleteFile(_path.c_str());
 }
 
+// Replaces `to` with `from`, readers of the old `to` keep their copy.
+static bool cr_rename(const std::string &from, const std::string &to) {
+    CR_WINDOWS_ConvertPath(_from, from);
+    CR_WINDOWS_ConvertPath(_to, to);
+    return MoveFileEx(_from.c_str(), _to.c_str(), MOVEFILE_REPLACE_EXISTING)
+               ? true
+               : false;
+}
+
+static size_t cr_file_size(const std::string &path) {
+    CR_WINDOWS_ConvertPath(_path, path);
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+    if (!GetFileAttributesEx(_path.c_str(), GetFileExInfoStandard, &fad)) {
+        return 0;
+    }
+    return ((size_t)fad.nFileSizeHigh << 32) | fad.nFileSizeLow;
+}
+
+// Maps a file to write, it is created (or truncated) with `size` zeroes.
+static void *cr_file_map_write(const std::string &path, size_t size) {
+    CR_WINDOWS_ConvertPath(_path, path);
+    HANDLE fp = CreateFile(_path.c_str(), GENERIC_READ | GENERIC_WRITE,
+                           FILE_SHARE_READ, nullptr, CREATE_ALWAYS,
+                           FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (fp == INVALID_HANDLE_VALUE) {
+        return nullptr;
+    }
+    LPVOID mem = nullptr;
+    HANDLE filemap =
+        CreateFileMapping(fp, nullptr, PAGE_READWRITE,
+                          (DWORD)((uint64_t)size >> 32), (DWORD)size, nullptr);
+    if (filemap != nullptr) {
+        mem = MapViewOfFile(filemap, FILE_MAP_WRITE, 0, 0, size);
+        CloseHandle(filemap);
+    }
+    CloseHandle(fp);
+    return mem;
+}
+
+// Maps a file to read, `size` gets its size.
+static const void *cr_file_map_read(const std::string &path, size_t &size) {
+    CR_WINDOWS_ConvertPath(_path, path);
+    HANDLE fp = CreateFile(_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (fp == INVALID_HANDLE_VALUE) {
+        return nullptr;
+    }
+    LARGE_INTEGER len;
+    HANDLE filemap = nullptr;
+    LPVOID mem = nullptr;
+    if (GetFileSizeEx(fp, &len) && len.QuadPart > 0) {
+        filemap = CreateFileMapping(fp, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    }
+    if (filemap != nullptr) {
+        mem = MapViewOfFile(filemap, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(filemap);
+    }
+    CloseHandle(fp);
+    size = mem ? (size_t)len.QuadPart : 0;
+    return mem;
+}
+
+static void cr_file_unmap(const void *ptr, size_t) {
+    UnmapViewOfFile(ptr);
+}
+
 // If using Microsoft Visual C/C++ compiler we need to do some workaround the
 // fact that the compiled binary has a fullpath to the PDB hardcoded inside
 // it. This causes a lot of headaches when trying compile while debugging as
@@ -1065,72 +2472,51 @@ bool static cr_pdb_process(const std::string &desination) {
 }
 #endif // _MSC_VER
 
-static void cr_pe_section_save(cr_plugin &ctx, cr_plugin_section_type::e type,
-                               int64_t vaddr, int64_t base,
-                               IMAGE_SECTION_HEADER &shdr) {
-    const auto version = cr_plugin_section_version::current;
-    auto p = (cr_internal *)ctx.p;
-    auto data = &p->data[type][version];
-    const size_t old_size = data->size;
-    data->base = base;
-    data->ptr = (char *)vaddr;
-    data->size = shdr.SizeOfRawData;
-    data->data = CR_REALLOC(data->data, shdr.SizeOfRawData);
-    if (old_size < shdr.SizeOfRawData) {
-        memset((char *)data->data + old_size, '\0',
-               shdr.SizeOfRawData - old_size);
-    }
-}
-
-static bool cr_plugin_validate_sections(cr_plugin &ctx, so_handle handle,
-                                        const std::string &imagefile,
-                                        bool rollback) {
-    (void)imagefile;
-    CR_ASSERT(handle);
-    auto p = (cr_internal *)ctx.p;
-    if (p->mode == CR_DISABLE) {
-        return true;
-    }
-    auto ntHeaders = ImageNtHeader(handle);
+// Finds the image data sections (.state, .bss and the ones named by
+// cr_set_section, up to 7 characters) in the loaded image.
+static bool cr_image_sections(cr_image &image) {
+    CR_ASSERT(image.handle);
+    auto ntHeaders = ImageNtHeader(image.handle);
     auto base = ntHeaders->OptionalHeader.ImageBase;
     auto sectionHeaders = (IMAGE_SECTION_HEADER *)(ntHeaders + 1);
-    bool result = true;
     for (int i = 0; i < ntHeaders->FileHeader.NumberOfSections; ++i) {
         auto sectionHeader = sectionHeaders[i];
-        const int64_t size = sectionHeader.SizeOfRawData;
+        auto type = cr_plugin_section_type::count;
         if (!strcmp((const char *)sectionHeader.Name, ".state")) {
-            if (ctx.version || rollback) {
-                result &= cr_plugin_section_validate(
-                    ctx, cr_plugin_section_type::state,
-                    base + sectionHeader.VirtualAddress, base, size);
-            }
-            if (result) {
-                auto sec = cr_plugin_section_type::state;
-                cr_pe_section_save(ctx, sec,
-                                   base + sectionHeader.VirtualAddress, base,
-                                   sectionHeader);
-            }
+            type = cr_plugin_section_type::state;
         } else if (!strcmp((const char *)sectionHeader.Name, ".bss")) {
-            if (ctx.version || rollback) {
-                result &= cr_plugin_section_validate(
-                    ctx, cr_plugin_section_type::bss,
-                    base + sectionHeader.VirtualAddress, base, size);
+            type = cr_plugin_section_type::bss;
+        } else {
+            for (size_t n = 2; n < image.names.size(); ++n) {
+                const auto name = "." + image.names[n];
+                if (!image.names[n].empty() &&
+                    !strncmp((const char *)sectionHeader.Name, name.c_str(),
+                             IMAGE_SIZEOF_SHORT_NAME)) {
+                    type = (cr_plugin_section_type::e)n;
+                    break;
+                }
             }
-            if (result) {
-                auto sec = cr_plugin_section_type::bss;
-                cr_pe_section_save(ctx, sec,
-                                   base + sectionHeader.VirtualAddress, base,
-                                   sectionHeader);
+            if (type == cr_plugin_section_type::count) {
+                continue;
             }
         }
+        auto sec = &image.sections[type];
+        sec->base = base;
+        sec->ptr = (char *)(base + sectionHeader.VirtualAddress);
+        sec->size = sectionHeader.SizeOfRawData;
     }
-    return result;
+    return true;
+}
+
+static void cr_so_close(void *handle) {
+    CR_ASSERT(handle);
+    FreeLibrary((HMODULE)handle);
 }
 
 static void cr_so_unload(cr_plugin &ctx) {
     auto p = (cr_internal *)ctx.p;
     CR_ASSERT(p->handle);
-    FreeLibrary((HMODULE)p->handle);
+    cr_so_close(p->handle);
 }
 
 static so_handle cr_so_load(const std::string &filename) {
@@ -1152,19 +2538,88 @@ static cr_plugin_main_func cr_so_symbol(so_handle handle) {
     return new_main;
 }
 
-#ifdef __MINGW32__
-#include <setjmp.h>
-#include <signal.h>
+// internal
+// Page allocated buffers for state snapshots, committed on first touch.
+static void *cr_pages_alloc(size_t size) {
+    return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT,
+                        PAGE_READWRITE);
+}
 
-static jmp_buf env;
-static void cr_signal_handler(int sig) {
-    __builtin_longjmp(env, 1);
+static void cr_pages_free(void *ptr, size_t size) {
+    (void)size;
+    if (ptr) {
+        VirtualFree(ptr, 0, MEM_RELEASE);
+    }
 }
 
-static cr_failure cr_signal_to_failure(int sig) {
-    switch (sig) {
-    case 0:
-        return CR_NONE;
+// Arena address space, see cr_set_arena. Pages are not write protected as
+// there is no copy-on-write fault handling, checkpoints copy the arena.
+static char *cr_arena_reserve(size_t size) {
+    return (char *)VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+static bool cr_arena_commit(char *ptr, size_t size) {
+    return !size || VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE);
+}
+
+static bool cr_arena_protect(char *, size_t, bool) {
+    return false;
+}
+
+static void cr_arena_release(char *ptr, size_t size) {
+    cr_pages_free(ptr, size);
+}
+
+static size_t cr_arena_page_size() {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+}
+
+// Sections are always restored eagerly, see cr_set_lazy_restore.
+static bool cr_lazy_protect(char *, size_t) {
+    return false;
+}
+
+static void cr_lazy_fill(int, char *dst, const char *src, size_t size) {
+    std::memcpy(dst, src, size);
+}
+
+static int cr_lazy_mem() {
+    return -1;
+}
+
+#ifdef __MINGW32__
+#include <setjmp.h>
+#include <signal.h>
+
+// internal
+// Crash recovery context of a protected call, see the unix version.
+struct cr_protect_frame {
+    jmp_buf env;
+    int sig = 0;
+    cr_plugin *ctx = nullptr;
+    cr_protect_frame *prev = nullptr;
+};
+
+static thread_local cr_protect_frame *cr_frame = nullptr;
+
+static void cr_signal_handler(int sig) {
+    auto frame = cr_frame;
+    if (!frame) {
+        // not within a protected call in this thread, crash as usual
+        signal(sig, SIG_DFL);
+        raise(sig);
+        return;
+    }
+    frame->sig = sig;
+    __builtin_longjmp(frame->env, 1);
+}
+
+static cr_failure cr_signal_to_failure(int sig) {
+    switch (sig) {
+    case 0:
+        return CR_NONE;
     case SIGILL:
         return CR_ILLEGAL;
     case SIGSEGV:
@@ -1230,22 +2685,90 @@ static int cr_plugin_main(cr_plugin &ctx, cr_op operation) {
     #pragma clang diagnostic pop
     #endif
 #else
-    if (int sig = __builtin_setjmp(env)) {
+    cr_protect_frame frame;
+    frame.ctx = &ctx;
+    frame.prev = cr_frame;
+    cr_frame = &frame;
+    if (__builtin_setjmp(frame.env)) {
+        cr_frame = frame.prev;
         ctx.version = ctx.last_working_version;
-        ctx.failure = cr_signal_to_failure(sig);
-        CR_LOG("1 FAILURE: %d (CR: %d)\n", sig, ctx.failure);
+        ctx.failure = cr_signal_to_failure(frame.sig);
+        CR_LOG("1 FAILURE: %d (CR: %d)\n", frame.sig, ctx.failure);
         return -1;
-    } else {
-        CR_ASSERT(p);
-        if (p->main) {
-            return p->main(&ctx, operation);
-        }
     }
+    CR_ASSERT(p);
+    int r = -1;
+    if (p->main) {
+        r = p->main(&ctx, operation);
+    }
+    cr_frame = frame.prev;
+    return r;
 #endif
 
     return -1;
 }
 
+// internal
+// Calls `CR_STEP` up to `n` times under a single protection frame, stopping
+// at the first negative result. Returns the number of completed iterations,
+// the result of the failed one (if any) is stored in `results` too.
+static unsigned int cr_plugin_main_n(cr_plugin &ctx, unsigned int n,
+                                     int *results) {
+    auto p = (cr_internal *)ctx.p;
+    CR_ASSERT(p && p->main);
+    volatile unsigned int i = 0;
+#if !defined(__MINGW32__)
+    #if defined(__clang__)
+    #pragma clang diagnostic push
+    #pragma clang diagnostic ignored "-Wlanguage-extension-token"
+    #endif
+        __try {
+                for (; i < n; i = i + 1) {
+                    int r = p->main(&ctx, CR_STEP);
+                    if (results) {
+                        results[i] = r;
+                    }
+                    if (r < 0) {
+                        break;
+                    }
+                }
+            } __except (cr_seh_filter(ctx, GetExceptionCode())) {
+                if (results) {
+                    results[i] = -1;
+                }
+            }
+    #if defined(__clang__)
+    #pragma clang diagnostic pop
+    #endif
+#else
+    cr_protect_frame frame;
+    frame.ctx = &ctx;
+    frame.prev = cr_frame;
+    cr_frame = &frame;
+    if (__builtin_setjmp(frame.env)) {
+        cr_frame = frame.prev;
+        ctx.version = ctx.last_working_version;
+        ctx.failure = cr_signal_to_failure(frame.sig);
+        CR_LOG("1 FAILURE: %d (CR: %d) at %u\n", frame.sig, ctx.failure, i);
+        if (results) {
+            results[i] = -1;
+        }
+        return i;
+    }
+    for (; i < n; i = i + 1) {
+        int r = p->main(&ctx, CR_STEP);
+        if (results) {
+            results[i] = r;
+        }
+        if (r < 0) {
+            break;
+        }
+    }
+    cr_frame = frame.prev;
+#endif
+    return i;
+}
+
 #endif // CR_WINDOWS
 
 #if defined(CR_LINUX) || defined(CR_OSX)
@@ -1254,6 +2777,7 @@ static int cr_plugin_main(cr_plugin &ctx, cr_op operation) {
 #include <cstring>
 #include <dlfcn.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -1268,7 +2792,8 @@ static int cr_plugin_main(cr_plugin &ctx, cr_op operation) {
 
 using so_handle = void *;
 
-static time_t cr_last_write_time(const std::string &path) {
+// Returns the last write time in nanoseconds since epoch.
+static int64_t cr_last_write_time(const std::string &path) {
     struct stat stats;
     if (stat(path.c_str(), &stats) == -1) {
         return -1;
@@ -1279,10 +2804,64 @@ static time_t cr_last_write_time(const std::string &path) {
     }
 
 #if defined(CR_OSX)
-    return stats.st_mtime;
+    const auto &ts = stats.st_mtimespec;
 #else
-    return stats.st_mtim.tv_sec;
+    const auto &ts = stats.st_mtim;
 #endif
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static bool cr_image_build_id(const char *p, size_t len, uint64_t &id);
+static bool cr_image_headers_complete(const char *p, size_t len);
+
+// unix,internal
+// Checks that an image is completely written by validating that all its
+// headers are in the file bounds, the file size is set before the content is
+// written so this needs to look into the headers pointing to the file end.
+static bool cr_image_complete(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    bool result = false;
+    struct stat stats;
+    if (fstat(fd, &stats) == 0 && stats.st_size > 0) {
+        const size_t len = (size_t)stats.st_size;
+        auto p = (char *)mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            result = cr_image_headers_complete(p, len);
+            munmap(p, len);
+        }
+    }
+    close(fd);
+    return result;
+}
+
+// unix,internal
+// Fingerprint of an image file, the build id embedded by the linker is used
+// when available (ELF .note.gnu.build-id or Mach-O LC_UUID), otherwise we
+// hash the whole image content.
+static uint64_t cr_image_fingerprint(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+
+    uint64_t result = 0;
+    struct stat stats;
+    if (fstat(fd, &stats) == 0 && stats.st_size > 0) {
+        const size_t len = (size_t)stats.st_size;
+        auto p = (char *)mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            if (!cr_image_build_id(p, len, result)) {
+                result = cr_hash(p, len);
+            }
+            munmap(p, len);
+        }
+    }
+    close(fd);
+    return result;
 }
 
 static bool cr_exists(const std::string &path) {
@@ -1318,6 +2897,58 @@ static void cr_del(const std::string& path) {
     unlink(path.c_str());
 }
 
+// Replaces `to` with `from`, readers of the old `to` keep their copy.
+static bool cr_rename(const std::string &from, const std::string &to) {
+    return rename(from.c_str(), to.c_str()) == 0;
+}
+
+static size_t cr_file_size(const std::string &path) {
+    struct stat stats;
+    if (stat(path.c_str(), &stats) == -1) {
+        return 0;
+    }
+    return static_cast<size_t>(stats.st_size);
+}
+
+// Maps a file to write, it is created (or truncated) with `size` zeroes. It
+// may also be an inherited memfd (`/proc/self/fd/N`).
+static void *cr_file_map_write(const std::string &path, size_t size) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return nullptr;
+    }
+    void *mem = MAP_FAILED;
+    if (!ftruncate(fd, 0) && !ftruncate(fd, size)) {
+        mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    return mem == MAP_FAILED ? nullptr : mem;
+}
+
+// Maps a file to read, `size` gets its size.
+static const void *cr_file_map_read(const std::string &path, size_t &size) {
+    size = 0;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat stats;
+    void *mem = MAP_FAILED;
+    if (!fstat(fd, &stats) && stats.st_size > 0) {
+        mem = mmap(0, stats.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mem == MAP_FAILED) {
+        return nullptr;
+    }
+    size = static_cast<size_t>(stats.st_size);
+    return mem;
+}
+
+static void cr_file_unmap(const void *ptr, size_t size) {
+    munmap((void *)ptr, size);
+}
+
 // unix,internal
 // a helper function to validate that an area of memory is empty
 // this is used to validate that the data in the .bss haven't changed
@@ -1327,102 +2958,387 @@ bool cr_is_empty(const void *const buf, int64_t len) {
         return true;
     }
 
-    bool r = false;
-    auto c = (const char *const)buf;
-    for (int i = 0; i < len; ++i) {
-        r |= c[i];
+    auto c = (const unsigned char *)buf;
+    const auto word = (int64_t)sizeof(uint64_t);
+    for (; len > 0 && ((uintptr_t)c & (word - 1)); ++c, --len) {
+        if (*c) {
+            return false;
+        }
+    }
+
+    // blocks of 8 words or-ed together, vectorized by the compiler
+    for (; len >= 8 * word; c += 8 * word, len -= 8 * word) {
+        uint64_t w[8];
+        std::memcpy(w, c, sizeof(w));
+        uint64_t r = 0;
+        for (int i = 0; i < 8; ++i) {
+            r |= w[i];
+        }
+        if (r) {
+            return false;
+        }
+    }
+
+    for (; len > 0; ++c, --len) {
+        if (*c) {
+            return false;
+        }
     }
-    return !r;
+    return true;
 }
 
 #if defined(CR_LINUX)
+#include <cerrno>
+#include <cxxabi.h>
 #include <elf.h>
 #include <link.h>
 
-static size_t cr_file_size(const std::string &path) {
-    struct stat stats;
-    if (stat(path.c_str(), &stats) == -1) {
-        return 0;
+// linux,internal
+// Finds the GNU build id note, every access is bounds checked as the image may
+// be incomplete or still being written.
+static bool cr_image_build_id(const char *p, size_t len, uint64_t &id) {
+    auto ehdr = (const ElfW(Ehdr) *)p;
+    if (len < sizeof(ElfW(Ehdr)) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG)) {
+        return false;
     }
-    return static_cast<size_t>(stats.st_size);
+
+    const size_t shsize = (size_t)ehdr->e_shnum * sizeof(ElfW(Shdr));
+    if (ehdr->e_shoff == 0 || ehdr->e_shoff + shsize > len) {
+        return false;
+    }
+
+    auto shdr = (const ElfW(Shdr) *)(p + ehdr->e_shoff);
+    for (int i = 0; i < ehdr->e_shnum; ++i) {
+        if (shdr[i].sh_type != SHT_NOTE ||
+            shdr[i].sh_offset + shdr[i].sh_size > len) {
+            continue;
+        }
+
+        const char *note = p + shdr[i].sh_offset;
+        const char *end = note + shdr[i].sh_size;
+        while (note + sizeof(ElfW(Nhdr)) <= end) {
+            auto nhdr = (const ElfW(Nhdr) *)note;
+            const char *name = note + sizeof(ElfW(Nhdr));
+            const char *desc = name + ((nhdr->n_namesz + 3) & ~3u);
+            note = desc + ((nhdr->n_descsz + 3) & ~3u);
+            if (note > end) {
+                break;
+            }
+            if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+                !memcmp(name, "GNU", 4) && nhdr->n_descsz) {
+                id = cr_hash(desc, nhdr->n_descsz);
+                return true;
+            }
+        }
+    }
+    return false;
 }
 
-// unix,internal
-// save section information to be used during load/unload when copying
-// around global state (from .bss and .state binary sections).
-// vaddr = is the in memory loaded address of the segment-section
-// base = is the in file section address
-// shdr = the in file section header
-template <class H>
-void cr_elf_section_save(cr_plugin &ctx, cr_plugin_section_type::e type,
-                         int64_t vaddr, int64_t base, H shdr) {
-    const auto version = cr_plugin_section_version::current;
-    auto p = (cr_internal *)ctx.p;
-    auto data = &p->data[type][version];
-    const size_t old_size = data->size;
-    data->base = base;
-    data->ptr = (char *)vaddr;
-    data->size = shdr.sh_size;
-    data->data = CR_REALLOC(data->data, shdr.sh_size);
-    if (old_size < shdr.sh_size) {
-        memset((char *)data->data + old_size, '\0', shdr.sh_size - old_size);
+// linux,internal
+// The section header table is the last thing in the file, so a valid header
+// and a complete, sane section table means the linker is done with it.
+static bool cr_image_headers_complete(const char *p, size_t len) {
+    auto ehdr = (const ElfW(Ehdr) *)p;
+    if (len < sizeof(ElfW(Ehdr)) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG)) {
+        return false;
+    }
+
+    const size_t shsize = (size_t)ehdr->e_shnum * sizeof(ElfW(Shdr));
+    if (ehdr->e_shoff == 0 || ehdr->e_shnum == 0 ||
+        ehdr->e_shentsize != sizeof(ElfW(Shdr)) ||
+        ehdr->e_shoff + shsize > len || ehdr->e_shstrndx >= ehdr->e_shnum) {
+        return false;
     }
+
+    auto shdr = (const ElfW(Shdr) *)(p + ehdr->e_shoff);
+    for (int i = 0; i < ehdr->e_shnum; ++i) {
+        if (shdr[i].sh_type != SHT_NOBITS &&
+            shdr[i].sh_offset + shdr[i].sh_size > len) {
+            return false;
+        }
+    }
+    return shdr[ehdr->e_shstrndx].sh_type == SHT_STRTAB;
 }
 
 // unix,internal
-// validates that the sections being loaded are compatible with the previous
-// one accordingly with desired `cr_mode` mode. If this is a first load, a
-// validation is not necessary. At the same time it will initialize the
-// section tracking information and alloc the required temporary space to use
-// during unload.
+// find the in memory location of the sections used to keep global state
+// (.bss and .state binary sections, and the ones named by cr_set_section).
+// base = is the loaded address of the end of the data segment file content
+// bias = is the load bias of the image
+// shdr = the in file section headers
 template <class H>
-bool cr_elf_validate_sections(cr_plugin &ctx, bool rollback, H shdr, int shnum,
-                              const char *sh_strtab_p) {
+void cr_elf_find_sections(cr_image &image, H shdr, int shnum,
+                          const char *sh_strtab_p, intptr_t bias) {
     CR_ASSERT(sh_strtab_p);
-    auto p = (cr_internal *)ctx.p;
-    bool result = true;
     for (int i = 0; i < shnum; ++i) {
         const char *name = sh_strtab_p + shdr[i].sh_name;
         auto sectionHeader = shdr[i];
         const int64_t addr = sectionHeader.sh_addr;
         const int64_t size = sectionHeader.sh_size;
-        const int64_t base = (intptr_t)p->seg.ptr + p->seg.size;
+        const int64_t base = (intptr_t)image.seg.ptr + image.seg.size;
+        auto sec = &image.sections[cr_plugin_section_type::state];
         if (!strcmp(name, ".state")) {
-            const int64_t vaddr = base - size;
-            auto sec = cr_plugin_section_type::state;
-            if (ctx.version || rollback) {
-                result &=
-                    cr_plugin_section_validate(ctx, sec, vaddr, addr, size);
-            }
-            if (result) {
-                cr_elf_section_save(ctx, sec, vaddr, addr, sectionHeader);
-            }
+            // named sections may be laid out after it in the segment
+            sec->ptr = (char *)(bias + addr);
         } else if (!strcmp(name, ".bss")) {
             // .bss goes past segment filesz, but it may be just padding
-            const int64_t vaddr = base;
-            auto sec = cr_plugin_section_type::bss;
-            if (ctx.version || rollback) {
-                // this is kinda hack to skip bss validation if our data is zero
-                // this means we don't care scrapping it, and helps skipping
-                // validating a .bss that serves only as padding in the segment.
-                if (!cr_is_empty(p->data[sec][0].data, p->data[sec][0].size)) {
-                    result &=
-                        cr_plugin_section_validate(ctx, sec, vaddr, addr, size);
+            sec = &image.sections[cr_plugin_section_type::bss];
+            sec->ptr = (char *)base;
+        } else {
+            sec = nullptr;
+            for (size_t n = 2; n < image.names.size() && !sec; ++n) {
+                if (!image.names[n].empty() && name[0] == '.' &&
+                    image.names[n] == name + 1 &&
+                    (sectionHeader.sh_flags & SHF_WRITE)) {
+                    sec = &image.sections[n];
+                    sec->ptr = (char *)(bias + addr);
                 }
             }
-            if (result) {
-                cr_elf_section_save(ctx, sec, vaddr, addr, sectionHeader);
+            if (!sec) {
+                continue;
             }
         }
+        sec->base = addr;
+        sec->size = size;
     }
-    return result;
+}
+
+// linux,internal
+// GCC numbers function static variables of C code (`name.N`), and these
+// numbers change as functions are added or removed.
+static std::string cr_symbol_name(const char *name, size_t len) {
+    size_t end = len;
+    while (end && isdigit((unsigned char)name[end - 1])) {
+        --end;
+    }
+    if (end && end < len && name[end - 1] == '.') {
+        len = end - 1;
+    }
+    return std::string(name, len);
+}
+
+// linux,internal
+// Checks the C++ name of a variable as spelled in the guest source, i.e.
+// `_ZL5count` is `count`, and a function static is `function(int)::name`.
+static bool cr_symbol_demangled_is(const cr_symbol &s, const char *name) {
+    if (s.name.compare(0, 2, "_Z")) {
+        return false;
+    }
+    int status = 0;
+    char *demangled =
+        abi::__cxa_demangle(s.name.c_str(), nullptr, nullptr, &status);
+    const bool is = demangled && !status && !strcmp(demangled, name);
+    free(demangled);
+    return is;
+}
+
+// linux,internal
+// Reads the objects of the data sections from a symbol table.
+template <class H>
+void cr_elf_read_symbols(std::shared_ptr<cr_symbol_table> *tables,
+                         const int *index, const char *p, size_t len, H shdr,
+                         int symtab) {
+    const auto &tab = shdr[symtab];
+    const auto &str = shdr[tab.sh_link];
+    if (tab.sh_entsize != sizeof(ElfW(Sym)) ||
+        tab.sh_offset + tab.sh_size > len ||
+        str.sh_offset + str.sh_size > len) {
+        return;
+    }
+
+    auto syms = (const ElfW(Sym) *)(p + tab.sh_offset);
+    const size_t count = tab.sh_size / sizeof(ElfW(Sym));
+    const char *strs = p + str.sh_offset;
+    for (size_t n = 0; n < count; ++n) {
+        const auto &sym = syms[n];
+        if (ELF64_ST_TYPE(sym.st_info) != STT_OBJECT || !sym.st_size ||
+            sym.st_name >= str.sh_size) {
+            continue;
+        }
+        for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+            if (index[i] < 0 || sym.st_shndx != index[i]) {
+                continue;
+            }
+            const auto &sec = shdr[index[i]];
+            cr_symbol s;
+            const char *name = strs + sym.st_name;
+            s.name = cr_symbol_name(name,
+                                    strnlen(name, str.sh_size - sym.st_name));
+            s.offset = (int64_t)(sym.st_value - sec.sh_addr);
+            s.size = sym.st_size;
+            if (s.offset < 0 || s.offset + s.size > (int64_t)sec.sh_size) {
+                continue;
+            }
+            if (!tables[i]) {
+                tables[i] = std::make_shared<cr_symbol_table>();
+            }
+            tables[i]->symbols.push_back(s);
+        }
+    }
+}
+
+// linux,internal
+// Reads the `CR_STATE_VAR` records of a loaded image (`bias` is its load
+// address), replacing the symbols of the same variables.
+template <class H>
+void cr_elf_find_typed(std::shared_ptr<cr_symbol_table> *tables,
+                       const int *index, H shdr, int meta, intptr_t bias) {
+    auto records = (const cr_state_meta *)(bias + shdr[meta].sh_addr);
+    const size_t count = shdr[meta].sh_size / sizeof(cr_state_meta);
+    for (size_t n = 0; n < count; ++n) {
+        const auto &rec = records[n];
+        const intptr_t ptr = (intptr_t)rec.ptr;
+        for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+            if (index[i] < 0 || !rec.name || !rec.type) {
+                continue;
+            }
+            const intptr_t start = bias + shdr[index[i]].sh_addr;
+            const intptr_t end = start + shdr[index[i]].sh_size;
+            if (ptr < start || ptr + (intptr_t)rec.size > end) {
+                continue;
+            }
+            if (!tables[i]) {
+                tables[i] = std::make_shared<cr_symbol_table>();
+            }
+            auto &symbols = tables[i]->symbols;
+            cr_symbol s;
+            s.name = rec.name;
+            s.offset = ptr - start;
+            s.size = rec.size;
+            const unsigned int shape[2] = {rec.size, rec.align};
+            s.type = cr_hash(shape, sizeof(shape),
+                             cr_hash(rec.type, strlen(rec.type)));
+            symbols.erase(std::remove_if(symbols.begin(), symbols.end(),
+                                         [&](const cr_symbol &o) {
+                return !o.type && o.offset == s.offset;
+            }), symbols.end());
+            symbols.push_back(s);
+            tables[i]->typed = true;
+        }
+    }
+}
+
+// linux,internal
+// Finds the variables in the data sections from the symbol table (or the
+// dynamic symbol table of a stripped image), see cr_set_state_migration.
+template <class H>
+void cr_elf_find_symbols(cr_image &image, const char *p, size_t len, H shdr,
+                         int shnum, const char *sh_strtab_p, intptr_t bias) {
+    int index[cr_plugin_section_type::count];
+    std::fill(index, index + cr_plugin_section_type::count, -1);
+    int symtab = -1;
+    int meta = -1;
+    for (int i = 0; i < shnum; ++i) {
+        const char *name = sh_strtab_p + shdr[i].sh_name;
+        if (!strcmp(name, ".state")) {
+            index[cr_plugin_section_type::state] = i;
+        } else if (!strcmp(name, ".bss")) {
+            index[cr_plugin_section_type::bss] = i;
+        } else if (!strcmp(name, ".state_meta")) {
+            meta = i;
+        } else if (shdr[i].sh_type == SHT_SYMTAB ||
+                   (shdr[i].sh_type == SHT_DYNSYM && symtab < 0)) {
+            symtab = i;
+        }
+    }
+    std::shared_ptr<cr_symbol_table> tables[cr_plugin_section_type::count];
+    if (symtab >= 0 && shdr[symtab].sh_link < (unsigned int)shnum) {
+        cr_elf_read_symbols(tables, index, p, len, shdr, symtab);
+    }
+    if (meta >= 0 && bias) {
+        cr_elf_find_typed(tables, index, shdr, meta, bias);
+    }
+
+    for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+        if (!tables[i]) {
+            continue;
+        }
+        auto &symbols = tables[i]->symbols;
+        std::sort(symbols.begin(), symbols.end(),
+                  [](const cr_symbol &a, const cr_symbol &b) {
+            return a.name != b.name ? a.name < b.name : a.offset < b.offset;
+        });
+        uint64_t layout = 0;
+        for (size_t n = 0; n < symbols.size(); ++n) {
+            auto &s = symbols[n];
+            if (n && symbols[n - 1].name == s.name) {
+                s.index = symbols[n - 1].index + 1;
+            }
+            const int64_t range[3] = {s.offset, s.size, (int64_t)s.type};
+            layout = cr_hash(s.name.data(), s.name.size(), layout);
+            layout = cr_hash(range, sizeof(range), layout);
+        }
+        tables[i]->layout = layout;
+        image.sections[i].symbols = tables[i];
+    }
+}
+
+// linux,internal
+// Reads the functions and objects of an image from its symbol table (or the
+// dynamic symbol table of a stripped image), see cr_set_relocation.
+template <class H>
+void cr_elf_read_map(cr_image_map &map, const char *p, size_t len, H shdr,
+                     int shnum) {
+    int symtab = -1;
+    for (int i = 0; i < shnum; ++i) {
+        if (shdr[i].sh_type == SHT_SYMTAB ||
+            (shdr[i].sh_type == SHT_DYNSYM && symtab < 0)) {
+            symtab = i;
+        }
+    }
+    if (symtab < 0 || shdr[symtab].sh_link >= (unsigned int)shnum) {
+        return;
+    }
+    const auto &tab = shdr[symtab];
+    const auto &str = shdr[tab.sh_link];
+    if (tab.sh_entsize != sizeof(ElfW(Sym)) ||
+        tab.sh_offset + tab.sh_size > len ||
+        str.sh_offset + str.sh_size > len) {
+        return;
+    }
+
+    auto syms = (const ElfW(Sym) *)(p + tab.sh_offset);
+    const size_t count = tab.sh_size / sizeof(ElfW(Sym));
+    const char *strs = p + str.sh_offset;
+    auto &symbols = map.symbols;
+    for (size_t n = 0; n < count; ++n) {
+        const auto &sym = syms[n];
+        const auto type = ELF64_ST_TYPE(sym.st_info);
+        if ((type != STT_OBJECT && type != STT_FUNC) || !sym.st_size ||
+            sym.st_shndx == SHN_UNDEF || sym.st_name >= str.sh_size) {
+            continue;
+        }
+        cr_symbol s;
+        const char *name = strs + sym.st_name;
+        s.name = cr_symbol_name(name, strnlen(name, str.sh_size - sym.st_name));
+        s.offset = (int64_t)sym.st_value;
+        s.size = sym.st_size;
+        symbols.push_back(s);
+    }
+
+    std::sort(symbols.begin(), symbols.end(),
+              [](const cr_symbol &a, const cr_symbol &b) {
+        return a.name != b.name ? a.name < b.name : a.offset < b.offset;
+    });
+    for (size_t n = 1; n < symbols.size(); ++n) {
+        if (symbols[n - 1].name == symbols[n].name) {
+            symbols[n].index = symbols[n - 1].index + 1;
+        }
+    }
+    map.by_addr.resize(symbols.size());
+    for (size_t n = 0; n < symbols.size(); ++n) {
+        map.by_addr[n] = (uint32_t)n;
+    }
+    std::sort(map.by_addr.begin(), map.by_addr.end(),
+              [&](uint32_t a, uint32_t b) {
+        return symbols[a].offset < symbols[b].offset;
+    });
 }
 
 struct cr_ld_data {
-    cr_plugin *ctx = nullptr;
-    int64_t data_segment_address = 0;
-    int64_t data_segment_size = 0;
+    cr_image *image = nullptr;
     const char *fullname = nullptr;
+    intptr_t bias = 0;
 };
 
 // Iterate over all loaded shared objects and then for each one, iterates
@@ -1443,51 +3359,61 @@ static int cr_dl_header_handler(struct dl_phdr_info *info, size_t,
                                 void *data) {
     CR_ASSERT(info && data);
     auto p = (cr_ld_data *)data;
-    auto ctx = p->ctx;
     if (strcasecmp(info->dlpi_name, p->fullname)) {
         return 0;
     }
+    p->bias = (intptr_t)info->dlpi_addr;
 
+    auto map = p->image->map.get();
     for (int i = 0; i < info->dlpi_phnum; i++) {
         auto phdr = info->dlpi_phdr[i];
         if (phdr.p_type != PT_LOAD) {
             continue;
         }
+        if (map) {
+            cr_plugin_segment seg;
+            seg.ptr = (char *)(info->dlpi_addr + phdr.p_vaddr);
+            seg.size = phdr.p_memsz;
+            map->segments.push_back(seg);
+        }
 
         // assume the first writable segment is the one that contains our
         // sections this may not be true I imagine, but if this becomes an
         // issue we fix it by comparing against section addresses, but this
         // will require some rework on the code flow.
-        if (phdr.p_flags & PF_W) {
-            auto pimpl = (cr_internal *)ctx->p;
-            pimpl->seg.ptr = (char *)(info->dlpi_addr + phdr.p_vaddr);
-            pimpl->seg.size = phdr.p_filesz;
-            break;
+        if ((phdr.p_flags & PF_W) && !p->image->seg.ptr) {
+            p->image->seg.ptr = (char *)(info->dlpi_addr + phdr.p_vaddr);
+            p->image->seg.size = phdr.p_filesz;
+            if (!map) {
+                break;
+            }
         }
     }
     return 0;
 }
 
-static bool cr_plugin_validate_sections(cr_plugin &ctx, so_handle handle,
-                                        const std::string &imagefile,
-                                        bool rollback) {
-    CR_ASSERT(handle);
+static bool cr_image_sections(cr_image &image) {
+    CR_ASSERT(image.handle);
     cr_ld_data data;
-    data.ctx = &ctx;
-    auto pimpl = (cr_internal *)ctx.p;
-    if (pimpl->mode == CR_DISABLE) {
-        return true;
+    data.image = &image;
+    data.fullname = image.file.c_str();
+    image.map = nullptr;
+    if (image.relocate) {
+        image.map = std::make_shared<cr_image_map>();
     }
-    data.fullname = imagefile.c_str();
     dl_iterate_phdr(cr_dl_header_handler, (void *)&data);
 
-    const auto len = cr_file_size(imagefile);
+    const auto len = cr_file_size(image.file);
     char *p = nullptr;
     bool result = false;
     do {
-        int fd = open(imagefile.c_str(), O_RDONLY);
+        int fd = open(image.file.c_str(), O_RDONLY);
         p = (char *)mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0);
         close(fd);
+        if (p == MAP_FAILED) {
+            p = nullptr;
+            break;
+        }
 
         // The ElfW() macro definition turns its argument into the name of an
         // ELF data type suitable for the hardware architecture. For example,
@@ -1504,31 +3430,276 @@ static bool cr_plugin_validate_sections(cr_plugin &ctx, so_handle handle,
         ElfW(Shdr*) shdr = (ElfW(Shdr) *)(p + ehdr->e_shoff);
         auto sh_strtab = &shdr[ehdr->e_shstrndx];
         const char *const sh_strtab_p = p + sh_strtab->sh_offset;
-        result = cr_elf_validate_sections(ctx, rollback, shdr,
-                                          ehdr->e_shnum, sh_strtab_p);
+        cr_elf_find_sections(image, shdr, ehdr->e_shnum, sh_strtab_p,
+                             data.bias);
+        cr_elf_find_symbols(image, p, len, shdr, ehdr->e_shnum, sh_strtab_p,
+                            data.bias);
+        if (image.map) {
+            image.map->bias = data.bias;
+            cr_elf_read_map(*image.map, p, len, shdr, ehdr->e_shnum);
+        }
+        result = true;
     } while (0);
 
     if (p) {
         munmap(p, len);
     }
 
-    if (!result) {
-        ctx.failure = CR_STATE_INVALIDATED;
-    }
-
     return result;
 }
 
-#elif defined(CR_OSX)
-#include <dlfcn.h>
-#include <mach-o/dyld.h>
-#include <mach-o/getsect.h>
-#include <mach-o/ldsyms.h>
-#include <stdlib.h>     // realpath
-#include <limits.h>     // PATH_MAX
-
-#if __LP64__
-typedef struct mach_header_64 macho_hdr;
+// linux,internal
+// State remapping: the page aligned part of a data section lives in a memfd
+// that is mapped MAP_PRIVATE over the section of each loaded version. The
+// memfd holds the state as of the last unload, so transferring it to a new
+// version (or rolling back to it) is only a mmap, and as the running version
+// writes to copy-on-write pages it also serves as the backup. On unload, only
+// the pages written since the mapping are written back to the memfd.
+static void cr_state_remap_setup(cr_plugin &ctx) {
+    auto p = (cr_internal *)ctx.p;
+    const intptr_t page = sysconf(_SC_PAGESIZE);
+    for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+        auto &map = p->remap[i];
+        const auto &sec = p->sections[i];
+        if (map.fd >= 0 || !sec.ptr) {
+            continue;
+        }
+
+        const intptr_t ptr = (intptr_t)sec.ptr;
+        const intptr_t start = (ptr + page - 1) & ~(page - 1);
+        const intptr_t end = (ptr + sec.size) & ~(page - 1);
+        if (end - start < page) {
+            continue;
+        }
+
+        const int64_t size = end - start;
+        int fd = memfd_create("cr_state", MFD_CLOEXEC);
+        if (fd < 0) {
+            CR_ERROR("Couldn't create state memfd: %d\n", errno);
+            return;
+        }
+        cr_state_map m;
+        m.fd = fd;
+        m.offset = start - ptr;
+        m.size = size;
+        if (ftruncate(fd, size) != 0) {
+            close(fd);
+            continue;
+        }
+        cr_state_remap_writeback(m, (const char *)start, true);
+        if (!cr_state_remap_map(m, sec.ptr, sec.size)) {
+            close(fd);
+            continue;
+        }
+        map = m;
+    }
+}
+
+// linux,internal
+// Maps the memfd over a section at the same offset, fails if the section is
+// not page aligned the same way as when the memfd was created.
+static bool cr_state_remap_map(const cr_state_map &map, char *ptr,
+                               int64_t size) {
+    const intptr_t page = sysconf(_SC_PAGESIZE);
+    char *start = ptr + map.offset;
+    if (((intptr_t)start & (page - 1)) || map.offset + map.size > size) {
+        return false;
+    }
+    void *addr = mmap(start, map.size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_FIXED, map.fd, 0);
+    return addr != MAP_FAILED;
+}
+
+#define CR_PAGEMAP_PRESENT (1ull << 63)
+#define CR_PAGEMAP_SWAPPED (1ull << 62)
+#define CR_PAGEMAP_FILE (1ull << 61)
+#define CR_PAGEMAP_SOFT_DIRTY (1ull << 55)
+
+// linux,internal
+// Reads the /proc/self/pagemap entries of `pages` pages starting at the page
+// aligned `ptr`.
+static bool cr_pagemap_read(const char *ptr, int64_t pages,
+                            std::vector<uint64_t> &entries) {
+    const int64_t page = sysconf(_SC_PAGESIZE);
+    entries.resize(pages);
+    int pm = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if (pm < 0) {
+        return false;
+    }
+    const auto len = (ssize_t)(pages * sizeof(uint64_t));
+    const off_t offset = ((uintptr_t)ptr / page) * sizeof(uint64_t);
+    const bool result = pread(pm, entries.data(), len, offset) == len;
+    close(pm);
+    return result;
+}
+
+// linux,internal
+// Sets a page map of the pages covering a range with any of the pagemap
+// `flags`.
+static bool cr_pages_flagged(const char *ptr, int64_t len,
+                             cr_plugin_section &sec, uint64_t flags) {
+    auto &pages = sec.sparse;
+    const intptr_t page = sysconf(_SC_PAGESIZE);
+    const intptr_t start = (intptr_t)ptr & ~(page - 1);
+    const intptr_t end = ((intptr_t)ptr + len + page - 1) & ~(page - 1);
+    std::vector<uint64_t> entries;
+    if (!cr_pagemap_read((const char *)start, (end - start) / page,
+                         entries)) {
+        pages.clear();
+        return false;
+    }
+    pages.resize(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        pages[i] = (entries[i] & flags) != 0;
+    }
+    sec.sparse_lead = (intptr_t)ptr - start;
+    sec.sparse_page = page;
+    return true;
+}
+
+// linux,internal
+// Finds which pages covering a range were ever populated (present or
+// swapped), the others were never touched and read as zero if anonymous.
+static bool cr_pages_populated(const char *ptr, int64_t len,
+                               cr_plugin_section &sec) {
+    const auto flags = CR_PAGEMAP_PRESENT | CR_PAGEMAP_SWAPPED;
+    return cr_pages_flagged(ptr, len, sec, flags);
+}
+
+// linux,internal
+// Finds which pages covering a range were written since the soft-dirty bits
+// were last cleared.
+static bool cr_pages_soft_dirty(const char *ptr, int64_t len,
+                                cr_plugin_section &sec) {
+    return cr_pages_flagged(ptr, len, sec, CR_PAGEMAP_SOFT_DIRTY);
+}
+
+// linux,internal
+// Clears the soft-dirty bits of the whole process.
+static bool cr_soft_dirty_clear() {
+    int fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    const bool result = write(fd, "4", 1) == 1;
+    close(fd);
+    return result;
+}
+
+// linux,internal
+// Checks once that soft-dirty bits are tracked (CONFIG_MEM_SOFT_DIRTY),
+// otherwise they read always clear.
+static bool cr_soft_dirty_probe() {
+    static const bool supported = []() {
+        const int64_t page = sysconf(_SC_PAGESIZE);
+        auto mem = (char *)mmap(nullptr, page, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            return false;
+        }
+        bool result = false;
+        std::vector<uint64_t> entries;
+        if (cr_soft_dirty_clear()) {
+            *(volatile char *)mem = 1;
+            result = cr_pagemap_read(mem, 1, entries) &&
+                     (entries[0] & CR_PAGEMAP_SOFT_DIRTY);
+        }
+        munmap(mem, page);
+        return result;
+    }();
+    return supported;
+}
+
+// linux,internal
+// Zeroes an anonymous range, only touching the pages that were populated.
+static void cr_pages_zero(char *ptr, int64_t len) {
+    cr_plugin_section sec;
+    sec.size = len;
+    if (!cr_pages_populated(ptr, len, sec)) {
+        std::memset(ptr, 0, len);
+        return;
+    }
+    cr_sparse_runs(sec, len, [&](int64_t from, int64_t to, bool populated) {
+        if (populated) {
+            std::memset(ptr + from, 0, to - from);
+        }
+    });
+}
+
+// linux,internal
+// Writes back to the memfd the pages of a mapped range that are not shared
+// with it anymore (written or swapped), as found in /proc/self/pagemap. If
+// pagemap is not available or `all` is set, everything is written back.
+static void cr_state_remap_writeback(const cr_state_map &map,
+                                     const char *ptr, bool all) {
+    const int64_t page = sysconf(_SC_PAGESIZE);
+    const int64_t pages = map.size / page;
+    const uint64_t present = CR_PAGEMAP_PRESENT;
+    const uint64_t swapped = CR_PAGEMAP_SWAPPED;
+    const uint64_t file = CR_PAGEMAP_FILE;
+    std::vector<uint64_t> entries;
+    if (all || !cr_pagemap_read(ptr, pages, entries)) {
+        entries.assign(pages, swapped);
+    }
+
+    int64_t i = 0;
+    while (i < pages) {
+        auto dirty = [&](int64_t n) {
+            const auto e = entries[n];
+            return (e & swapped) || ((e & present) && !(e & file));
+        };
+        if (!dirty(i)) {
+            ++i;
+            continue;
+        }
+        int64_t first = i;
+        while (i < pages && dirty(i)) {
+            ++i;
+        }
+        int64_t off = first * page;
+        const int64_t end = i * page;
+        while (off < end) {
+            auto w = pwrite(map.fd, ptr + off, end - off, off);
+            if (w <= 0) {
+                CR_ERROR("Couldn't write back state: %d\n", errno);
+                break;
+            }
+            off += w;
+        }
+    }
+}
+
+// linux,internal
+static bool cr_state_remap_read(const cr_state_map &map, void *dst) {
+    int64_t off = 0;
+    while (off < map.size) {
+        auto r = pread(map.fd, (char *)dst + off, map.size - off, off);
+        if (r <= 0) {
+            return false;
+        }
+        off += r;
+    }
+    return true;
+}
+
+// linux,internal
+static void cr_state_remap_close(cr_state_map &map) {
+    if (map.fd >= 0) {
+        close(map.fd);
+    }
+    map = cr_state_map();
+}
+
+#elif defined(CR_OSX)
+#include <dlfcn.h>
+#include <mach-o/dyld.h>
+#include <mach-o/getsect.h>
+#include <mach-o/ldsyms.h>
+#include <stdlib.h>     // realpath
+#include <limits.h>     // PATH_MAX
+
+#if __LP64__
+typedef struct mach_header_64 macho_hdr;
 #define CR_MH_MAGIC MH_MAGIC_64
 #else
 typedef struct mach_header macho_hdr;
@@ -1536,22 +3707,61 @@ typedef struct mach_header macho_hdr;
 #endif
 
 // osx,internal
-// save section information to be used during load/unload when copying
-// around global state (from .bss and .state binary sections).
-// vaddr = is the in memory loaded address of the segment-section
-void cr_macho_section_save(cr_plugin &ctx, cr_plugin_section_type::e type,
-                           intptr_t addr, size_t size) {
-    const auto version = cr_plugin_section_version::current;
-    auto p = (cr_internal *)ctx.p;
-    auto data = &p->data[type][version];
-    const size_t old_size = data->size;
-    data->base = 0;
-    data->ptr = (char *)addr;
-    data->size = size;
-    data->data = CR_REALLOC(data->data, size);
-    if (old_size < size) {
-        memset((char *)data->data + old_size, '\0', size - old_size);
+// Finds the LC_UUID load command.
+static bool cr_image_build_id(const char *p, size_t len, uint64_t &id) {
+    auto hdr = (const macho_hdr *)p;
+    if (len < sizeof(macho_hdr) || hdr->magic != CR_MH_MAGIC) {
+        return false;
+    }
+
+    const char *cmd = p + sizeof(macho_hdr);
+    for (uint32_t i = 0; i < hdr->ncmds; ++i) {
+        auto lc = (const struct load_command *)cmd;
+        if (cmd + sizeof(*lc) > p + len || cmd + lc->cmdsize > p + len ||
+            lc->cmdsize == 0) {
+            break;
+        }
+        if (lc->cmd == LC_UUID) {
+            auto uuid = (const struct uuid_command *)cmd;
+            id = cr_hash(uuid->uuid, sizeof(uuid->uuid));
+            return true;
+        }
+        cmd += lc->cmdsize;
+    }
+    return false;
+}
+
+// osx,internal
+// Checks that all load commands and the segments they describe are in the
+// file bounds.
+static bool cr_image_headers_complete(const char *p, size_t len) {
+    auto hdr = (const macho_hdr *)p;
+    if (len < sizeof(macho_hdr) || hdr->magic != CR_MH_MAGIC ||
+        sizeof(macho_hdr) + hdr->sizeofcmds > len) {
+        return false;
+    }
+
+    const char *cmd = p + sizeof(macho_hdr);
+    for (uint32_t i = 0; i < hdr->ncmds; ++i) {
+        auto lc = (const struct load_command *)cmd;
+        if (cmd + sizeof(*lc) > p + len || cmd + lc->cmdsize > p + len ||
+            lc->cmdsize == 0) {
+            return false;
+        }
+#if __LP64__
+        if (lc->cmd == LC_SEGMENT_64) {
+            auto seg = (const struct segment_command_64 *)cmd;
+#else
+        if (lc->cmd == LC_SEGMENT) {
+            auto seg = (const struct segment_command *)cmd;
+#endif
+            if (seg->fileoff + seg->filesize > len) {
+                return false;
+            }
+        }
+        cmd += lc->cmdsize;
     }
+    return true;
 }
 
 // Iterate over all loaded shared objects and then for each one to find
@@ -1561,19 +3771,12 @@ void cr_macho_section_save(cr_plugin &ctx, cr_plugin_section_type::e type,
 //
 // Some useful references:
 // man 3 dyld
-static bool cr_plugin_validate_sections(cr_plugin &ctx, so_handle handle,
-                                        const std::string &imagefile,
-                                        bool rollback) {
-    bool result = true;
-    auto pimpl = (cr_internal *)ctx.p;
-    if (pimpl->mode == CR_DISABLE) {
-        return result;
-    }
+static bool cr_image_sections(cr_image &image) {
     CR_TRACE
 
     // resolve absolute path of the image, because _dyld_get_image_name returns abs path
     char imageAbsPath[PATH_MAX+1];
-    if (!::realpath(imagefile.c_str(), imageAbsPath)) {
+    if (!::realpath(image.file.c_str(), imageAbsPath)) {
         CR_ASSERT(0 && "resolving absolute path for plugin failed");
         return false;
     }
@@ -1593,51 +3796,57 @@ static bool cr_plugin_validate_sections(cr_plugin &ctx, so_handle handle,
             continue;
         }
 
-        intptr_t vaddr = _dyld_get_image_vmaddr_slide(i);
-        (void)vaddr;
-        //auto cmd_stride = sizeof(struct mach_header);
         if (hdr->magic != CR_MH_MAGIC) {
             // check for conforming mach-o header
             continue;
         }
 
-        auto validate_and_save = [&](cr_plugin_section_type::e sec,
-            intptr_t addr, unsigned long size) {
+        auto save = [&](cr_plugin_section_type::e type, intptr_t addr,
+                        unsigned long size) {
             if (addr != 0 && size != 0) {
-                if (ctx.version || rollback) {
-                    result &= cr_plugin_section_validate(ctx, sec, addr, 0, size);
-                }
-                if (result) {
-                    cr_macho_section_save(ctx, sec, addr, size);
-                }
+                auto sec = &image.sections[type];
+                sec->base = 0;
+                sec->ptr = (char *)addr;
+                sec->size = size;
             }
         };
 
         auto mhdr = (macho_hdr *)hdr;
         unsigned long size = 0;
         auto ptr = (intptr_t)getsectiondata(mhdr, SEG_DATA, "__bss", &size);
-        validate_and_save(cr_plugin_section_type::bss, ptr, (size_t)size);
-        if (result) {
-            ptr = (intptr_t)getsectiondata(mhdr, SEG_DATA, "__state", &size);
-            validate_and_save(cr_plugin_section_type::state, ptr, (size_t)size);
+        save(cr_plugin_section_type::bss, ptr, size);
+        ptr = (intptr_t)getsectiondata(mhdr, SEG_DATA, "__state", &size);
+        save(cr_plugin_section_type::state, ptr, size);
+        for (size_t n = 2; n < image.names.size(); ++n) {
+            if (image.names[n].empty()) {
+                continue;
+            }
+            const auto name = "__" + image.names[n];
+            ptr = (intptr_t)getsectiondata(mhdr, SEG_DATA, name.c_str(),
+                                           &size);
+            save((cr_plugin_section_type::e)n, ptr, size);
         }
         break;
     }
 
-    return result;
+    return true;
 }
 
 #endif
 
+static void cr_so_close(void *handle) {
+    CR_ASSERT(handle);
+    const int r = dlclose(handle);
+    if (r) {
+        CR_ERROR("Error closing plugin: %d\n", r);
+    }
+}
+
 static void cr_so_unload(cr_plugin &ctx) {
     CR_ASSERT(ctx.p);
     auto p = (cr_internal *)ctx.p;
     CR_ASSERT(p->handle);
-
-    const int r = dlclose(p->handle);
-    if (r) {
-        CR_ERROR("Error closing plugin: %d\n", r);
-    }
+    cr_so_close(p->handle);
 
     p->handle = nullptr;
     p->main = nullptr;
@@ -1662,22 +3871,126 @@ static cr_plugin_main_func cr_so_symbol(so_handle handle) {
     return new_main;
 }
 
-sigjmp_buf env;
+// unix,internal
+// Page allocated buffers for state snapshots, anonymous pages are only
+// populated when written. On Linux large buffers may use transparent huge
+// pages, making copying them into the buffer take less page faults.
+static void *cr_pages_alloc(size_t size) {
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return nullptr;
+    }
+#if defined(CR_LINUX) && defined(MADV_HUGEPAGE)
+    if (size >= CR_HUGEPAGE_MIN_SIZE) {
+        madvise(ptr, size, MADV_HUGEPAGE);
+    }
+#endif
+    return ptr;
+}
+
+static void cr_pages_free(void *ptr, size_t size) {
+    if (ptr) {
+        munmap(ptr, size);
+    }
+}
+
+// unix,internal
+// Arena address space, see cr_set_arena. Write protected pages are made
+// writable again by the crash handler, see cr_arena_fault.
+static char *cr_arena_reserve(size_t size) {
+    void *ptr = mmap(nullptr, size, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return ptr == MAP_FAILED ? nullptr : (char *)ptr;
+}
+
+static bool cr_arena_commit(char *ptr, size_t size) {
+    return !size || !mprotect(ptr, size, PROT_READ | PROT_WRITE);
+}
+
+static bool cr_arena_protect(char *ptr, size_t size, bool write) {
+    return !mprotect(ptr, size, PROT_READ | (write ? PROT_WRITE : 0));
+}
+
+static void cr_arena_release(char *ptr, size_t size) {
+    cr_pages_free(ptr, size);
+}
+
+static size_t cr_arena_page_size() {
+    return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// unix,internal
+// Pages of a section restored on demand, see cr_set_lazy_restore. They are
+// made accessible again by the crash handler, see cr_lazy_fault.
+static bool cr_lazy_protect(char *ptr, size_t size) {
+    return !mprotect(ptr, size, PROT_NONE);
+}
+
+// unix,internal
+// Restores pages left inaccessible by cr_lazy_protect. On Linux they are
+// written through /proc/self/mem while still inaccessible, so other threads
+// never see them half restored.
+static void cr_lazy_fill(int mem, char *dst, const char *src, size_t size) {
+#if defined(CR_LINUX)
+    if (mem >= 0 &&
+        pwrite(mem, src, size, (off_t)(uintptr_t)dst) == (ssize_t)size) {
+        mprotect(dst, size, PROT_READ | PROT_WRITE);
+        return;
+    }
+#else
+    (void)mem;
+#endif
+    mprotect(dst, size, PROT_READ | PROT_WRITE);
+    std::memcpy(dst, src, size);
+}
+
+// unix,internal
+static int cr_lazy_mem() {
+#if defined(CR_LINUX)
+    static const int mem = open("/proc/self/mem", O_RDWR | O_CLOEXEC);
+    return mem;
+#else
+    return -1;
+#endif
+}
+
+// unix,internal
+// Crash recovery context of a protected call. Frames are per thread and form
+// a stack (a plugin may update another plugin), so different plugins can be
+// updated and crash protected concurrently from different threads.
+struct cr_protect_frame {
+    sigjmp_buf env;
+    cr_plugin *ctx = nullptr;
+    cr_protect_frame *prev = nullptr;
+};
+
+static thread_local cr_protect_frame *cr_frame = nullptr;
 
 static void cr_signal_handler(int sig, siginfo_t *si, void *uap) {
     CR_TRACE
     (void)uap;
     CR_ASSERT(si);
-    siglongjmp(env, sig);
+    if ((sig == SIGSEGV || sig == SIGBUS) &&
+        (cr_lazy_fault(si->si_addr) || cr_arena_fault(si->si_addr))) {
+        return;
+    }
+    auto frame = cr_frame;
+    if (!frame) {
+        // not within a protected call in this thread, crash as usual
+        signal(sig, SIG_DFL);
+        raise(sig);
+        return;
+    }
+    siglongjmp(frame->env, sig);
 }
 
 static void cr_plat_init() {
     CR_TRACE
-    static bool initialized = false;
-    if (initialized) {
+    static std::atomic<bool> initialized{false};
+    if (initialized.exchange(true)) {
         return;
     }
-    initialized = true;
     struct sigaction sa;
     sa.sa_flags = SA_SIGINFO | SA_RESTART | SA_NODEFER;
     sigemptyset(&sa.sa_mask);
@@ -1716,149 +4029,1365 @@ static cr_failure cr_signal_to_failure(int sig) {
     return static_cast<cr_failure>(CR_OTHER + sig);
 }
 
+// unix,internal
+// The protected call doesn't save the signal mask with sigsetjmp as it would
+// cost a syscall (rt_sigprocmask) on every call. Instead the mask is only
+// repaired in the crash path, making sure the signals we use for crash
+// protection are not left blocked by the guest.
+static void cr_signal_mask_repair() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGILL);
+    sigaddset(&set, SIGBUS);
+    sigaddset(&set, SIGSEGV);
+    sigaddset(&set, SIGABRT);
+    pthread_sigmask(SIG_UNBLOCK, &set, nullptr);
+}
+
 static int cr_plugin_main(cr_plugin &ctx, cr_op operation) {
-    if (int sig = sigsetjmp(env, 1)) {
+    cr_protect_frame frame;
+    frame.ctx = &ctx;
+    frame.prev = cr_frame;
+    cr_frame = &frame;
+    if (int sig = sigsetjmp(frame.env, 0)) {
+        cr_frame = frame.prev;
+        cr_signal_mask_repair();
         ctx.version = ctx.last_working_version;
         ctx.failure = cr_signal_to_failure(sig);
         CR_LOG("1 FAILURE: %d (CR: %d)\n", sig, ctx.failure);
         return -1;
-    } else {
-        auto p = (cr_internal *)ctx.p;
-        CR_ASSERT(p);
-        if (p->main) {
-            return p->main(&ctx, operation);
-        }
     }
 
-    return -1;
+    auto p = (cr_internal *)ctx.p;
+    CR_ASSERT(p);
+    int r = -1;
+    if (p->main) {
+        r = p->main(&ctx, operation);
+    }
+    cr_frame = frame.prev;
+    return r;
 }
 
-#endif // CR_LINUX || CR_OSX
-
-static bool cr_plugin_load_internal(cr_plugin &ctx, bool rollback) {
-    CR_TRACE
+// unix,internal
+// Calls `CR_STEP` up to `n` times under a single protection frame, stopping
+// at the first negative result. Returns the number of completed iterations,
+// the result of the failed one (if any) is stored in `results` too.
+static unsigned int cr_plugin_main_n(cr_plugin &ctx, unsigned int n,
+                                     int *results) {
     auto p = (cr_internal *)ctx.p;
-    const auto file = p->fullname;
-    if (cr_exists(file) || rollback) {
-        const auto old_file = cr_version_path(file, ctx.version, p->temppath);
-        CR_LOG("unload '%s' with rollback: %d\n", old_file.c_str(), rollback);
-        int r = cr_plugin_unload(ctx, rollback, false);
+    CR_ASSERT(p && p->main);
+    volatile unsigned int i = 0;
+    cr_protect_frame frame;
+    frame.ctx = &ctx;
+    frame.prev = cr_frame;
+    cr_frame = &frame;
+    if (int sig = sigsetjmp(frame.env, 0)) {
+        cr_frame = frame.prev;
+        cr_signal_mask_repair();
+        ctx.version = ctx.last_working_version;
+        ctx.failure = cr_signal_to_failure(sig);
+        CR_LOG("1 FAILURE: %d (CR: %d) at %u\n", sig, ctx.failure, i);
+        if (results) {
+            results[i] = -1;
+        }
+        return i;
+    }
+    for (; i < n; i = i + 1) {
+        int r = p->main(&ctx, CR_STEP);
+        if (results) {
+            results[i] = r;
+        }
         if (r < 0) {
-            return false;
+            break;
         }
+    }
+    cr_frame = frame.prev;
+    return i;
+}
 
-        auto new_version = rollback ? ctx.version : ctx.next_version;
-        auto new_file = cr_version_path(file, new_version, p->temppath);
-        if (rollback) {
-            if (ctx.version == 0) {
-                ctx.failure = CR_INITIAL_FAILURE;
-                return false;
-            }
-            // Don't rollback to this version again, if it crashes.
-            ctx.last_working_version = ctx.version > 0 ? ctx.version - 1 : 0;
-        } else {
-            // Save current version for rollback.
-            ctx.last_working_version = ctx.version;
-            cr_copy(file, new_file);
+#endif // CR_LINUX || CR_OSX
 
-            // Update `next_version` for use by the next reload.
-            ctx.next_version = new_version + 1;
+#if !defined(CR_LINUX)
+static void cr_state_remap_setup(cr_plugin &ctx) {
+    (void)ctx;
+}
 
-#if defined(_MSC_VER)
-            if (!cr_pdb_process(new_file)) {
-                CR_ERROR("Couldn't process PDB, debugging may be "
-                         "affected and/or reload may fail\n");
-            }
-#endif // defined(_MSC_VER)
-        }
+static bool cr_state_remap_map(const cr_state_map &map, char *ptr,
+                               int64_t size) {
+    (void)map;
+    (void)ptr;
+    (void)size;
+    return false;
+}
 
-        auto new_dll = cr_so_load(new_file);
-        if (!new_dll) {
-            ctx.failure = CR_BAD_IMAGE;
-            return false;
-        }
+static void cr_state_remap_writeback(const cr_state_map &map,
+                                     const char *ptr, bool all) {
+    (void)map;
+    (void)ptr;
+    (void)all;
+}
 
-        if (!cr_plugin_validate_sections(ctx, new_dll, new_file, rollback)) {
-            return false;
-        }
+static bool cr_state_remap_read(const cr_state_map &map, void *dst) {
+    (void)map;
+    (void)dst;
+    return false;
+}
 
-        if (rollback) {
-            cr_plugin_sections_reload(ctx, cr_plugin_section_version::backup);
-        } else if (ctx.version) {
-            cr_plugin_sections_reload(ctx, cr_plugin_section_version::current);
-        }
+static void cr_state_remap_close(cr_state_map &map) {
+    map = cr_state_map();
+}
 
-        auto new_main = cr_so_symbol(new_dll);
-        if (!new_main) {
-            return false;
-        }
+static bool cr_pages_populated(const char *ptr, int64_t len,
+                               cr_plugin_section &sec) {
+    (void)ptr;
+    (void)len;
+    sec.sparse.clear();
+    return false;
+}
 
-        auto p2 = (cr_internal *)ctx.p;
-        p2->handle = new_dll;
-        p2->main = new_main;
-        if (ctx.failure != CR_BAD_IMAGE) {
-            p2->timestamp = cr_last_write_time(file);
-        }
-        ctx.version = new_version;
-        CR_LOG("loaded: %s (version: %d)\n", new_file.c_str(), ctx.version);
-    } else {
-        CR_ERROR("Error loading plugin.\n");
-        return false;
-    }
-    return true;
+static void cr_pages_zero(char *ptr, int64_t len) {
+    std::memset(ptr, 0, len);
 }
 
-static bool cr_plugin_section_validate(cr_plugin &ctx,
-                                       cr_plugin_section_type::e type,
-                                       intptr_t ptr, intptr_t base,
-                                       int64_t size) {
-    CR_TRACE
+static bool cr_pages_soft_dirty(const char *ptr, int64_t len,
+                                cr_plugin_section &sec) {
     (void)ptr;
-    auto p = (cr_internal *)ctx.p;
-    switch (p->mode) {
-    case CR_SAFE:
-        return (p->data[type][0].size == size);
-    case CR_UNSAFE:
-        return (p->data[type][0].size <= size);
-    case CR_DISABLE:
-        return true;
-    default:
-        break;
-    }
-    // CR_SAFEST
-    return (p->data[type][0].base == base && p->data[type][0].size == size);
+    (void)len;
+    sec.sparse.clear();
+    return false;
 }
 
-// internal
-static void cr_plugin_sections_backup(cr_plugin &ctx) {
-    auto p = (cr_internal *)ctx.p;
-    if (p->mode == CR_DISABLE) {
-        return;
-    }
-    CR_TRACE
+static bool cr_soft_dirty_clear() {
+    return false;
+}
 
-    for (int i = 0; i < cr_plugin_section_type::count; ++i) {
-        auto cur = &p->data[i][cr_plugin_section_version::current];
-        if (cur->ptr) {
-            auto bkp = &p->data[i][cr_plugin_section_version::backup];
-            bkp->data = CR_REALLOC(bkp->data, cur->size);
-            bkp->ptr = cur->ptr;
-            bkp->size = cur->size;
-            bkp->base = cur->base;
-
-            if (bkp->data) {
-                std::memcpy(bkp->data, cur->data, bkp->size);
-            }
+static bool cr_soft_dirty_probe() {
+    return false;
+}
+#endif // !CR_LINUX
+
+#if defined(CR_LINUX)
+// linux,internal
+// Checks if a stored section is all zeroes, skipping pages never populated.
+static bool cr_section_is_empty(const cr_plugin_section &sec) {
+    bool empty = true;
+    cr_sparse_runs(sec, sec.size, [&](int64_t from, int64_t to, bool populated) {
+        if (empty && populated) {
+            empty = cr_is_empty((const char *)sec.data + from, to - from);
         }
+    });
+    return empty;
+}
+#endif // CR_LINUX
+
+// internal
+// Copies with non-temporal stores where available, so copying a large state
+// doesn't evict the host working set from the caches.
+static void cr_stream_copy(char *dst, const char *src, size_t len) {
+#if defined(CR_STREAM_STORES)
+    const size_t head = std::min(len, (size_t)(-(uintptr_t)dst & 15));
+    std::memcpy(dst, src, head);
+    size_t i = head;
+    for (; i + 64 <= len; i += 64) {
+        auto s = (const __m128i *)(src + i);
+        auto d = (__m128i *)(dst + i);
+        const __m128i a = _mm_loadu_si128(s);
+        const __m128i b = _mm_loadu_si128(s + 1);
+        const __m128i c = _mm_loadu_si128(s + 2);
+        const __m128i e = _mm_loadu_si128(s + 3);
+        _mm_stream_si128(d, a);
+        _mm_stream_si128(d + 1, b);
+        _mm_stream_si128(d + 2, c);
+        _mm_stream_si128(d + 3, e);
     }
+    std::memcpy(dst + i, src + i, len - i);
+    _mm_sfence();
+#else
+    std::memcpy(dst, src, len);
+#endif
 }
 
 // internal
-// Before unloading iterate over possible global static state and keeps an
-// internal copy to be used in next version load and a backup copy as a known
-// valid state checkpoint. This is mostly due that a new load may want to
-// modify the state and if anything bad happens we are sure to have a valid
+struct cr_copy_job {
+    char *dst;
+    const char *src;
+    size_t len;
+    size_t *left; // chunks of the copy not done yet, guarded by the lock
+};
+
+// internal
+// The CR_COPY_THREADS - 1 workers shared by all large state copies, started
+// by the first one. Copies can come from several threads at once (scheduler,
+// history), so a caller helps with whatever is queued while it waits.
+struct cr_copier {
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::deque<cr_copy_job> jobs;
+    std::vector<std::thread> threads;
+    bool quit = false;
+
+    cr_copier() {
+        for (int i = 1; i < CR_COPY_THREADS; ++i) {
+            threads.emplace_back([this]() {
+                std::unique_lock<std::mutex> l(lock);
+                for (;;) {
+                    wake.wait(l, [&] { return quit || !jobs.empty(); });
+                    if (quit) {
+                        return;
+                    }
+                    run(l);
+                }
+            });
+        }
+    }
+
+    ~cr_copier() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            quit = true;
+        }
+        wake.notify_all();
+        for (auto &t : threads) {
+            t.join();
+        }
+    }
+
+    // Copies the first queued chunk, `l` is held before and after.
+    void run(std::unique_lock<std::mutex> &l) {
+        const auto job = jobs.front();
+        jobs.pop_front();
+        l.unlock();
+        cr_stream_copy(job.dst, job.src, job.len);
+        l.lock();
+        if (--*job.left == 0) {
+            done.notify_all();
+        }
+    }
+};
+
+static cr_copier &cr_copier_get() {
+    static cr_copier copier;
+    return copier;
+}
+
+// internal
+// Copies state data. Copies of CR_COPY_THRESHOLD bytes or more are split in
+// page aligned chunks copied with non-temporal stores by the calling thread
+// and the cr_copier workers.
+static void cr_state_memcpy(void *dst, const void *src, size_t len) {
+    if (len < (size_t)CR_COPY_THRESHOLD) {
+        std::memcpy(dst, src, len);
+        return;
+    }
+    auto d = (char *)dst;
+    auto s = (const char *)src;
+    const size_t threads = std::max(CR_COPY_THREADS, 1);
+    const size_t page = cr_arena_page_size();
+    const size_t chunk = (len / threads + page - 1) / page * page;
+    if (chunk >= len) {
+        cr_stream_copy(d, s, len);
+        return;
+    }
+    auto &c = cr_copier_get();
+    size_t left = 0;
+    {
+        std::lock_guard<std::mutex> guard(c.lock);
+        for (size_t off = chunk; off < len; off += chunk) {
+            c.jobs.push_back({d + off, s + off, std::min(chunk, len - off),
+                              &left});
+            ++left;
+        }
+    }
+    c.wake.notify_all();
+    cr_stream_copy(d, s, chunk);
+    std::unique_lock<std::mutex> l(c.lock);
+    while (left) {
+        if (!c.jobs.empty()) {
+            c.run(l);
+        } else {
+            c.done.wait(l);
+        }
+    }
+}
+
+// internal
+// Copies a section data but the range backed by a memfd, if any.
+static void cr_state_copy(void *dst, const void *src, int64_t len,
+                          const cr_state_map &map) {
+    if (map.fd < 0) {
+        cr_state_memcpy(dst, src, len);
+        return;
+    }
+    const int64_t tail = map.offset + map.size;
+    cr_state_memcpy(dst, src, std::min(len, map.offset));
+    if (len > tail) {
+        cr_state_memcpy((char *)dst + tail, (const char *)src + tail,
+                        len - tail);
+    }
+}
+
+// internal
+// Reads a range of a stored section, pages that were never populated are
+// zero.
+static void cr_section_read(const cr_plugin_section &src, int64_t from,
+                            int64_t len, char *dst) {
+    auto data = (const char *)src.data;
+    const int64_t end = from + len;
+    const int64_t count = (int64_t)src.sparse.size();
+    for (int64_t off = from; off < end;) {
+        bool populated = true;
+        int64_t to = end;
+        int64_t n = count ? (off + src.sparse_lead) / src.sparse_page : 0;
+        if (n < count) {
+            populated = src.sparse[n] != 0;
+            while (n < count && (src.sparse[n] != 0) == populated) {
+                ++n;
+            }
+            to = std::min(end, n * src.sparse_page - src.sparse_lead);
+        } else if (count) {
+            populated = false;
+        }
+        if (populated) {
+            std::memcpy(dst + off - from, data + off, to - off);
+        } else {
+            cr_pages_zero(dst + off - from, to - off);
+        }
+        off = to;
+    }
+}
+
+// internal
+// Checks if a stored section must be migrated per variable into a section
+// laid out differently, see cr_set_state_migration. Always done for guests
+// using CR_STATE_VAR.
+static bool cr_section_migrates(const cr_internal *p,
+                                const cr_plugin_section &stored,
+                                const cr_plugin_section &sec) {
+    if (!stored.symbols || !sec.symbols) {
+        return false;
+    }
+    const bool typed = stored.symbols->typed && sec.symbols->typed;
+    return (p->migrate || typed) &&
+           (stored.symbols->layout != sec.symbols->layout ||
+            stored.size != sec.size);
+}
+
+// internal
+// Copies each variable of a stored section to the variable with the same
+// name, size and type (if typed) in `sec`. New variables and those whose
+// type changed keep their initial values (zero for .bss, as a standby image
+// may have changed them) and removed ones are dropped.
+static void cr_section_migrate(cr_plugin_section_type::e type,
+                               const cr_plugin_section &stored,
+                               const cr_plugin_section &sec) {
+    const auto &from = stored.symbols->symbols;
+    for (const auto &sym : sec.symbols->symbols) {
+        auto it = std::lower_bound(from.begin(), from.end(), sym,
+                                   [](const cr_symbol &a, const cr_symbol &b) {
+            return a.name != b.name ? a.name < b.name : a.index < b.index;
+        });
+        char *dst = sec.ptr + sym.offset;
+        if (it != from.end() && it->name == sym.name &&
+            it->index == sym.index && it->size == sym.size &&
+            it->type == sym.type && it->offset + it->size <= stored.size) {
+            cr_section_read(stored, it->offset, sym.size, dst);
+        } else if (type == cr_plugin_section_type::bss) {
+            cr_pages_zero(dst, sym.size);
+        } else {
+            CR_LOG("state migration: new or changed variable %s\n",
+                   sym.name.c_str());
+        }
+    }
+}
+
+// internal
+// Saves the location of a section of the newly loaded image.
+static void cr_plugin_section_save(cr_plugin &ctx,
+                                   cr_plugin_section_type::e type,
+                                   const cr_plugin_section &sec) {
+    auto p = (cr_internal *)ctx.p;
+    auto data = &p->sections[type];
+    data->base = sec.base;
+    data->ptr = sec.ptr;
+    data->size = sec.size;
+    data->symbols = sec.symbols;
+}
+
+// internal
+// Returns the state stored `depth` unloads ago, if still in the ring.
+static cr_snapshot *cr_snapshot_at(cr_internal *p, unsigned int depth) {
+    if (depth >= p->snapshot_count) {
+        return nullptr;
+    }
+    const size_t ring = p->snapshots.size();
+    return &p->snapshots[(p->snapshot_head + ring - depth) % ring];
+}
+
+// internal
+static void cr_snapshot_release(cr_snapshot &snap) {
+    for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+        cr_pages_free(snap.sections[i].data, snap.capacity[i]);
+    }
+    snap = cr_snapshot();
+}
+
+// internal
+// Changes the number of snapshots kept, keeping the newest ones.
+static void cr_snapshot_resize(cr_internal *p, unsigned int depth) {
+    // the snapshots may be released
+    cr_lazy_finish(p);
+    cr_history_wait(p);
+    p->snapshot_depth = depth;
+    if (p->snapshots.empty()) {
+        // allocated by the first store
+        return;
+    }
+    std::vector<cr_snapshot> ring(depth);
+    const unsigned int keep = std::min(p->snapshot_count, depth);
+    for (unsigned int d = 0; d < keep; ++d) {
+        std::swap(ring[keep - 1 - d], *cr_snapshot_at(p, d));
+    }
+    for (auto &snap : p->snapshots) {
+        cr_snapshot_release(snap);
+    }
+    p->snapshots.swap(ring);
+    p->snapshot_head = keep ? keep - 1 : 0;
+    p->snapshot_count = keep;
+}
+
+// internal
+static void cr_varint_put(std::vector<uint8_t> &out, uint64_t v) {
+    for (; v >= 0x80; v >>= 7) {
+        out.push_back((uint8_t)(v | 0x80));
+    }
+    out.push_back((uint8_t)v);
+}
+
+// internal
+static uint64_t cr_varint_get(const uint8_t *&in) {
+    uint64_t v = 0;
+    for (int shift = 0;; shift += 7) {
+        const uint8_t b = *in++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return v;
+        }
+    }
+}
+
+// internal
+// Appends `a ^ b` to a delta as runs of words: a varint count of zero words,
+// a varint count of literal words and the literal words. The delta of two
+// states mostly alike is mostly zero words.
+static void cr_delta_encode(std::vector<uint8_t> &out, const uint64_t *a,
+                            const uint64_t *b, size_t words) {
+    for (size_t i = 0; i < words;) {
+        size_t literal = i;
+        while (literal < words && a[literal] == b[literal]) {
+            ++literal;
+        }
+        size_t end = literal;
+        while (end < words && a[end] != b[end]) {
+            ++end;
+        }
+        cr_varint_put(out, literal - i);
+        cr_varint_put(out, end - literal);
+        for (; literal < end; ++literal) {
+            const uint64_t w = a[literal] ^ b[literal];
+            const size_t at = out.size();
+            out.resize(at + sizeof(w));
+            std::memcpy(&out[at], &w, sizeof(w));
+        }
+        i = end;
+    }
+}
+
+// internal
+// Applies a delta made by cr_delta_encode to `size` bytes.
+static void cr_delta_apply(const std::vector<uint8_t> &delta, char *dst,
+                           size_t size) {
+    const uint8_t *in = delta.data();
+    const uint8_t *end = in + delta.size();
+    size_t at = 0;
+    while (in < end) {
+        at += cr_varint_get(in) * sizeof(uint64_t);
+        for (uint64_t n = cr_varint_get(in); n; --n) {
+            uint64_t w = 0, cur = 0;
+            const size_t len = std::min(sizeof(w), size - at);
+            std::memcpy(&w, in, sizeof(w));
+            std::memcpy(&cur, dst + at, len);
+            cur ^= w;
+            std::memcpy(dst + at, &cur, len);
+            in += sizeof(w);
+            at += sizeof(w);
+        }
+    }
+}
+
+// internal
+// Computes the delta of a stored section to the section stored after it, or
+// to zero if null.
+static void cr_history_delta(std::vector<uint8_t> &out,
+                             const cr_plugin_section &prev,
+                             const cr_plugin_section *next) {
+    const int64_t block = 64 * 1024;
+    std::vector<uint64_t> a(block / sizeof(uint64_t));
+    std::vector<uint64_t> b(a.size());
+    for (int64_t off = 0; off < prev.size; off += block) {
+        const int64_t len = std::min(block, prev.size - off);
+        const size_t words = (len + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+        a[words - 1] = 0;
+        b[words - 1] = 0;
+        cr_section_read(prev, off, len, (char *)a.data());
+        if (next) {
+            cr_section_read(*next, off, len, (char *)b.data());
+        } else {
+            std::fill(b.begin(), b.begin() + words, 0);
+        }
+        cr_delta_encode(out, a.data(), b.data(), words);
+    }
+    out.shrink_to_fit();
+}
+
+// internal
+// Drops the oldest entries of the history over its memory cap.
+static void cr_history_trim(cr_history &h) {
+    size_t drop = 0;
+    for (; drop < h.entries.size() && h.bytes > h.max_bytes; ++drop) {
+        h.bytes -= h.entries[drop].bytes;
+    }
+    h.entries.erase(h.entries.begin(), h.entries.begin() + drop);
+}
+
+// internal
+static void cr_history_wait(cr_internal *p) {
+    if (p->history.worker.joinable()) {
+        p->history.worker.join();
+    }
+}
+
+// internal
+static void cr_history_clear(cr_internal *p) {
+    cr_history_wait(p);
+    p->history.entries.clear();
+    p->history.bytes = 0;
+}
+
+// internal
+// Adds the state stored before the newest snapshot to the history, as its
+// delta to the newest snapshot, in the background.
+static void cr_history_push(cr_internal *p) {
+    auto &h = p->history;
+    const auto prev = cr_snapshot_at(p, 1);
+    const auto next = cr_snapshot_at(p, 0);
+    if (!h.max_bytes || !next) {
+        return;
+    }
+    if (!prev || prev->partial || next->partial) {
+        // the newest entry would be a delta to another state
+        cr_history_clear(p);
+        return;
+    }
+    h.worker = std::thread([&h, prev, next]() {
+        cr_history_entry entry;
+        entry.version = prev->version;
+        entry.map = prev->map;
+        for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+            const auto &sec = prev->sections[i];
+            const auto &cur = next->sections[i];
+            if (!sec.ptr) {
+                continue;
+            }
+            auto &e = entry.sections[i];
+            e.type = sec.type;
+            e.ptr = sec.ptr;
+            e.base = sec.base;
+            e.size = sec.size;
+            e.symbols = sec.symbols;
+            entry.whole[i] = !cur.ptr || cur.size != sec.size;
+            cr_history_delta(entry.delta[i], sec,
+                             entry.whole[i] ? nullptr : &cur);
+            entry.bytes += entry.delta[i].size();
+        }
+        h.bytes += entry.bytes;
+        h.entries.push_back(std::move(entry));
+        cr_history_trim(h);
+    });
+}
+
+// internal
+// Rebuilds the state stored by the last unload of `version` kept in the
+// history, applying the deltas backwards from the newest snapshot.
+static bool cr_history_rebuild(cr_internal *p, unsigned int version,
+                               cr_snapshot &out) {
+    const auto &entries = p->history.entries;
+    const auto newest = cr_snapshot_at(p, 0);
+    size_t found = entries.size();
+    while (found && entries[found - 1].version != version) {
+        --found;
+    }
+    if (!found || !newest || newest->partial) {
+        return false;
+    }
+    for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+        const auto &src = newest->sections[i];
+        auto &sec = out.sections[i];
+        if (!src.ptr) {
+            continue;
+        }
+        sec.data = cr_pages_alloc(src.size);
+        if (!sec.data) {
+            cr_snapshot_release(out);
+            return false;
+        }
+        out.capacity[i] = src.size;
+        cr_section_read(src, 0, src.size, (char *)sec.data);
+    }
+    for (size_t j = entries.size(); j-- > found - 1;) {
+        const auto &e = entries[j];
+        for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+            const auto &from = e.sections[i];
+            auto &sec = out.sections[i];
+            sec.ptr = from.ptr;
+            if (!from.ptr) {
+                continue;
+            }
+            if (e.whole[i]) {
+                cr_pages_free(sec.data, out.capacity[i]);
+                sec.data = cr_pages_alloc(from.size);
+                out.capacity[i] = sec.data ? from.size : 0;
+                if (!sec.data) {
+                    cr_snapshot_release(out);
+                    return false;
+                }
+            }
+            sec.type = from.type;
+            sec.base = from.base;
+            sec.size = from.size;
+            sec.symbols = from.symbols;
+            cr_delta_apply(e.delta[i], (char *)sec.data, from.size);
+        }
+        out.version = e.version;
+        out.map = e.map;
+    }
+    return true;
+}
+
+// internal
+// Stops remapping a section, the newest snapshot gets the pages it was
+// missing from the memfd.
+static void cr_state_remap_release(cr_internal *p, int i) {
+    auto &map = p->remap[i];
+    if (map.fd < 0) {
+        return;
+    }
+    auto snap = cr_snapshot_at(p, 0);
+    if (snap && snap->partial) {
+        auto &src = snap->sections[i];
+        if (src.ptr && src.size >= map.offset + map.size) {
+            cr_state_remap_read(map, (char *)src.data + map.offset);
+        }
+    }
+    cr_state_remap_close(map);
+    if (snap) {
+        snap->partial = false;
+        for (const auto &m : p->remap) {
+            snap->partial |= m.fd >= 0;
+        }
+    }
+}
+
+// internal
+// If a section is stored and copied into the next version, see
+// cr_set_section.
+static bool cr_section_transferred(const cr_internal *p, int i) {
+    return p->section_policy[i] == CR_SECTION_TRANSFER ||
+           p->section_policy[i] == CR_SECTION_PERSIST;
+}
+
+// internal
+// Checks a section of a loaded image against its stored state.
+static bool cr_plugin_section_compatible(cr_plugin &ctx,
+                                         cr_plugin_section_type::e type,
+                                         const cr_plugin_section &stored,
+                                         const cr_plugin_section &sec) {
+    auto p = (cr_internal *)ctx.p;
+    // the size and base are checked first, scanning a .bss is only needed
+    // when they differ
+    if (cr_section_migrates(p, stored, sec) ||
+        cr_plugin_section_validate(ctx, stored, (intptr_t)sec.ptr, sec.base,
+                                   sec.size)) {
+        return true;
+    }
+#if defined(CR_LINUX)
+    // this is kinda hack to skip bss validation if our data is zero
+    // this means we don't care scrapping it, and helps skipping
+    // validating a .bss that serves only as padding in the segment.
+    return type == cr_plugin_section_type::bss && p->remap[type].fd < 0 &&
+           cr_section_is_empty(stored);
+#else
+    (void)type;
+    return false;
+#endif
+}
+
+// internal
+// Checks if the running version state can be transferred to an image as
+// is, comparing to the sections as they will be stored by its unload.
+static bool cr_plugin_image_fits(cr_plugin &ctx, const cr_image &image) {
+    auto p = (cr_internal *)ctx.p;
+    for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+        const auto type = (cr_plugin_section_type::e)i;
+        if (!image.sections[i].ptr || !cr_section_transferred(p, i)) {
+            continue;
+        }
+        auto live = p->sections[i];
+        live.data = live.ptr;
+        if (!cr_plugin_section_compatible(ctx, type, live, image.sections[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// internal
+// validates that the sections being loaded are compatible with the previous
+// one accordingly with desired `cr_mode` mode. If this is a first load, a
+// validation is not necessary. At the same time it will initialize the
+// section tracking information.
+static bool cr_plugin_validate_sections(cr_plugin &ctx, const cr_image &image,
+                                        bool rollback, bool validate) {
+    auto p = (cr_internal *)ctx.p;
+    if (p->mode == CR_DISABLE) {
+        return true;
+    }
+
+    bool result = true;
+    const auto snap = cr_snapshot_at(p, 0);
+    for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+        const auto type = (cr_plugin_section_type::e)i;
+        const auto &sec = image.sections[i];
+        if (!sec.ptr || !cr_section_transferred(p, i)) {
+            // not tracked, nor left pointing to the previous image
+            if (result) {
+                p->sections[i] = cr_plugin_section();
+            }
+            continue;
+        }
+        if ((ctx.version || rollback) && validate) {
+            static const cr_plugin_section none;
+            const auto &stored = snap ? snap->sections[i] : none;
+            result &= cr_plugin_section_compatible(ctx, type, stored, sec);
+        }
+        if (result) {
+            cr_plugin_section_save(ctx, type, sec);
+        }
+    }
+
+    if (!result) {
+        ctx.failure = CR_STATE_INVALIDATED;
+    }
+    return result;
+}
+
+// internal
+// Starts a new image for a version of the plugin.
+static void cr_image_init(cr_plugin &ctx, cr_image &image,
+                          unsigned int version) {
+    auto p = (cr_internal *)ctx.p;
+    image = cr_image();
+    image.version = version;
+    image.file = cr_version_path(p->fullname, version, p->temppath);
+    image.names.assign(p->section_names,
+                       p->section_names + cr_plugin_section_type::count);
+    image.relocate = p->relocate && p->mode != CR_DISABLE;
+}
+
+// internal
+// Copies the plugin file to the image version path. The fingerprint is of
+// the copy, the plugin file may change again before the copy is loaded.
+static void cr_image_copy(cr_image &image, const std::string &file) {
+    // before copying, a build landing meanwhile is still seen as newer
+    image.timestamp = cr_last_write_time(file);
+    cr_copy(file, image.file);
+    // before windows patches its pdb path
+    image.fingerprint = cr_image_fingerprint(image.file);
+#if defined(_MSC_VER)
+    if (!cr_pdb_process(image.file)) {
+        CR_ERROR("Couldn't process PDB, debugging may be "
+                 "affected and/or reload may fail\n");
+    }
+#endif // defined(_MSC_VER)
+}
+
+// internal
+// Loads the image and resolves its entry point.
+static void cr_image_open(cr_image &image) {
+    image.handle = cr_so_load(image.file);
+    if (!image.handle) {
+        image.failure = CR_BAD_IMAGE;
+        return;
+    }
+
+    image.main = cr_so_symbol((so_handle)image.handle);
+    if (!image.main) {
+        image.failure = CR_BAD_IMAGE;
+    }
+}
+
+// internal
+// Finds the loaded image data sections and its fingerprint.
+static void cr_image_inspect(cr_image &image, cr_mode mode, bool copied) {
+    if (mode != CR_DISABLE && !cr_image_sections(image)) {
+        image.failure = CR_STATE_INVALIDATED;
+        return;
+    }
+
+    // a copy got it from cr_image_copy, on rollback the image is the one
+    // that failed
+    if (!copied) {
+        image.fingerprint = cr_image_fingerprint(image.file);
+    }
+    if (image.map) {
+        image.map->fingerprint = image.fingerprint;
+    }
+    image.size = cr_file_size(image.file);
+}
+
+// internal
+// Prepares an image to take over the plugin without touching the running
+// one: copies the plugin file to the image version path (if `copy`), loads
+// it and finds its data sections. This is safe to run in another thread.
+static void cr_image_prepare(cr_image &image, const std::string &file,
+                             cr_mode mode, bool copy) {
+    CR_TRACE
+    if (copy) {
+        cr_image_copy(image, file);
+    }
+
+    cr_image_open(image);
+    if (!image.failure) {
+        cr_image_inspect(image, mode, copy);
+    }
+}
+
+static void cr_image_close(cr_image &image) {
+    if (image.handle) {
+        cr_so_close(image.handle);
+    }
+    image.handle = nullptr;
+    image.main = nullptr;
+}
+
+// internal
+// Finds in the `to` image the address of a pointer into the `from` image: the
+// same offset if they are the same image, otherwise the same offset in the
+// symbol with the same name. Returns 0 if there's no such symbol.
+static intptr_t cr_image_map_translate(const cr_image_map &from,
+                                       const cr_image_map &to,
+                                       intptr_t value) {
+    const int64_t vaddr = value - from.bias;
+    if (from.fingerprint && from.fingerprint == to.fingerprint) {
+        return to.bias + vaddr;
+    }
+    auto it = std::upper_bound(from.by_addr.begin(), from.by_addr.end(),
+                               vaddr, [&](int64_t v, uint32_t n) {
+        return v < from.symbols[n].offset;
+    });
+    if (it == from.by_addr.begin()) {
+        return 0;
+    }
+    const auto &s = from.symbols[*(it - 1)];
+    const int64_t offset = vaddr - s.offset;
+    if (offset >= s.size) {
+        return 0;
+    }
+    auto t = std::lower_bound(to.symbols.begin(), to.symbols.end(), s,
+                              [](const cr_symbol &a, const cr_symbol &b) {
+        return a.name != b.name ? a.name < b.name : a.index < b.index;
+    });
+    if (t == to.symbols.end() || t->name != s.name || t->index != s.index ||
+        offset >= t->size) {
+        return 0;
+    }
+    return to.bias + t->offset + offset;
+}
+
+// internal
+// Rewrites the pointers into the `from` image found in a memory range, any
+// aligned word with a value inside of its segments. Returns how many were
+// found and how many of them couldn't be moved (`lost`).
+static size_t cr_relocate_range(const cr_image_map &from,
+                                const cr_image_map &to, char *ptr,
+                                int64_t size, size_t &lost) {
+    intptr_t lo = INTPTR_MAX;
+    intptr_t hi = 0;
+    for (const auto &seg : from.segments) {
+        lo = std::min(lo, (intptr_t)seg.ptr);
+        hi = std::max(hi, (intptr_t)seg.ptr + (intptr_t)seg.size);
+    }
+    const intptr_t word = sizeof(intptr_t);
+    const intptr_t start = ((intptr_t)ptr + word - 1) & ~(word - 1);
+    const intptr_t end = ((intptr_t)ptr + size) & ~(word - 1);
+    size_t found = 0;
+    for (intptr_t at = start; at < end; at += word) {
+        intptr_t value;
+        std::memcpy(&value, (const void *)at, word);
+        if (value < lo || value >= hi) {
+            continue;
+        }
+        bool inside = false;
+        for (const auto &seg : from.segments) {
+            inside |= value >= (intptr_t)seg.ptr &&
+                      value < (intptr_t)seg.ptr + (intptr_t)seg.size;
+        }
+        if (!inside) {
+            continue;
+        }
+        found++;
+        const intptr_t moved = cr_image_map_translate(from, to, value);
+        if (moved) {
+            std::memcpy((void *)at, &moved, word);
+        } else {
+            lost++;
+        }
+    }
+    return found;
+}
+
+// internal
+// After the state of a version was transferred into the `to` image, moves
+// the pointers it has into the previous image, see cr_set_relocation.
+// `sections` is the image the state was stored from, `heap` the image that
+// ran last and used the registered heap ranges.
+static void cr_plugin_relocate(cr_plugin &ctx, const cr_image_map *sections,
+                               const cr_image_map *heap,
+                               const cr_image_map &to) {
+    auto p = (cr_internal *)ctx.p;
+    CR_TRACE
+    size_t found = 0;
+    size_t lost = 0;
+    for (int i = 0; sections && i < cr_plugin_section_type::count; ++i) {
+        const auto &sec = p->sections[i];
+        if (sec.ptr) {
+            found += cr_relocate_range(*sections, to, sec.ptr, sec.size, lost);
+        }
+    }
+    for (const auto &range : heap ? p->heap_ranges
+                                  : std::vector<cr_plugin_segment>()) {
+        found += cr_relocate_range(*heap, to, range.ptr, range.size, lost);
+    }
+    if (found) {
+        CR_LOG("relocated %zu pointers (%zu lost)\n", found - lost, lost);
+    }
+}
+
+// internal
+// Puts back the initial values of the CR_SECTION_RESET sections of an image
+// that ran before, or keeps them if it may run again (standby).
+static void cr_image_sections_reset(cr_plugin &ctx, cr_image &image) {
+    auto p = (cr_internal *)ctx.p;
+    if (p->mode == CR_DISABLE) {
+        return;
+    }
+    for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+        const auto &sec = image.sections[i];
+        auto &initial = image.initial[i];
+        if (!sec.ptr || p->section_policy[i] != CR_SECTION_RESET) {
+            continue;
+        }
+        if (!image.reused) {
+            if (p->standby_depth && i != cr_plugin_section_type::bss) {
+                initial = std::make_shared<const std::vector<char>>(
+                    sec.ptr, sec.ptr + sec.size);
+            }
+        } else if (i == cr_plugin_section_type::bss) {
+            cr_pages_zero(sec.ptr, sec.size);
+        } else if (initial && initial->size() == (size_t)sec.size) {
+            std::memcpy(sec.ptr, initial->data(), sec.size);
+        }
+    }
+}
+
+// internal
+// Makes a prepared image the current plugin image, the previous one must be
+// already unloaded. Validates and restores the global state into it, unless
+// it will be imported (see cr_set_state_export).
+static bool cr_plugin_install(cr_plugin &ctx, cr_image &image, bool rollback,
+                              bool imported = false) {
+    auto p = (cr_internal *)ctx.p;
+    if (image.failure) {
+        ctx.failure = image.failure;
+        cr_image_close(image);
+        return false;
+    }
+
+    if (!cr_plugin_validate_sections(ctx, image, rollback, !imported)) {
+        cr_image_close(image);
+        return false;
+    }
+    cr_image_sections_reset(ctx, image);
+
+    auto snap = cr_snapshot_at(p, 0);
+    if (imported) {
+        // the memfds have the old layout
+        for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+            cr_state_remap_release(p, i);
+        }
+    } else if (snap && (rollback || ctx.version)) {
+        cr_plugin_sections_reload(ctx, *snap);
+    } else if (!ctx.version && !p->state_file.empty()) {
+        cr_state_file_restore(ctx, image);
+    }
+    // the state may be rewritten below
+    if (rollback || image.map) {
+        cr_lazy_finish(p);
+    }
+    // the state comes from the version that stored it, or the crashed one
+    const cr_image_map *from = nullptr;
+    const bool checkpoint = rollback && cr_plugin_checkpoint_restore(ctx);
+    if (checkpoint) {
+        from = p->image.map.get();
+    } else if (!imported && snap && (rollback || ctx.version)) {
+        from = snap->map.get();
+    }
+    // and the arena to the same point
+    if (rollback) {
+        cr_arena_rollback(p, checkpoint);
+    }
+    if (image.map && (rollback || ctx.version)) {
+        cr_plugin_relocate(ctx, from, p->image.map.get(), *image.map);
+    }
+    cr_plugin_checkpoint_reset(ctx, rollback);
+    if (p->state_remap && p->mode != CR_DISABLE) {
+        cr_state_remap_setup(ctx);
+    }
+
+    p->handle = image.handle;
+    p->main = image.main;
+    p->image = image;
+    p->fingerprint = image.fingerprint;
+    cr_state_seq_reset(p);
+    // the plugin file may have changed since it was copied (staging), on
+    // rollback the build that failed isn't retried
+    p->timestamp =
+        rollback ? cr_last_write_time(p->fullname) : image.timestamp;
+    ctx.version = image.version;
+    image.handle = nullptr;
+    CR_LOG("loaded: %s (version: %d)\n", image.file.c_str(), ctx.version);
+    return true;
+}
+
+// internal
+// Replaces the running version with a new image prepared before unloading it
+// (staging, incremental reload or state export). If the image could not be
+// loaded at all the running version is kept and the load will be retried
+// later.
+static bool cr_plugin_swap(cr_plugin &ctx, cr_image &image) {
+    if (image.failure == CR_BAD_IMAGE) {
+        CR_ERROR("Couldn't load image '%s'\n", image.file.c_str());
+        cr_image_close(image);
+        cr_plugin_backoff(ctx);
+        return false;
+    }
+
+    const int exported = cr_plugin_state_export(ctx, image);
+    if (exported < 0) {
+        cr_image_close(image);
+        return false;
+    }
+
+    CR_LOG("unload version %d\n", ctx.version);
+    int r = cr_plugin_unload(ctx, false, false);
+    if (r < 0) {
+        cr_image_close(image);
+        return false;
+    }
+
+    // Save current version for rollback.
+    ctx.last_working_version = ctx.version;
+    if (!cr_plugin_install(ctx, image, false, exported > 0)) {
+        return false;
+    }
+    return !exported || cr_plugin_state_import(ctx);
+}
+
+// internal
+static char *cr_buffer_grow(cr_buffer *buf, size_t capacity) {
+    capacity = std::max(capacity, buf->capacity * 2);
+    auto data = (char *)CR_REALLOC(buf->data, capacity);
+    if (!data) {
+        return nullptr;
+    }
+    buf->data = data;
+    buf->capacity = capacity;
+    return data;
+}
+
+// internal
+// When the running version state doesn't fit a new image, asks the running
+// version to serialize it (CR_STATE_EXPORT) before unloading. Returns 1 if
+// it did, 0 if the state should be transferred as usual and -1 if it
+// crashed.
+static int cr_plugin_state_export(cr_plugin &ctx, const cr_image &image) {
+    auto p = (cr_internal *)ctx.p;
+    if (!p->state_export || p->mode == CR_DISABLE || !p->main ||
+        image.failure || cr_plugin_image_fits(ctx, image)) {
+        return 0;
+    }
+
+    CR_LOG("state doesn't fit version %d, exporting\n", image.version);
+    p->buffer.grow = cr_buffer_grow;
+    p->buffer.size = 0;
+    p->buffer.offset = 0;
+    ctx.state = &p->buffer;
+    int r = cr_plugin_main(ctx, CR_STATE_EXPORT);
+    ctx.state = nullptr;
+    if (ctx.failure) {
+        CR_LOG("5 FAILURE: %d\n", r);
+        return -1;
+    }
+    // declined, it will be rejected (CR_STATE_INVALIDATED)
+    return r >= 0 ? 1 : 0;
+}
+
+// internal
+// The new version deserializes the state exported by the previous one
+// (CR_STATE_IMPORT) before its CR_LOAD. A failure rolls back.
+static bool cr_plugin_state_import(cr_plugin &ctx) {
+    auto p = (cr_internal *)ctx.p;
+    p->buffer.offset = 0;
+    ctx.state = &p->buffer;
+    int r = cr_plugin_main(ctx, CR_STATE_IMPORT);
+    ctx.state = nullptr;
+    if (r < 0 && !ctx.failure) {
+        CR_LOG("6 FAILURE: %d\n", r);
+        ctx.failure = CR_USER;
+        // the stored state is the previous version one, rollback to it as
+        // after a crash
+        ctx.version = ctx.last_working_version;
+    }
+    return !ctx.failure;
+}
+
+// internal
+// Warm standby pool: instead of unloading the images replaced by a reload we
+// keep the last known good ones mapped, with their sections already found,
+// so that a rollback is only a pointer swap and a backup state restore.
+static void cr_plugin_standby_push(cr_plugin &ctx, cr_image &image) {
+    auto p = (cr_internal *)ctx.p;
+    p->standby.insert(p->standby.begin(), image);
+    image.handle = nullptr;
+
+    size_t total = 0;
+    size_t keep = 0;
+    for (; keep < p->standby.size() && keep < p->standby_depth; ++keep) {
+        total += p->standby[keep].size;
+        if (p->standby_max_bytes && total > p->standby_max_bytes) {
+            break;
+        }
+    }
+    while (p->standby.size() > keep) {
+        cr_image_close(p->standby.back());
+        p->standby.pop_back();
+    }
+}
+
+static bool cr_plugin_standby_take(cr_plugin &ctx, unsigned int version,
+                                   cr_image &image) {
+    auto p = (cr_internal *)ctx.p;
+    for (auto it = p->standby.begin(); it != p->standby.end(); ++it) {
+        if (it->version == version) {
+            CR_LOG("rollback to standby version %d\n", version);
+            image = *it;
+            image.reused = true;
+            p->standby.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void cr_plugin_standby_free(cr_plugin &ctx) {
+    auto p = (cr_internal *)ctx.p;
+    for (auto &image : p->standby) {
+        cr_image_close(image);
+    }
+    p->standby.clear();
+}
+
+static bool cr_plugin_load_internal(cr_plugin &ctx, bool rollback) {
+    CR_TRACE
+    auto p = (cr_internal *)ctx.p;
+    const auto file = p->fullname;
+    if (!rollback) {
+        if (!cr_exists(file)) {
+            CR_ERROR("Error loading plugin.\n");
+            return false;
+        }
+
+        cr_image image;
+        cr_image_init(ctx, image, ctx.next_version);
+        if (p->state_export && p->main) {
+            // the new layout decides if the state is exported before unload
+            ctx.next_version = image.version + 1;
+            cr_image_prepare(image, file, p->mode, true);
+            return cr_plugin_swap(ctx, image);
+        }
+
+        CR_LOG("unload version %d\n", ctx.version);
+        int r = cr_plugin_unload(ctx, false, false);
+        if (r < 0) {
+            return false;
+        }
+
+        // Save current version for rollback.
+        ctx.last_working_version = ctx.version;
+        // Update `next_version` for use by the next reload.
+        ctx.next_version = image.version + 1;
+        cr_image_prepare(image, file, p->mode, true);
+        if (image.failure == CR_BAD_IMAGE) {
+            cr_plugin_backoff(ctx);
+        }
+        return cr_plugin_install(ctx, image, false);
+    }
+
+    CR_LOG("unload version %d with rollback\n", ctx.version);
+    int r = cr_plugin_unload(ctx, rollback, false);
+    if (r < 0) {
+        return false;
+    }
+
+    if (ctx.version == 0) {
+        ctx.failure = CR_INITIAL_FAILURE;
+        return false;
+    }
+    // Don't rollback to this version again, if it crashes.
+    ctx.last_working_version = ctx.version > 0 ? ctx.version - 1 : 0;
+
+    cr_image image;
+    if (!cr_plugin_standby_take(ctx, ctx.version, image)) {
+        cr_image_init(ctx, image, ctx.version);
+        cr_image_prepare(image, file, p->mode, false);
+    }
+    return cr_plugin_install(ctx, image, rollback);
+}
+
+// internal
+// Background staging: once a change is detected a worker thread prepares
+// the new image while the current version keeps running, then the update
+// thread only does the final swap when it is ready.
+static bool cr_plugin_staging_update(cr_plugin &ctx) {
+    auto p = (cr_internal *)ctx.p;
+    if (p->stager.joinable()) {
+        if (!p->staged_ready.load(std::memory_order_acquire)) {
+            return false;
+        }
+        p->stager.join();
+        p->staged_ready = false;
+        return cr_plugin_swap(ctx, p->staged);
+    }
+
+    if (!cr_plugin_changed(ctx)) {
+        return false;
+    }
+
+    cr_image_init(ctx, p->staged, ctx.next_version);
+    ctx.next_version++;
+    p->stager = std::thread([p]() {
+        cr_image_prepare(p->staged, p->fullname, p->mode, true);
+        p->staged_ready.store(true, std::memory_order_release);
+    });
+    return false;
+}
+
+// internal
+// Incremental reload for hosts that can't use threads: the reload work is
+// split in stages and each update advances at least one of them, continuing
+// while the time budget allows. The current version keeps running until the
+// final swap stage (unload, state transfer and load).
+static bool cr_plugin_incremental_update(cr_plugin &ctx) {
+    auto p = (cr_internal *)ctx.p;
+    const auto start = std::chrono::steady_clock::now();
+    const auto budget = std::chrono::microseconds(p->reload_budget);
+    do {
+        switch (p->stage) {
+        case cr_reload_stage::idle:
+            if (!cr_plugin_changed(ctx)) {
+                return false;
+            }
+            cr_image_init(ctx, p->staged, ctx.next_version);
+            ctx.next_version++;
+            p->stage = cr_reload_stage::copy;
+            break;
+        case cr_reload_stage::copy:
+            // takes the plugin file mtime, it may change before the swap
+            cr_image_copy(p->staged, p->fullname);
+            p->stage = cr_reload_stage::open;
+            break;
+        case cr_reload_stage::open:
+            cr_image_open(p->staged);
+            p->stage = p->staged.failure ? cr_reload_stage::swap
+                                         : cr_reload_stage::inspect;
+            break;
+        case cr_reload_stage::inspect:
+            cr_image_inspect(p->staged, p->mode, true);
+            p->stage = cr_reload_stage::swap;
+            break;
+        case cr_reload_stage::swap:
+            p->stage = cr_reload_stage::idle;
+            return cr_plugin_swap(ctx, p->staged);
+        }
+    } while (std::chrono::steady_clock::now() - start < budget);
+    CR_LOG("reload stage %d next update\n", p->stage);
+    return false;
+}
+
+// internal
+// Drops any image being prepared by staging or an incremental reload.
+static void cr_plugin_staging_cancel(cr_plugin &ctx) {
+    auto p = (cr_internal *)ctx.p;
+    if (p->stager.joinable()) {
+        p->stager.join();
+        p->staged_ready = false;
+    } else if (p->stage == cr_reload_stage::idle) {
+        return;
+    }
+    p->stage = cr_reload_stage::idle;
+    cr_image_close(p->staged);
+    cr_del(p->staged.file);
+}
+
+static bool cr_plugin_section_validate(cr_plugin &ctx,
+                                       const cr_plugin_section &stored,
+                                       intptr_t ptr, intptr_t base,
+                                       int64_t size) {
+    CR_TRACE
+    (void)ptr;
+    auto p = (cr_internal *)ctx.p;
+    switch (p->mode) {
+    case CR_SAFE:
+        return (stored.size == size);
+    case CR_UNSAFE:
+        return (stored.size <= size);
+    case CR_DISABLE:
+        return true;
+    default:
+        break;
+    }
+    // CR_SAFEST
+    return (stored.base == base && stored.size == size);
+}
+
+// internal
+// Before unloading iterate over possible global static state and keeps a copy
+// in the next snapshot of the ring, to be used in next version load and as a
+// known valid state checkpoint. This is mostly due that a new load may want
+// to modify the state and if anything bad happens we are sure to have a valid
 // and compatible copy of the state for the previous version of the plugin.
+// The oldest snapshot buffers are reused, so this is a single copy without
+// allocations unless a section grew.
 static void cr_plugin_sections_store(cr_plugin &ctx) {
     auto p = (cr_internal *)ctx.p;
     if (p->mode == CR_DISABLE) {
@@ -1866,65 +5395,1181 @@ static void cr_plugin_sections_store(cr_plugin &ctx) {
     }
     CR_TRACE
 
-    auto version = cr_plugin_section_version::current;
+    // the history may be reading the slot reused
+    cr_history_wait(p);
+    if (p->snapshots.empty()) {
+        p->snapshots.resize(p->snapshot_depth);
+    }
+    const unsigned int slot = (p->snapshot_head + 1) % p->snapshots.size();
+    auto &snap = p->snapshots[slot];
+    snap.version = ctx.version;
+    snap.partial = false;
+    snap.map = p->image.map;
+    for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+        const auto &cur = p->sections[i];
+        auto &sec = snap.sections[i];
+        sec.sparse.clear();
+        sec.ptr = nullptr;
+        if (!cur.ptr) {
+            continue;
+        }
+        const char *ptr = cur.ptr;
+        const int64_t len = cur.size;
+        if (snap.capacity[i] < (size_t)len) {
+            cr_pages_free(sec.data, snap.capacity[i]);
+            sec.data = cr_pages_alloc(len);
+            snap.capacity[i] = sec.data ? len : 0;
+            if (!sec.data) {
+                CR_ERROR("Couldn't allocate state snapshot\n");
+                continue;
+            }
+        }
+        sec.type = (cr_plugin_section_type::e)i;
+        sec.ptr = cur.ptr;
+        sec.base = cur.base;
+        sec.size = len;
+        sec.symbols = cur.symbols;
+
+        const auto &map = p->remap[i];
+        // only copy the pages of a large .bss that were ever touched
+        if (map.fd >= 0) {
+            cr_state_copy(sec.data, ptr, len, map);
+            cr_state_remap_writeback(map, ptr + map.offset, false);
+            snap.partial = true;
+        } else if (i == cr_plugin_section_type::bss &&
+                   len >= CR_SPARSE_MIN_SIZE &&
+                   cr_pages_populated(ptr, len, sec)) {
+            auto dst = (char *)sec.data;
+            cr_sparse_runs(sec, len,
+                           [&](int64_t from, int64_t to, bool populated) {
+                if (populated) {
+                    cr_state_memcpy(dst + from, ptr + from, to - from);
+                }
+            });
+        } else {
+            cr_state_memcpy(sec.data, ptr, len);
+        }
+    }
+
+    p->snapshot_head = slot;
+    p->snapshot_count = std::min(p->snapshot_count + 1,
+                                 (unsigned int)p->snapshots.size());
+    if (!p->state_file.empty()) {
+        cr_state_file_save(ctx, snap);
+    }
+    cr_history_push(p);
+}
+
+// internal
+static uint64_t cr_state_file_align(uint64_t size) {
+    const uint64_t page = 4096;
+    return (size + page - 1) & ~(page - 1);
+}
+
+// internal
+// Writes a stored state to the state file, to be restored by the first load
+// of another host process, see cr_set_state_file.
+static void cr_state_file_save(cr_plugin &ctx, const cr_snapshot &snap) {
+    auto p = (cr_internal *)ctx.p;
+    CR_TRACE
+
+    cr_state_file_header header = {};
+    header.fingerprint = p->fingerprint;
+    header.count = cr_plugin_section_type::count;
+    uint64_t total = cr_state_file_align(sizeof(header));
+    for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+        const auto &sec = snap.sections[i];
+        if (!sec.ptr) {
+            continue;
+        }
+        auto &entry = header.sections[i];
+        entry.offset = total;
+        entry.size = sec.size;
+        entry.layout = sec.symbols ? sec.symbols->layout : 0;
+        total += cr_state_file_align(sec.size);
+    }
+
+    // written aside and renamed over the last one, so a crash while saving
+    // doesn't lose it. A memfd (`/proc/self/fd/N`) can only be rewritten.
+    const bool in_place = !p->state_file.compare(0, 14, "/proc/self/fd/");
+    const auto path = in_place ? p->state_file : p->state_file + ".tmp";
+    auto file = (char *)cr_file_map_write(path, total);
+    if (!file) {
+        CR_ERROR("Couldn't write state file '%s'\n", path.c_str());
+        return;
+    }
+    for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+        const auto &sec = snap.sections[i];
+        const auto &map = p->remap[i];
+        auto dst = file + header.sections[i].offset;
+        if (!sec.ptr) {
+            continue;
+        }
+        if (snap.partial && map.fd >= 0) {
+            cr_state_copy(dst, sec.data, sec.size, map);
+            cr_state_remap_read(map, dst + map.offset);
+        } else {
+            cr_section_read(sec, 0, sec.size, dst);
+        }
+    }
+    std::memcpy(file, &header, sizeof(header));
+    std::memcpy(file, CR_STATE_FILE_MAGIC, sizeof(header.magic));
+    cr_file_unmap(file, total);
+    if (!in_place && !cr_rename(path, p->state_file)) {
+        CR_ERROR("Couldn't replace state file '%s'\n", p->state_file.c_str());
+        cr_del(path);
+    }
+}
+
+// internal
+// Restores the state file into the first version loaded, if it was written
+// for the same image, or the sections have the same layout.
+static bool cr_state_file_restore(cr_plugin &ctx, const cr_image &image) {
+    auto p = (cr_internal *)ctx.p;
+    CR_TRACE
+
+    size_t len = 0;
+    auto file = (const char *)cr_file_map_read(p->state_file, len);
+    if (!file) {
+        return false;
+    }
+    cr_state_file_header header;
+    bool fits = len >= sizeof(header);
+    if (fits) {
+        std::memcpy(&header, file, sizeof(header));
+        fits = !std::memcmp(header.magic, CR_STATE_FILE_MAGIC,
+                            sizeof(header.magic)) &&
+               header.count == cr_plugin_section_type::count;
+    }
+    const bool same = fits && header.fingerprint == image.fingerprint;
+    for (int i = 0; fits && i < cr_plugin_section_type::count; ++i) {
+        const auto &sec = p->sections[i];
+        const auto &entry = header.sections[i];
+        const uint64_t layout = sec.symbols ? sec.symbols->layout : 0;
+        if (sec.ptr) {
+            fits = entry.size == sec.size &&
+                   entry.offset + entry.size <= len &&
+                   (same || (layout && layout == entry.layout));
+        }
+    }
+    if (fits) {
+        for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+            const auto &sec = p->sections[i];
+            if (sec.ptr) {
+                cr_state_memcpy(sec.ptr, file + header.sections[i].offset,
+                                sec.size);
+            }
+        }
+        CR_LOG("restored state file '%s'\n", p->state_file.c_str());
+    } else {
+        CR_LOG("state file doesn't fit the image\n");
+    }
+    cr_file_unmap(file, len);
+    return fits;
+}
+
+// internal
+// Handles a write to a page of an arena protected since its checkpoint,
+// keeping a copy of the page first. Called by the crash handler, returns
+// false if the address is not in a protected page.
+static bool cr_arena_fault(void *addr) {
+    for (auto &slot : cr_arena_list) {
+        auto a = slot.load(std::memory_order_acquire);
+        if (!a) {
+            continue;
+        }
+        const uintptr_t off = (uintptr_t)addr - (uintptr_t)a->arena.base;
+        if ((uintptr_t)addr < (uintptr_t)a->arena.base ||
+            off >= a->tracked.load(std::memory_order_acquire)) {
+            continue;
+        }
+        // another thread may be copying it, the write faults until done
+        const size_t n = off / a->page;
+        if (!a->written[n].exchange(1)) {
+            const size_t at = n * a->page;
+            std::memcpy(a->shadow + at, a->arena.base + at, a->page);
+            cr_arena_protect(a->arena.base + at, a->page, true);
+        }
+        return true;
+    }
+    return false;
+}
+
+// internal
+// Keeps a copy of the arena as of the last unload before a periodic
+// checkpoint moves past it: the pages written since come from `shadow`.
+static void cr_arena_keep_unload(cr_arena_state *a) {
+    const size_t used = a->saved.used;
+    auto keep = (char *)CR_REALLOC(a->unload, std::max(used, (size_t)1));
+    a->unload_kept = keep != nullptr;
+    if (!keep) {
+        CR_ERROR("Couldn't keep the arena, it may not match the state\n");
+        return;
+    }
+    a->unload = keep;
+    for (size_t at = 0; at < used; at += a->page) {
+        const bool written =
+            a->copy || a->written[at / a->page].load(std::memory_order_relaxed);
+        std::memcpy(keep + at, (written ? a->shadow : a->arena.base) + at,
+                    std::min(a->page, used - at));
+    }
+    a->unloaded = a->saved;
+}
+
+// internal
+// Takes a checkpoint of the arena, together with the state: write protects
+// its used pages, or copies them if pages can't be protected. `unload` if
+// it goes with the state stored by an unload, otherwise it goes with a
+// periodic state checkpoint (see cr_set_checkpoint).
+static void cr_arena_checkpoint(cr_internal *p, bool unload) {
+    auto a = p->arena;
+    if (!a) {
+        return;
+    }
+    CR_TRACE
+    auto base = a->arena.base;
+    if (unload) {
+        a->unload_kept = false;
+    } else if (a->saved_unload) {
+        cr_arena_keep_unload(a);
+    }
+    a->saved_unload = unload;
+    const size_t len = (a->arena.used + a->page - 1) / a->page * a->page;
+    const size_t last = a->tracked.exchange(0);
+    for (size_t n = 0; n < last / a->page; ++n) {
+        a->written[n].store(0, std::memory_order_relaxed);
+    }
+    a->saved = a->arena;
+    if (!a->copy && len && !cr_arena_protect(base, len, false)) {
+        a->copy = true;
+    }
+    if (a->copy) {
+        cr_state_memcpy(a->shadow, base, a->arena.used);
+        return;
+    }
+    a->tracked.store(len, std::memory_order_release);
+}
+
+// internal
+// Rolls the arena back after a crash rollback, to the same point as the
+// state: its last checkpoint if the state `checkpoint` was restored,
+// otherwise the last unload.
+static void cr_arena_rollback(cr_internal *p, bool checkpoint) {
+    auto a = p->arena;
+    if (!a) {
+        return;
+    }
+    auto base = a->arena.base;
+    if (!checkpoint && a->unload_kept) {
+        const size_t tracked = a->tracked.load(std::memory_order_acquire);
+        if (tracked) {
+            cr_arena_protect(base, tracked, true);
+        }
+        std::memcpy(base, a->unload, a->unloaded.used);
+        const size_t committed = a->arena.committed;
+        a->arena = a->unloaded;
+        a->arena.committed = committed;
+        CR_LOG("rolled back arena to the last unload\n");
+        cr_arena_checkpoint(p, true);
+        return;
+    }
+    if (a->copy) {
+        cr_state_memcpy(base, a->shadow, a->saved.used);
+    } else {
+        const size_t tracked = a->tracked.load(std::memory_order_acquire);
+        for (size_t n = 0; n < tracked / a->page; ++n) {
+            if (a->written[n].load(std::memory_order_relaxed)) {
+                const size_t at = n * a->page;
+                std::memcpy(base + at, a->shadow + at, a->page);
+            }
+        }
+    }
+    // the pages committed since are kept
+    const size_t committed = a->arena.committed;
+    a->arena = a->saved;
+    a->arena.committed = committed;
+    CR_LOG("rolled back arena\n");
+    cr_arena_checkpoint(p, a->saved_unload);
+}
+
+// internal
+static void cr_arena_destroy(cr_plugin &ctx) {
+    auto p = (cr_internal *)ctx.p;
+    auto a = p->arena;
+    if (!a) {
+        return;
+    }
+    for (auto &slot : cr_arena_list) {
+        cr_arena_state *cur = a;
+        slot.compare_exchange_strong(cur, nullptr);
+    }
+    cr_arena_release(a->arena.base, a->reserved);
+    cr_arena_release(a->shadow, a->reserved);
+    a->~cr_arena_state();
+    CR_FREE(a);
+    p->arena = nullptr;
+    ctx.arena = nullptr;
+}
+
+// internal
+// Restores a page of a section restored on demand on its first access.
+// Called by the crash handler, returns false if the address is not in a page
+// left to restore.
+static bool cr_lazy_fault(void *addr) {
+    // seq_cst with the unlisting in cr_lazy_finish, either it waits for us or
+    // we don't see the section
+    cr_lazy_users++;
+    bool found = false;
+    for (auto &slot : cr_lazy_list) {
+        auto l = slot.load();
+        if (!l || (char *)addr < l->ptr || (char *)addr >= l->ptr + l->size) {
+            continue;
+        }
+        // another thread may be restoring it, wait until done
+        const size_t n = ((char *)addr - l->ptr) / l->page;
+        uint8_t pending = 0;
+        if (l->pages[n].compare_exchange_strong(pending, 1)) {
+            const size_t at = n * l->page;
+            cr_lazy_fill(l->mem, l->ptr + at, l->data + at, l->page);
+            l->pages[n].store(2, std::memory_order_release);
+        }
+        while (l->pages[n].load(std::memory_order_acquire) != 2) {
+            std::this_thread::yield();
+        }
+        found = true;
+        break;
+    }
+    cr_lazy_users--;
+    return found;
+}
+
+// internal
+static void cr_lazy_delete(cr_lazy_section *l) {
+    l->~cr_lazy_section();
+    CR_FREE(l);
+}
+
+// internal
+// Leaves the whole pages of a section to restore on demand, copying only its
+// head and tail. Returns false if the section must be copied instead.
+static bool cr_lazy_restore(cr_internal *p, int i, char *dest,
+                            const char *data, int64_t len) {
+    if (!p->lazy_restore || p->lazy[i] || len < CR_LAZY_MIN_SIZE) {
+        return false;
+    }
+    const size_t page = cr_arena_page_size();
+    auto from = (char *)(((uintptr_t)dest + page - 1) / page * page);
+    auto to = (char *)(((uintptr_t)dest + len) / page * page);
+    if (to <= from) {
+        return false;
+    }
+    auto l = new(CR_MALLOC(sizeof(cr_lazy_section))) cr_lazy_section;
+    l->ptr = from;
+    l->data = data + (from - dest);
+    l->size = to - from;
+    l->page = page;
+    l->mem = cr_lazy_mem();
+    const size_t count = l->size / page;
+    l->pages = (std::atomic<uint8_t> *)CR_MALLOC(count);
+    for (size_t n = 0; n < count; ++n) {
+        new(&l->pages[n]) std::atomic<uint8_t>(0);
+    }
+    std::atomic<cr_lazy_section *> *listed = nullptr;
+    for (auto &slot : cr_lazy_list) {
+        cr_lazy_section *none = nullptr;
+        if (slot.compare_exchange_strong(none, l)) {
+            listed = &slot;
+            break;
+        }
+    }
+    if (!listed || !cr_lazy_protect(from, l->size)) {
+        if (listed) {
+            listed->store(nullptr);
+            while (cr_lazy_users.load()) {
+                std::this_thread::yield();
+            }
+        }
+        cr_lazy_delete(l);
+        return false;
+    }
+    std::memcpy(dest, data, from - dest);
+    std::memcpy(to, data + (to - dest), dest + len - to);
+    p->lazy[i] = l;
+    return true;
+}
+
+// internal
+// Restores the pages of the sections restored on demand not accessed yet,
+// before the state is stored or rewritten, or its image unloaded.
+static void cr_lazy_finish(cr_internal *p) {
+    for (auto &l : p->lazy) {
+        if (!l) {
+            continue;
+        }
+        CR_TRACE
+        const size_t count = l->size / l->page;
+        size_t restored = 0;
+        for (size_t n = 0; n < count;) {
+            // claim a run of pages to restore at once
+            size_t end = n;
+            uint8_t pending = 0;
+            while (end < count &&
+                   l->pages[end].compare_exchange_strong(pending, 1)) {
+                pending = 0;
+                ++end;
+            }
+            if (end == n) {
+                // a crash handler is restoring it
+                while (l->pages[n].load(std::memory_order_acquire) != 2) {
+                    std::this_thread::yield();
+                }
+                ++n;
+                continue;
+            }
+            const size_t at = n * l->page;
+            cr_lazy_fill(l->mem, l->ptr + at, l->data + at,
+                         (end - n) * l->page);
+            restored += end - n;
+            for (; n < end; ++n) {
+                l->pages[n].store(2, std::memory_order_release);
+            }
+        }
+        CR_LOG("lazy restore: %zu of %zu pages never accessed\n", restored,
+               count);
+        for (auto &slot : cr_lazy_list) {
+            cr_lazy_section *cur = l;
+            slot.compare_exchange_strong(cur, nullptr);
+        }
+        // a handler may have found it just before it was unlisted
+        while (cr_lazy_users.load()) {
+            std::this_thread::yield();
+        }
+        cr_lazy_delete(l);
+        l = nullptr;
+    }
+}
+
+// internal
+// Keeps the values of the CR_SECTION_PERSIST sections of a version that
+// crashed, the version rolled back to gets them instead of the stored ones.
+static void cr_plugin_sections_persist(cr_plugin &ctx) {
+    auto p = (cr_internal *)ctx.p;
+    auto snap = cr_snapshot_at(p, 0);
+    if (p->mode == CR_DISABLE || !snap) {
+        return;
+    }
+    for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+        const auto &cur = p->sections[i];
+        auto &sec = snap->sections[i];
+        if (p->section_policy[i] != CR_SECTION_PERSIST || !cur.ptr ||
+            !sec.ptr || sec.size != cur.size) {
+            continue;
+        }
+        // the newest history entry is a delta to the state replaced
+        cr_history_clear(p);
+        const auto &map = p->remap[i];
+        cr_state_copy(sec.data, cur.ptr, cur.size, map);
+        if (map.fd >= 0) {
+            cr_state_remap_writeback(map, cur.ptr + map.offset, false);
+        }
+        sec.sparse.clear();
+        CR_LOG("persisted section %s\n", p->section_names[i].c_str());
+    }
+}
+
+// internal
+// After a load happens reload the global state from previous version from one
+// of the snapshots created during the unload steps.
+static void cr_plugin_sections_reload(cr_plugin &ctx, cr_snapshot &snap) {
+    auto p = (cr_internal *)ctx.p;
+    if (p->mode == CR_DISABLE) {
+        return;
+    }
+    CR_TRACE
+
+    for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+        auto &src = snap.sections[i];
+        // restore backup into the current section address as it may
+        // change due aslr and backup address may be invalid
+        auto dest = (char *)p->sections[i].ptr;
+        if (!src.ptr || !dest) {
+            continue;
+        }
+        const int64_t size = p->sections[i].size;
+        const int64_t len = std::min(src.size, size);
+        const bool migrate = cr_section_migrates(p, src, p->sections[i]);
+        const bool newest = &snap == cr_snapshot_at(p, 0);
+        auto &map = p->remap[i];
+        if (map.fd >= 0 &&
+            (migrate || !newest || !cr_state_remap_map(map, dest, size))) {
+            // laid out differently (or an older state), fallback to copying
+            CR_LOG("state remap: layout changed, copying\n");
+            cr_state_remap_release(p, i);
+        }
+        if (migrate) {
+            cr_section_migrate((cr_plugin_section_type::e)i, src,
+                               p->sections[i]);
+            continue;
+        }
+        if (map.fd < 0 && src.sparse.empty() && !p->state_remap &&
+            cr_lazy_restore(p, i, dest, (const char *)src.data, len)) {
+            CR_LOG("lazy restore: section %s\n", p->section_names[i].c_str());
+        } else if (map.fd >= 0 || src.sparse.empty()) {
+            cr_state_copy(dest, src.data, len, map);
+        } else {
+            // pages never touched are zero, the destination may not be (i.e.
+            // a standby image) and only its populated pages are zeroed
+            auto data = (const char *)src.data;
+            cr_sparse_runs(src, len,
+                           [&](int64_t from, int64_t to, bool populated) {
+                if (populated) {
+                    cr_state_memcpy(dest + from, data + from, to - from);
+                } else {
+                    cr_pages_zero(dest + from, to - from);
+                }
+            });
+        }
+        // a section that grew starts zeroed
+        if (size > len) {
+            std::memset(dest + len, 0, size - len);
+        }
+    }
+}
+
+// internal
+// Cleanup and frees any temporary memory used to keep global static data
+// between sessions, used during shutdown.
+static void cr_so_sections_free(cr_plugin &ctx) {
+    CR_TRACE
+    auto p = (cr_internal *)ctx.p;
+    cr_history_clear(p);
+    for (auto &snap : p->snapshots) {
+        cr_snapshot_release(snap);
+    }
+    p->snapshots.clear();
+    p->snapshot_head = 0;
+    p->snapshot_count = 0;
+    for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+        cr_state_remap_close(p->remap[i]);
+    }
+}
+
+// internal
+// Checkpoints copy the pages written since the previous checkpoint, tracked
+// with soft-dirty bits (Linux). As clearing these bits affects the whole
+// process, all checkpoints are serialized and before clearing we keep the
+// bits of the other plugins. A plugin whose step ran while the bits were
+// cleared may have lost some, so its next checkpoint copies everything.
+struct cr_dirty_tracker {
+    std::mutex lock;
+    std::vector<cr_plugin *> plugins;
+    std::atomic<unsigned int> epoch{0};
+    bool supported = false;
+    bool probed = false;
+};
+
+// internal
+static cr_dirty_tracker &cr_dirty_tracker_get() {
+    static cr_dirty_tracker tracker;
+    return tracker;
+}
+
+// internal
+static bool cr_plugin_checkpoint_enabled(cr_internal *p) {
+    return p->checkpoint.steps || p->checkpoint.ms;
+}
+
+// internal
+// Points the checkpoint at the sections of the loaded image, a checkpoint of
+// another size is dropped. The dirty tracker lock must be held.
+static void cr_plugin_checkpoint_track(cr_internal *p) {
+    auto &cp = p->checkpoint;
     for (int i = 0; i < cr_plugin_section_type::count; ++i) {
-        if (p->data[i][version].ptr && p->data[i][version].data) {
-            const char *ptr = p->data[i][version].ptr;
-            const int64_t len = p->data[i][version].size;
-            std::memcpy(p->data[i][version].data, ptr, len);
+        auto &snap = cp.sections[i];
+        const auto &cur = p->sections[i];
+        if (snap.size != cur.size) {
+            snap.data = CR_REALLOC(snap.data, cur.size);
+            snap.size = cur.size;
+            cp.valid = false;
         }
+        snap.ptr = cur.ptr;
+        snap.symbols = cur.symbols;
+        cp.dirty[i].clear();
     }
+}
 
-    cr_plugin_sections_backup(ctx);
+// internal
+// Adds or removes the plugin from the dirty tracker accordingly to its
+// checkpoint settings.
+static void cr_plugin_checkpoint_register(cr_plugin &ctx) {
+    auto p = (cr_internal *)ctx.p;
+    auto &t = cr_dirty_tracker_get();
+    std::lock_guard<std::mutex> guard(t.lock);
+    auto it = std::find(t.plugins.begin(), t.plugins.end(), &ctx);
+    if (cr_plugin_checkpoint_enabled(p) && it == t.plugins.end()) {
+        if (!t.probed) {
+            t.probed = true;
+            t.supported = cr_soft_dirty_probe();
+            t.epoch++;
+        }
+        t.plugins.push_back(&ctx);
+    } else if (!cr_plugin_checkpoint_enabled(p) && it != t.plugins.end()) {
+        t.plugins.erase(it);
+    }
+    // enabled after the load, the install didn't track the sections
+    if (cr_plugin_checkpoint_enabled(p) && p->handle) {
+        cr_plugin_checkpoint_track(p);
+    }
+    p->checkpoint.valid = false;
+    p->checkpoint.full = true;
+    p->checkpoint.due = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(p->checkpoint.ms);
 }
 
 // internal
-// After a load happens reload the global state from previous version from our
-// internal copy created during the unload step.
-static void cr_plugin_sections_reload(cr_plugin &ctx,
-                                      cr_plugin_section_version::e version) {
-    CR_ASSERT(version < cr_plugin_section_version::count);
+// Tracks the sections of a newly installed image. The checkpoint is kept
+// only when rolling back to it, otherwise the state stored during unload is
+// newer.
+static void cr_plugin_checkpoint_reset(cr_plugin &ctx, bool rollback) {
     auto p = (cr_internal *)ctx.p;
-    if (p->mode == CR_DISABLE) {
+    auto &cp = p->checkpoint;
+    if (!cr_plugin_checkpoint_enabled(p)) {
         return;
     }
-    CR_TRACE
+    auto &t = cr_dirty_tracker_get();
+    std::lock_guard<std::mutex> guard(t.lock);
+    cr_plugin_checkpoint_track(p);
+    cp.valid &= rollback;
+    cp.full = true;
+    cp.counter = 0;
+}
+
+// internal
+// Restores the last checkpoint into a rolled back image, if it fits.
+static bool cr_plugin_checkpoint_restore(cr_plugin &ctx) {
+    auto p = (cr_internal *)ctx.p;
+    auto &cp = p->checkpoint;
+    if (!cr_plugin_checkpoint_enabled(p) || !cp.valid) {
+        return false;
+    }
+    for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+        const auto &snap = cp.sections[i];
+        if (snap.data && snap.size > p->sections[i].size &&
+            !cr_section_migrates(p, snap, p->sections[i])) {
+            CR_LOG("checkpoint doesn't fit the rolled back version\n");
+            return false;
+        }
+    }
+    for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+        const auto &snap = cp.sections[i];
+        auto dest = p->sections[i].ptr;
+        // the crashed version values were kept, they are newer
+        if (!snap.data || !dest ||
+            p->section_policy[i] == CR_SECTION_PERSIST) {
+            continue;
+        }
+        if (cr_section_migrates(p, snap, p->sections[i])) {
+            cr_section_migrate((cr_plugin_section_type::e)i, snap,
+                               p->sections[i]);
+        } else {
+            cr_state_memcpy(dest, snap.data, snap.size);
+        }
+    }
+    CR_LOG("restored checkpoint\n");
+    return true;
+}
 
+// internal
+// Copies the pages dirtied since the previous checkpoint, or all of them.
+static void cr_plugin_checkpoint(cr_plugin &ctx) {
+    CR_TRACE
+    auto p = (cr_internal *)ctx.p;
+    cr_lazy_finish(p);
+    auto &cp = p->checkpoint;
+    auto &t = cr_dirty_tracker_get();
+    std::lock_guard<std::mutex> guard(t.lock);
+    const bool full = cp.full || !t.supported || cp.epoch != t.epoch;
+    bool copied = false;
     for (int i = 0; i < cr_plugin_section_type::count; ++i) {
-        if (p->data[i][version].data) {
-            const int64_t len = p->data[i][version].size;
-            // restore backup into the current section address as it may
-            // change due aslr and backup address may be invalid
-            const auto current = cr_plugin_section_version::current;
-            auto dest = (void *)p->data[i][current].ptr;
-            if (dest) {
-                std::memcpy(dest, p->data[i][version].data, len);
+        auto &snap = cp.sections[i];
+        if (!snap.ptr || !snap.data) {
+            continue;
+        }
+        copied = true;
+        cr_plugin_section dirty;
+        dirty.size = snap.size;
+        auto &pending = cp.dirty[i];
+        auto dst = (char *)snap.data;
+        if (full || !cr_pages_soft_dirty(snap.ptr, snap.size, dirty)) {
+            pending.clear();
+            // a large .bss may be mostly never touched, like in transfers
+            if (i != cr_plugin_section_type::bss ||
+                snap.size < CR_SPARSE_MIN_SIZE ||
+                !cr_pages_populated(snap.ptr, snap.size, dirty)) {
+                cr_state_memcpy(dst, snap.ptr, snap.size);
+                continue;
+            }
+            cr_sparse_runs(dirty, snap.size,
+                           [&](int64_t from, int64_t to, bool populated) {
+                if (populated) {
+                    cr_state_memcpy(dst + from, snap.ptr + from, to - from);
+                } else {
+                    cr_pages_zero(dst + from, to - from);
+                }
+            });
+            continue;
+        }
+        if (pending.size() == dirty.sparse.size()) {
+            for (size_t n = 0; n < dirty.sparse.size(); ++n) {
+                dirty.sparse[n] |= pending[n];
+            }
+        }
+        pending.clear();
+        cr_sparse_runs(dirty, snap.size,
+                       [&](int64_t from, int64_t to, bool written) {
+            if (written) {
+                cr_state_memcpy(dst + from, snap.ptr + from, to - from);
+            }
+        });
+    }
+
+    // keep the bits of the other plugins before clearing them
+    for (auto other : t.supported ? t.plugins : std::vector<cr_plugin *>()) {
+        auto &ocp = ((cr_internal *)other->p)->checkpoint;
+        for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+            auto &osnap = ocp.sections[i];
+            if (other == &ctx || !osnap.ptr) {
+                continue;
+            }
+            cr_plugin_section dirty;
+            if (!cr_pages_soft_dirty(osnap.ptr, osnap.size, dirty)) {
+                ocp.full = true;
+                continue;
+            }
+            auto &pending = ocp.dirty[i];
+            if (pending.size() != dirty.sparse.size()) {
+                pending.assign(dirty.sparse.size(), 0);
+            }
+            for (size_t n = 0; n < dirty.sparse.size(); ++n) {
+                pending[n] |= dirty.sparse[n];
+            }
+        }
+    }
+
+    if (t.supported && !cr_soft_dirty_clear()) {
+        t.supported = false;
+    }
+    cp.epoch = ++t.epoch;
+    // nothing to restore from if the sections aren't tracked
+    cp.valid = copied;
+    cp.full = !copied;
+}
+
+// internal
+// Called around each step, checkpoints when due. A step that ran while
+// another plugin cleared the dirty bits forces a full checkpoint.
+static void cr_plugin_checkpoint_step(cr_plugin &ctx, bool begin, bool ok) {
+    auto p = (cr_internal *)ctx.p;
+    auto &cp = p->checkpoint;
+    if (!cr_plugin_checkpoint_enabled(p)) {
+        return;
+    }
+    auto &t = cr_dirty_tracker_get();
+    if (begin) {
+        cp.epoch = t.epoch.load();
+        return;
+    }
+    if (cp.epoch != t.epoch.load()) {
+        cp.full = true;
+    }
+    if (!ok) {
+        return;
+    }
+
+    bool due = false;
+    if (cp.steps && ++cp.counter >= cp.steps) {
+        cp.counter = 0;
+        due = true;
+    }
+    if (cp.ms) {
+        const auto now = std::chrono::steady_clock::now();
+        if (now >= cp.due) {
+            cp.due = now + std::chrono::milliseconds(cp.ms);
+            due = true;
+        }
+    }
+    if (due) {
+        cr_plugin_checkpoint(ctx);
+        cr_arena_checkpoint(p, false);
+    }
+}
+
+// internal
+static void cr_plugin_checkpoint_free(cr_plugin &ctx) {
+    auto p = (cr_internal *)ctx.p;
+    p->checkpoint.steps = 0;
+    p->checkpoint.ms = 0;
+    cr_plugin_checkpoint_register(ctx);
+    for (auto &snap : p->checkpoint.sections) {
+        CR_FREE(snap.data);
+        snap = cr_plugin_section();
+    }
+}
+
+#if defined(CR_LINUX)
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+// linux,internal
+// Event driven change detection. A single inotify instance is shared by all
+// open plugins so that checking for a new version doesn't need to stat() the
+// file on every update. We watch the parent directory instead of the file
+// itself so atomic renames done by linkers and build systems are also seen.
+// Each plugin owns a generation counter bumped by the event dispatcher, the
+// update hot path only compares it against the last generation it saw.
+struct cr_watch {
+    std::string name = {};
+    int wd = -1;
+    std::atomic<unsigned int> generation{0};
+};
+
+struct cr_watcher {
+    std::mutex mutex;
+    int fd = -1;
+    int wakeup = -1;
+    std::vector<cr_watch *> watches;
+    std::thread thread;
+    std::atomic<bool> enabled{false};
+
+    ~cr_watcher() {
+        stop();
+        if (fd != -1) {
+            close(fd);
+        }
+        if (wakeup != -1) {
+            close(wakeup);
+        }
+    }
+
+    bool init() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (fd == -1) {
+            fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (fd == -1) {
+                CR_ERROR("Couldn't initialize inotify: %d\n", errno);
+                return false;
+            }
+        }
+        enabled = true;
+        return true;
+    }
+
+    void stop() {
+        if (!thread.joinable()) {
+            return;
+        }
+        const uint64_t one = 1;
+        if (write(wakeup, &one, sizeof(one)) != sizeof(one)) {
+            CR_ERROR("Couldn't wake up watcher thread\n");
+        }
+        thread.join();
+    }
+};
+
+static cr_watcher &cr_watcher_get() {
+    static cr_watcher watcher;
+    return watcher;
+}
+
+// linux,internal
+// Drains all pending inotify events bumping the generation of any plugin
+// whose file was touched. An overflowed queue bumps everything so that the
+// next update falls back to check the file timestamp.
+static void cr_watch_dispatch_events(cr_watcher &w) {
+    alignas(struct inotify_event) char buf[4096];
+    for (;;) {
+        const ssize_t len = read(w.fd, buf, sizeof(buf));
+        if (len <= 0) {
+            break;
+        }
+
+        std::lock_guard<std::mutex> lock(w.mutex);
+        for (char *ptr = buf; ptr < buf + len;) {
+            auto ev = (const struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + ev->len;
+            for (auto watch : w.watches) {
+                if ((ev->mask & IN_Q_OVERFLOW) ||
+                    (ev->wd == watch->wd && ev->len &&
+                     watch->name == ev->name)) {
+                    watch->generation.fetch_add(1, std::memory_order_release);
+                }
+            }
+        }
+    }
+}
+
+static void cr_watch_add(cr_plugin &ctx) {
+    auto p = (cr_internal *)ctx.p;
+    auto &w = cr_watcher_get();
+    if (p->watch || !w.enabled) {
+        return;
+    }
+
+    std::string folder, fname, ext;
+    cr_split_path(p->fullname, folder, fname, ext);
+    if (folder.empty()) {
+        folder = ".";
+    }
+
+    // IN_MODIFY happens while the image is still being written, but also
+    // when only the mtime changes. Writes in progress are filtered by the
+    // image readiness check, it is IN_CLOSE_WRITE or an atomic rename in
+    // place (IN_MOVED_TO) that normally tells us a new image is complete.
+    const uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB;
+    std::lock_guard<std::mutex> lock(w.mutex);
+    const int wd = inotify_add_watch(w.fd, folder.c_str(), mask);
+    if (wd == -1) {
+        CR_ERROR("Couldn't watch '%s': %d\n", folder.c_str(), errno);
+        return;
+    }
+
+    auto watch = new (CR_MALLOC(sizeof(cr_watch))) cr_watch;
+    watch->name = fname + ext;
+    watch->wd = wd;
+    w.watches.push_back(watch);
+    p->watch = watch;
+    p->watch_generation = 0;
+}
+
+static void cr_watch_remove(cr_plugin &ctx) {
+    auto p = (cr_internal *)ctx.p;
+    if (!p->watch) {
+        return;
+    }
+
+    auto &w = cr_watcher_get();
+    std::lock_guard<std::mutex> lock(w.mutex);
+    auto watch = p->watch;
+    w.watches.erase(std::remove(w.watches.begin(), w.watches.end(), watch),
+                    w.watches.end());
+    // inotify returns the same descriptor for the same directory, only drop
+    // it if no other plugin lives there.
+    bool shared = false;
+    for (auto other : w.watches) {
+        shared |= other->wd == watch->wd;
+    }
+    if (!shared) {
+        inotify_rm_watch(w.fd, watch->wd);
+    }
+    watch->~cr_watch();
+    CR_FREE(watch);
+    p->watch = nullptr;
+}
+
+// Enables event based change detection and returns a pollable file
+// descriptor that becomes readable when any watched plugin changes. Add it to
+// your own poll/epoll loop and call `cr_watch_dispatch` when readable.
+extern "C" int cr_watch_fd() {
+    auto &w = cr_watcher_get();
+    return w.init() ? w.fd : -1;
+}
+
+// Drains pending change notifications without blocking.
+extern "C" void cr_watch_dispatch() {
+    auto &w = cr_watcher_get();
+    if (w.fd != -1) {
+        cr_watch_dispatch_events(w);
+    }
+}
+
+// Enables event based change detection with a background thread taking care
+// of dispatching the notifications, the host doesn't need to poll anything.
+extern "C" bool cr_watch_start() {
+    auto &w = cr_watcher_get();
+    if (!w.init()) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(w.mutex);
+    if (w.thread.joinable()) {
+        return true;
+    }
+    if (w.wakeup == -1) {
+        w.wakeup = eventfd(0, EFD_CLOEXEC);
+        if (w.wakeup == -1) {
+            CR_ERROR("Couldn't create watcher eventfd: %d\n", errno);
+            return false;
+        }
+    }
+
+    w.thread = std::thread([&w]() {
+        struct pollfd fds[2] = {{w.fd, POLLIN, 0}, {w.wakeup, POLLIN, 0}};
+        for (;;) {
+            if (poll(fds, 2, -1) == -1 && errno != EINTR) {
+                break;
+            }
+            if (fds[1].revents & POLLIN) {
+                uint64_t value;
+                (void)!read(w.wakeup, &value, sizeof(value));
+                break;
+            }
+            if (fds[0].revents & POLLIN) {
+                cr_watch_dispatch_events(w);
+            }
+        }
+    });
+    return true;
+}
+
+// Stops the background watcher thread. Watching continues to be enabled and
+// `cr_watch_dispatch` must be called by the host from now on.
+extern "C" void cr_watch_stop() {
+    cr_watcher_get().stop();
+}
+
+#else
+
+static void cr_watch_add(cr_plugin &) {
+}
+
+static void cr_watch_remove(cr_plugin &) {
+}
+
+extern "C" int cr_watch_fd() {
+    return -1;
+}
+
+extern "C" void cr_watch_dispatch() {
+}
+
+extern "C" bool cr_watch_start() {
+    return false;
+}
+
+extern "C" void cr_watch_stop() {
+}
+
+#endif // CR_LINUX
+
+// internal
+// Parses the build manifest, a text file listing one completed plugin per
+// line by file name and optionally its build id in hexadecimal:
+//
+//     libgame.so 05b006576d6660641638709629f45cb8a621fd32
+//
+// Without a build id the manifest must be newer than the plugin image.
+static bool cr_manifest_ready(cr_plugin &ctx, int64_t timestamp) {
+    auto p = (cr_internal *)ctx.p;
+    FILE *fp = fopen(p->manifest.c_str(), "r");
+    if (!fp) {
+        return false;
+    }
+
+    std::string folder, fname, ext;
+    cr_split_path(p->fullname, folder, fname, ext);
+    const std::string name = fname + ext;
+
+    bool result = false;
+    char line[1024];
+    while (!result && fgets(line, sizeof(line), fp)) {
+        char entry[512] = {}, id[256] = {};
+        const int n = sscanf(line, "%511s %255s", entry, id);
+        if (n < 1 || name != entry) {
+            continue;
+        }
+
+        if (n == 1) {
+            result = cr_last_write_time(p->manifest) >= timestamp;
+            continue;
+        }
+
+        // decode the id ignoring separators (ie. dashes in uuids)
+        unsigned char bytes[128];
+        size_t len = 0;
+        for (const char *c = id; c[0] && c[1] && len < sizeof(bytes);) {
+            unsigned int byte;
+            if (!isxdigit((unsigned char)c[0])) {
+                c++;
+            } else if (sscanf(c, "%2x", &byte) == 1) {
+                bytes[len++] = (unsigned char)byte;
+                c += 2;
+            } else {
+                break;
             }
         }
+        result = len && cr_hash(bytes, len) == cr_image_fingerprint(p->fullname);
+    }
+    fclose(fp);
+    return result;
+}
+
+// internal
+// Checks if the plugin image is complete and ready to be loaded. If a build
+// manifest is set, it must list the new image, the first load doesn't wait
+// for the manifest as the host explicitly asked for the current image.
+static bool cr_plugin_image_ready(cr_plugin &ctx, int64_t timestamp) {
+    auto p = (cr_internal *)ctx.p;
+    if (ctx.version && !p->manifest.empty() &&
+        !cr_manifest_ready(ctx, timestamp)) {
+        return false;
     }
+    return cr_image_complete(p->fullname);
 }
 
 // internal
-// Cleanup and frees any temporary memory used to keep global static data
-// between sessions, used during shutdown.
-static void cr_so_sections_free(cr_plugin &ctx) {
-    CR_TRACE
+// The image isn't ready yet, wait exponentially longer until trying again.
+static void cr_plugin_backoff(cr_plugin &ctx) {
     auto p = (cr_internal *)ctx.p;
-    for (int i = 0; i < cr_plugin_section_type::count; ++i) {
-        for (int v = 0; v < cr_plugin_section_version::count; ++v) {
-            if (p->data[i][v].data) {
-                CR_FREE(p->data[i][v].data);
-            }
-            p->data[i][v].data = nullptr;
-        }
-    }
+    p->retry_delay = p->retry_delay ? p->retry_delay * 2 : CR_RETRY_MIN_MS;
+    p->retry_delay = std::min(p->retry_delay, CR_RETRY_MAX_MS);
+    p->retry_at = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(p->retry_delay);
+    CR_LOG("image not ready, retrying in %dms\n", p->retry_delay);
 }
 
 static bool cr_plugin_changed(cr_plugin &ctx) {
     auto p = (cr_internal *)ctx.p;
+    if (p->retry_delay && std::chrono::steady_clock::now() < p->retry_at) {
+        return false;
+    }
+
+    const auto seen_generation = p->watch_generation;
+    (void)seen_generation;
+#if defined(CR_LINUX)
+    if (p->watch) {
+        // nothing happened to our file since the last check, skip the stat()
+        const auto gen = p->watch->generation.load(std::memory_order_acquire);
+        if (gen == p->watch_generation) {
+            return false;
+        }
+        p->watch_generation = gen;
+    } else {
+        cr_watch_add(ctx);
+    }
+#endif
     const auto src = cr_last_write_time(p->fullname);
     const auto cur = p->timestamp;
-    return src > cur;
+    if (src <= cur) {
+        return false;
+    }
+
+    if (!cr_plugin_image_ready(ctx, src)) {
+        // keep looking even if no other notification comes for this file
+        p->watch_generation = seen_generation;
+        cr_plugin_backoff(ctx);
+        return false;
+    }
+    p->retry_delay = 0;
+
+    // a touch or a no-op relink, nothing to reload
+    if (p->skip_identical && ctx.version &&
+        cr_image_fingerprint(p->fullname) == p->fingerprint) {
+        CR_LOG("skipping identical image '%s'\n", p->fullname.c_str());
+        p->timestamp = src;
+        return false;
+    }
+    return true;
 }
 
 // internal
@@ -1939,6 +6584,7 @@ static int cr_plugin_unload(cr_plugin &ctx, bool rollback, bool close) {
     auto p = (cr_internal *)ctx.p;
     int r = 0;
     if (p->handle) {
+        cr_lazy_finish(p);
         if (!rollback) {
             r = cr_plugin_main(ctx, close ? CR_CLOSE : CR_UNLOAD);
             // Don't store state if unload crashed.  Rollback will use backup.
@@ -1946,11 +6592,23 @@ static int cr_plugin_unload(cr_plugin &ctx, bool rollback, bool close) {
                 CR_LOG("4 FAILURE: %d\n", r);
             } else {
                 cr_plugin_sections_store(ctx);
+                cr_arena_checkpoint(p, true);
             }
+        } else {
+            cr_plugin_sections_persist(ctx);
+        }
+        // a crashing version is not worth keeping around
+        if (!rollback && !close && r >= 0 && p->standby_depth) {
+            cr_plugin_standby_push(ctx, p->image);
+        } else {
+            cr_so_unload(ctx);
         }
-        cr_so_unload(ctx);
         p->handle = nullptr;
         p->main = nullptr;
+        p->image.handle = nullptr;
+    }
+    if (close) {
+        cr_plugin_standby_free(ctx);
     }
     return r;
 }
@@ -1977,11 +6635,19 @@ static bool cr_plugin_rollback(cr_plugin &ctx) {
 // handling during this first update, effectivelly rollbacking if possible and
 // causing a consecutive `CR_LOAD` with the previous version.
 static void cr_plugin_reload(cr_plugin &ctx) {
-    if (cr_plugin_changed(ctx)) {
+    auto p = (cr_internal *)ctx.p;
+    bool loaded = false;
+    // the first load is always done in place
+    if (p->staging && p->main) {
+        loaded = cr_plugin_staging_update(ctx);
+    } else if (p->reload_budget >= 0 && p->main) {
+        loaded = cr_plugin_incremental_update(ctx);
+    } else if (cr_plugin_changed(ctx)) {
         CR_TRACE
-        if (!cr_plugin_load_internal(ctx, false)) {
-            return;
-        }
+        loaded = cr_plugin_load_internal(ctx, false);
+    }
+
+    if (loaded) {
         int r = cr_plugin_main(ctx, CR_LOAD);
         if (r < 0 && !ctx.failure) {
             CR_LOG("2 FAILURE: %d\n", r);
@@ -1990,11 +6656,11 @@ static void cr_plugin_reload(cr_plugin &ctx) {
     }
 }
 
-// This is basically the plugin `main` function, should be called as
-// frequently as your core logic/application needs. -1 and -2 are the only
-// possible return values from cr meaning a fatal error (causes rollback),
-// other return values are returned directly from `cr_main`.
-extern "C" int cr_plugin_update(cr_plugin &ctx, bool reloadCheck = true) {
+// internal
+// Common part of `cr_plugin_update` and `cr_plugin_update_n`: rollbacks a
+// previous failure or checks for a new version. Returns false if the plugin
+// can't be stepped.
+static bool cr_plugin_update_prepare(cr_plugin &ctx, bool reloadCheck) {
     if (ctx.failure) {
         CR_LOG("1 ROLLBACK version was %d\n", ctx.version);
         cr_plugin_rollback(ctx);
@@ -2013,17 +6679,361 @@ extern "C" int cr_plugin_update(cr_plugin &ctx, bool reloadCheck = true) {
     // happened probably during load or unload and not update
     if (ctx.failure) {
         CR_LOG("3 FAILURE: -2\n");
+        return false;
+    }
+
+    // no image loaded yet, still waiting for it to be ready
+    return ((cr_internal *)ctx.p)->main != nullptr;
+}
+
+// This is basically the plugin `main` function, should be called as
+// frequently as your core logic/application needs. -1 and -2 are the only
+// possible return values from cr meaning a fatal error (causes rollback),
+// other return values are returned directly from `cr_main`.
+extern "C" int cr_plugin_update(cr_plugin &ctx, bool reloadCheck = true) {
+    if (!cr_plugin_update_prepare(ctx, reloadCheck)) {
         return -2;
     }
 
+    cr_plugin_checkpoint_step(ctx, true, true);
     int r = cr_plugin_main(ctx, CR_STEP);
     if (r < 0 && !ctx.failure) {
         CR_LOG("4 FAILURE: CR_USER\n");
         ctx.failure = CR_USER;
     }
+    cr_plugin_checkpoint_step(ctx, false, !ctx.failure);
+    if (!ctx.failure) {
+        cr_state_share_publish(ctx);
+    }
     return r;
 }
 
+// Batched `cr_plugin_update`: one reload check and one protection frame for
+// `n` calls to `cr_main`. Returns the number of completed iterations, if less
+// than `n` the iteration at that index failed (see `ctx.failure`). Returns -2
+// in the same cases as `cr_plugin_update`.
+extern "C" int cr_plugin_update_n(cr_plugin &ctx, unsigned int n, int *results,
+                                  bool reloadCheck = true) {
+    if (!cr_plugin_update_prepare(ctx, reloadCheck)) {
+        return -2;
+    }
+
+    cr_plugin_checkpoint_step(ctx, true, true);
+    unsigned int done = cr_plugin_main_n(ctx, n, results);
+    if (done < n && !ctx.failure) {
+        CR_LOG("4 FAILURE: CR_USER at %u\n", done);
+        ctx.failure = CR_USER;
+    }
+    cr_plugin_checkpoint_step(ctx, false, !ctx.failure);
+    if (!ctx.failure) {
+        cr_state_share_publish(ctx);
+    }
+    return (int)done;
+}
+
+// internal
+// Restores a stored state into the running version, if compatible.
+static bool cr_plugin_snapshot_restore(cr_plugin &ctx, cr_snapshot &snap) {
+    auto p = (cr_internal *)ctx.p;
+    for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+        const auto type = (cr_plugin_section_type::e)i;
+        const auto &sec = p->sections[i];
+        if (sec.ptr &&
+            !cr_plugin_section_compatible(ctx, type, snap.sections[i], sec)) {
+            CR_LOG("state of version %u doesn't fit the running version\n",
+                   snap.version);
+            return false;
+        }
+    }
+    cr_plugin_sections_reload(ctx, snap);
+    if (p->image.map && snap.map) {
+        cr_lazy_finish(p);
+        cr_plugin_relocate(ctx, snap.map.get(), nullptr, *p->image.map);
+    }
+    // the restored state is newer than the last checkpoint
+    cr_plugin_checkpoint_reset(ctx, false);
+    return true;
+}
+
+// Restores the state stored `depth` unloads ago into the running version, see
+// `cr_set_snapshots`.
+extern "C" bool cr_plugin_restore(cr_plugin &ctx, unsigned int depth) {
+    CR_TRACE
+    auto p = (cr_internal *)ctx.p;
+    if (!p || !p->handle || p->mode == CR_DISABLE) {
+        return false;
+    }
+    auto snap = cr_snapshot_at(p, depth);
+    if (!snap) {
+        return false;
+    }
+    if (depth && snap->partial) {
+        CR_LOG("snapshot %u was partially kept in a memfd\n", depth);
+        return false;
+    }
+    return cr_plugin_snapshot_restore(ctx, *snap);
+}
+
+// Restores the state stored by the last unload of `version` into the running
+// version, from the snapshots or the history, see `cr_set_history`.
+extern "C" bool cr_plugin_restore_version(cr_plugin &ctx,
+                                          unsigned int version) {
+    CR_TRACE
+    auto p = (cr_internal *)ctx.p;
+    if (!p || !p->handle || p->mode == CR_DISABLE) {
+        return false;
+    }
+    for (unsigned int depth = 0; depth < p->snapshot_count; ++depth) {
+        if (cr_snapshot_at(p, depth)->version == version) {
+            return cr_plugin_restore(ctx, depth);
+        }
+    }
+    cr_history_wait(p);
+    cr_snapshot snap;
+    if (!cr_history_rebuild(p, version, snap)) {
+        return false;
+    }
+    const bool restored = cr_plugin_snapshot_restore(ctx, snap);
+    // the rebuilt state is released, nothing is left to restore from it
+    cr_lazy_finish(p);
+    cr_snapshot_release(snap);
+    CR_LOG("restored version %u from the history\n", version);
+    return restored;
+}
+
+// internal
+// Finds the first variable named `name` in the sections of the running
+// version, from their symbol tables (Linux). C++ names are demangled.
+static char *cr_plugin_symbol_find(cr_internal *p, const char *name,
+                                   int64_t &size) {
+    for (int i = 0; i < cr_plugin_section_type::count; ++i) {
+        const auto &table = p->image.sections[i].symbols;
+        const auto &sec = p->sections[i];
+        if (!table || !sec.ptr) {
+            continue;
+        }
+        const auto &symbols = table->symbols;
+        auto it = std::lower_bound(symbols.begin(), symbols.end(), name,
+                                   [](const cr_symbol &s, const char *n) {
+            return s.name < n;
+        });
+        if (it != symbols.end() && it->name == name) {
+            size = it->size;
+            return sec.ptr + it->offset;
+        }
+#if defined(CR_LINUX)
+        for (const auto &s : symbols) {
+            if (cr_symbol_demangled_is(s, name)) {
+                size = s.size;
+                return sec.ptr + s.offset;
+            }
+        }
+#endif
+    }
+    return nullptr;
+}
+
+// internal
+// A restored state may have been stored while the guest was writing (it
+// returned or crashed between CR_STATE_WRITE_BEGIN and CR_STATE_WRITE_END),
+// the sequence is made even again so it can be read.
+static void cr_state_seq_reset(cr_internal *p) {
+    int64_t size = 0;
+    auto seq = (volatile unsigned int *)cr_plugin_symbol_find(p, "cr_state_seq",
+                                                              size);
+    if (seq && size == sizeof(unsigned int) && (*seq & 1)) {
+        *seq = *seq + 1;
+    }
+}
+
+// Finds a variable of the running version state by name, see
+// `cr_state_view_read`.
+bool cr_plugin_state_find(cr_plugin &ctx, const char *name,
+                          cr_state_view &view) {
+    CR_ASSERT(name);
+    auto p = (cr_internal *)ctx.p;
+    view = cr_state_view();
+    if (!p || !p->handle) {
+        return false;
+    }
+    int64_t size = 0;
+    view.ptr = cr_plugin_symbol_find(p, name, size);
+    if (!view.ptr) {
+        return false;
+    }
+    view.size = (size_t)size;
+    view.version = ctx.version;
+    auto seq = cr_plugin_symbol_find(p, "cr_state_seq", size);
+    if (seq && size == sizeof(unsigned int)) {
+        view.seq = (const volatile unsigned int *)seq;
+    }
+    return true;
+}
+
+// Reads the value of a variable found by `cr_plugin_state_find`, retrying
+// while the guest writes it if it declares a `CR_STATE_SEQLOCK`, up to
+// CR_STATE_READ_TRIES times.
+bool cr_state_view_read(const cr_state_view &view, void *dst, size_t size) {
+    if (!view.ptr || size != view.size) {
+        return false;
+    }
+    for (int tries = 0; tries < CR_STATE_READ_TRIES; ++tries) {
+        const unsigned int seq = view.seq ? *view.seq : 0;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seq & 1) {
+            std::this_thread::yield();
+            continue;
+        }
+        std::memcpy(dst, view.ptr, size);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (!view.seq || *view.seq == seq) {
+            return true;
+        }
+    }
+    return false;
+}
+
+template <class T>
+bool cr_state_view_read(const cr_state_view &view, T &value) {
+    return cr_state_view_read(view, &value, sizeof(T));
+}
+
+// Reads a variable published by `cr_set_state_share` from the file mapped by
+// another process, retrying while the host publishes up to CR_STATE_READ_TRIES
+// times.
+bool cr_state_share_read(const void *shared, const char *name, void *dst,
+                         size_t size) {
+    auto header = (const cr_state_share_header *)shared;
+    if (!header || std::memcmp(header->magic, CR_STATE_SHARE_MAGIC,
+                               sizeof(header->magic))) {
+        return false;
+    }
+    auto vars = (const cr_state_share_var *)(header + 1);
+    for (uint32_t n = 0; n < header->count; ++n) {
+        if (strncmp(vars[n].name, name, sizeof(vars[n].name))) {
+            continue;
+        }
+        for (int tries = 0; tries < CR_STATE_READ_TRIES; ++tries) {
+            const uint32_t seq = header->seq.load(std::memory_order_acquire);
+            if (seq & 1) {
+                std::this_thread::yield();
+                continue;
+            }
+            const bool fits = vars[n].size == size;
+            if (fits) {
+                std::memcpy(dst, (const char *)shared + vars[n].offset, size);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (header->seq.load(std::memory_order_relaxed) == seq) {
+                return fits;
+            }
+        }
+        return false;
+    }
+    return false;
+}
+
+// internal
+static void cr_state_share_close(cr_internal *p) {
+    if (p->share) {
+        cr_file_unmap(p->share, p->share_size);
+    }
+    p->share = nullptr;
+    p->share_size = 0;
+    p->share_views.clear();
+}
+
+// internal
+// Creates the file the variables are published to, each one gets the room of
+// its size in the running version. A new file replaces the old one, so a
+// process still mapping it keeps reading the old one.
+static bool cr_state_share_open(cr_plugin &ctx) {
+    auto p = (cr_internal *)ctx.p;
+    const size_t count = p->share_names.size();
+    const size_t vars = sizeof(cr_state_share_header) +
+                        count * sizeof(cr_state_share_var);
+    size_t total = vars;
+    for (const auto &view : p->share_views) {
+        total += (view.size + 7) & ~(size_t)7;
+    }
+    const std::string path = p->share_path + ".tmp";
+    auto share = (char *)cr_file_map_write(path, total);
+    if (!share) {
+        CR_ERROR("Couldn't create state share '%s'\n", p->share_path.c_str());
+        p->share_names.clear();
+        return false;
+    }
+    auto header = new (share) cr_state_share_header;
+    header->count = (uint32_t)count;
+    header->seq.store(0, std::memory_order_relaxed);
+    auto var = (cr_state_share_var *)(header + 1);
+    size_t offset = vars;
+    for (size_t n = 0; n < count; ++n) {
+        std::memset(var[n].name, 0, sizeof(var[n].name));
+        std::memcpy(var[n].name, p->share_names[n].data(),
+                    p->share_names[n].size());
+        var[n].offset = offset;
+        var[n].size = p->share_views[n].size;
+        offset += (var[n].size + 7) & ~(size_t)7;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(header->magic, CR_STATE_SHARE_MAGIC, sizeof(header->magic));
+    if (!cr_rename(path, p->share_path)) {
+        CR_ERROR("Couldn't replace state share '%s'\n", p->share_path.c_str());
+        cr_file_unmap(share, total);
+        cr_del(path);
+        p->share_names.clear();
+        return false;
+    }
+    p->share = share;
+    p->share_size = total;
+    return true;
+}
+
+// internal
+// Publishes the variables of the running version, see cr_set_state_share.
+static void cr_state_share_publish(cr_plugin &ctx) {
+    auto p = (cr_internal *)ctx.p;
+    if (p->share_names.empty() || !p->handle) {
+        return;
+    }
+    const size_t count = p->share_names.size();
+    if (p->share_views.empty() ||
+        p->share_views[0].version != ctx.version) {
+        p->share_views.resize(count);
+        for (size_t n = 0; n < count; ++n) {
+            cr_plugin_state_find(ctx, p->share_names[n].c_str(),
+                                 p->share_views[n]);
+            p->share_views[n].version = ctx.version;
+        }
+    }
+    if (!p->share && !cr_state_share_open(ctx)) {
+        return;
+    }
+    auto header = (cr_state_share_header *)p->share;
+    auto var = (cr_state_share_var *)(header + 1);
+    const uint32_t seq = header->seq.load(std::memory_order_relaxed);
+    header->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t n = 0; n < count; ++n) {
+        const auto &view = p->share_views[n];
+        const uint64_t end = n + 1 < count ? var[n + 1].offset : p->share_size;
+        const bool fits = view.ptr && var[n].offset + view.size <= end;
+        if (!fits) {
+            var[n].size = 0;
+            continue;
+        }
+        // a guest that left its sequence odd keeps the last value published
+        p->share_sample.resize(view.size);
+        if (cr_state_view_read(view, p->share_sample.data(), view.size)) {
+            std::memcpy(p->share + var[n].offset, p->share_sample.data(),
+                        view.size);
+            var[n].size = view.size;
+        }
+    }
+    header->seq.store(seq + 2, std::memory_order_release);
+}
+
 // Loads a plugin from the specified full path (or current directory if NULL).
 extern "C" bool cr_plugin_open(cr_plugin &ctx, const char *fullpath) {
     CR_TRACE
@@ -2039,6 +7049,8 @@ extern "C" bool cr_plugin_open(cr_plugin &ctx, const char *fullpath) {
     ctx.last_working_version = 0;
     ctx.version = 0;
     ctx.failure = CR_NONE;
+    ctx.state = nullptr;
+    ctx.arena = nullptr;
     cr_plat_init();
     return true;
 }
@@ -2053,9 +7065,15 @@ extern "C" void cr_plugin_close(cr_plugin &ctx) {
     CR_TRACE
     const bool rollback = false;
     const bool close = true;
+    cr_plugin_staging_cancel(ctx);
     cr_plugin_unload(ctx, rollback, close);
     cr_so_sections_free(ctx);
+    cr_plugin_checkpoint_free(ctx);
+    cr_watch_remove(ctx);
+    cr_arena_destroy(ctx);
     auto p = (cr_internal *)ctx.p;
+    cr_state_share_close(p);
+    CR_FREE(p->buffer.data);
 
     // delete backups
     const auto file = p->fullname;
@@ -2072,6 +7090,280 @@ extern "C" void cr_plugin_close(cr_plugin &ctx) {
     ctx.version = 0;
 }
 
+// A set of plugins updated together, independent plugins are updated in
+// parallel. See `cr_scheduler_open`.
+struct cr_scheduler {
+    void *p;
+};
+
+// internal
+struct cr_task {
+    cr_plugin *ctx = nullptr;
+    std::vector<unsigned int> dependents;
+    unsigned int dependencies = 0;
+    std::atomic<unsigned int> pending{0};
+    int result = 0;
+};
+
+// internal
+// Each worker owns a queue, it takes tasks from the back of its own queue and
+// steals from the front of the others when it runs out of work.
+struct cr_task_queue {
+    std::mutex lock;
+    std::deque<unsigned int> tasks;
+};
+
+// internal
+struct cr_scheduler_internal {
+    std::deque<cr_task> tasks;
+    std::deque<cr_task_queue> queues; // queue 0 belongs to the caller thread
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable ready; // a task was queued or the frame is done
+    std::condition_variable done;
+    unsigned int frame = 0;
+    bool quit = false;
+    bool reload_check = true;
+    std::atomic<unsigned int> remaining{0};
+    std::atomic<unsigned int> queued{0};
+};
+
+// internal
+static void cr_scheduler_push(cr_scheduler_internal &s, unsigned int worker,
+                              unsigned int task) {
+    {
+        auto &q = s.queues[worker];
+        std::lock_guard<std::mutex> guard(q.lock);
+        s.queued++;
+        q.tasks.push_back(task);
+    }
+    // an idle worker checks `queued` holding `lock`, so it can't miss this
+    { std::lock_guard<std::mutex> guard(s.lock); }
+    s.ready.notify_one();
+}
+
+// internal
+static bool cr_scheduler_pop(cr_scheduler_internal &s, unsigned int worker,
+                             unsigned int &task) {
+    {
+        auto &q = s.queues[worker];
+        std::lock_guard<std::mutex> guard(q.lock);
+        if (!q.tasks.empty()) {
+            task = q.tasks.back();
+            q.tasks.pop_back();
+            s.queued--;
+            return true;
+        }
+    }
+    const auto count = (unsigned int)s.queues.size();
+    for (unsigned int i = 1; i < count; ++i) {
+        auto &q = s.queues[(worker + i) % count];
+        std::lock_guard<std::mutex> guard(q.lock);
+        if (!q.tasks.empty()) {
+            task = q.tasks.front();
+            q.tasks.pop_front();
+            s.queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+// internal
+// Runs tasks until every plugin of the current frame was updated. A task
+// only becomes ready once all its dependencies are done, meanwhile the
+// idle workers sleep.
+static void cr_scheduler_work(cr_scheduler_internal &s, unsigned int worker) {
+    while (s.remaining.load() > 0) {
+        unsigned int i;
+        if (!cr_scheduler_pop(s, worker, i)) {
+            std::unique_lock<std::mutex> l(s.lock);
+            s.ready.wait(l, [&] {
+                return s.queued.load() > 0 || s.remaining.load() == 0;
+            });
+            continue;
+        }
+        auto &t = s.tasks[i];
+        t.result = cr_plugin_update(*t.ctx, s.reload_check);
+        for (auto d : t.dependents) {
+            if (--s.tasks[d].pending == 0) {
+                cr_scheduler_push(s, worker, d);
+            }
+        }
+        if (--s.remaining == 0) {
+            std::lock_guard<std::mutex> guard(s.lock);
+            s.ready.notify_all();
+            s.done.notify_all();
+        }
+    }
+}
+
+// Creates a scheduler with `threads` workers, including the thread calling
+// `cr_scheduler_update`. 0 uses one worker per hardware thread.
+extern "C" void cr_scheduler_open(cr_scheduler &sched,
+                                  unsigned int threads = 0) {
+    CR_TRACE
+    if (!threads) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    auto s = new(CR_MALLOC(sizeof(cr_scheduler_internal))) cr_scheduler_internal;
+    sched.p = s;
+    for (unsigned int i = 0; i < threads; ++i) {
+        s->queues.emplace_back();
+    }
+    for (unsigned int i = 1; i < threads; ++i) {
+        s->threads.emplace_back([s, i]() {
+            unsigned int seen = 0;
+            for (;;) {
+                {
+                    std::unique_lock<std::mutex> l(s->lock);
+                    s->wake.wait(l, [&] { return s->quit || s->frame != seen; });
+                    if (s->quit) {
+                        return;
+                    }
+                    seen = s->frame;
+                }
+                cr_scheduler_work(*s, i);
+            }
+        });
+    }
+}
+
+// Stops the workers. The plugins are not closed, this is up to the host.
+extern "C" void cr_scheduler_close(cr_scheduler &sched) {
+    CR_TRACE
+    auto s = (cr_scheduler_internal *)sched.p;
+    if (!s) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(s->lock);
+        s->quit = true;
+    }
+    s->wake.notify_all();
+    for (auto &t : s->threads) {
+        t.join();
+    }
+    s->~cr_scheduler_internal();
+    CR_FREE(s);
+    sched.p = nullptr;
+}
+
+// internal
+static int cr_scheduler_find(cr_scheduler_internal &s, const cr_plugin &ctx) {
+    for (size_t i = 0; i < s.tasks.size(); ++i) {
+        if (s.tasks[i].ctx == &ctx) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Adds an open plugin to the scheduler, returns its index in the results of
+// `cr_scheduler_update`. Must not be called during an update.
+extern "C" int cr_scheduler_add(cr_scheduler &sched, cr_plugin &ctx) {
+    auto s = (cr_scheduler_internal *)sched.p;
+    CR_ASSERT(s);
+    int i = cr_scheduler_find(*s, ctx);
+    if (i < 0) {
+        i = (int)s->tasks.size();
+        s->tasks.emplace_back();
+        s->tasks.back().ctx = &ctx;
+    }
+    return i;
+}
+
+// Declares that `ctx` must only be updated after `dependency` in each
+// `cr_scheduler_update`. Both must have been added already. Fails if this
+// would make a dependency cycle.
+extern "C" bool cr_scheduler_depends(cr_scheduler &sched, cr_plugin &ctx,
+                                     cr_plugin &dependency) {
+    auto s = (cr_scheduler_internal *)sched.p;
+    CR_ASSERT(s);
+    const int task = cr_scheduler_find(*s, ctx);
+    const int dep = cr_scheduler_find(*s, dependency);
+    if (task < 0 || dep < 0 || task == dep) {
+        return false;
+    }
+
+    // a cycle if `dependency` already (indirectly) depends on `ctx`
+    std::vector<unsigned int> open = {(unsigned int)task};
+    std::vector<bool> seen(s->tasks.size());
+    while (!open.empty()) {
+        auto i = open.back();
+        open.pop_back();
+        if (i == (unsigned int)dep) {
+            CR_ERROR("Dependency cycle between scheduled plugins\n");
+            return false;
+        }
+        if (seen[i]) {
+            continue;
+        }
+        seen[i] = true;
+        for (auto d : s->tasks[i].dependents) {
+            open.push_back(d);
+        }
+    }
+
+    auto &dependents = s->tasks[dep].dependents;
+    if (std::find(dependents.begin(), dependents.end(), (unsigned int)task) ==
+        dependents.end()) {
+        dependents.push_back(task);
+        s->tasks[task].dependencies++;
+    }
+    return true;
+}
+
+// Updates all plugins once, as `cr_plugin_update` does, in parallel but
+// respecting the declared dependencies. The result of each plugin update is
+// stored in `results` (optional, in the order they were added). Returns the
+// number of plugins that failed (negative result).
+extern "C" int cr_scheduler_update(cr_scheduler &sched, int *results = nullptr,
+                                   bool reloadCheck = true) {
+    auto s = (cr_scheduler_internal *)sched.p;
+    CR_ASSERT(s);
+    const auto count = (unsigned int)s->tasks.size();
+    if (!count) {
+        return 0;
+    }
+
+    // a worker late from the last frame may pop a task as soon as it is
+    // queued, so the dependency counts and `remaining` are set before that
+    s->reload_check = reloadCheck;
+    for (unsigned int i = 0; i < count; ++i) {
+        s->tasks[i].pending = s->tasks[i].dependencies;
+    }
+    s->remaining = count;
+    unsigned int worker = 0;
+    for (unsigned int i = 0; i < count; ++i) {
+        if (!s->tasks[i].dependencies) {
+            cr_scheduler_push(*s, worker, i);
+            worker = (worker + 1) % s->queues.size();
+        }
+    }
+    {
+        std::lock_guard<std::mutex> guard(s->lock);
+        s->frame++;
+    }
+    s->wake.notify_all();
+    cr_scheduler_work(*s, 0);
+    {
+        std::unique_lock<std::mutex> l(s->lock);
+        s->done.wait(l, [&] { return s->remaining.load() == 0; });
+    }
+
+    int failures = 0;
+    for (unsigned int i = 0; i < count; ++i) {
+        const int r = s->tasks[i].result;
+        failures += r < 0;
+        if (results) {
+            results[i] = r;
+        }
+    }
+    return failures;
+}
+
 #endif // #ifndef CR_HOST
 
 #endif // __CR_H__
@@ -14,6 +14,8 @@ static unsigned int CR_STATE version = 1;
 // will have a value of zero.
 //static int32_t CR_STATE sad_state = 2;
 // For this reason, cr is better for runtime modifing existing stuff than adding/removing new stuff.
+// On Linux, a host calling `cr_set_state_migration` gets states transferred by variable name instead, so added
+// states keep their initial value and removed ones are simply dropped.
 // At the sime time, if we remove a state variable, the reload will safely fail with the error CR_STATE_INVALIDATED.
 // A rollback will be effectued and this error can be dealt client side, for exemple, by poping a dialog box asking
 // to force reload cleaning up states (restarting the client from scratch with the new version).
@@ -17,11 +17,16 @@ int main(int argc, char *argv[]) {
     cr_plugin_open(ctx, plugin);
     cr_plugin_open(ctx2, plugin2);
 
-    // call the plugin update function with the plugin context to execute it
-    // at any frequency matters to you
+    // independent plugins can be updated in parallel by a scheduler, using
+    // one worker per hardware thread
+    cr_scheduler sched;
+    cr_scheduler_open(sched);
+    cr_scheduler_add(sched, ctx);
+    cr_scheduler_add(sched, ctx2);
+
+    // update all plugins at any frequency matters to you
     while (true) {
-        cr_plugin_update(ctx);
-        cr_plugin_update(ctx2);
+        cr_scheduler_update(sched);
         fflush(stdout);
         fflush(stderr);
         std::this_thread::sleep_for(std::chrono::milliseconds(10));
@@ -29,6 +34,7 @@ int main(int argc, char *argv[]) {
 
     // at the end do not forget to cleanup the plugin context, as it needs to
     // allocate some memory to track internal and plugin states
+    cr_scheduler_close(sched);
     cr_plugin_close(ctx2);
     cr_plugin_close(ctx);
     return 0;
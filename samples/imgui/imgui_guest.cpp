@@ -486,6 +486,8 @@ CR_EXPORT int cr_main(cr_plugin *ctx, cr_op operation) {
             imui_draw();
             imui_frame_end();
             return 0;
+        default:
+            break;
     }
 
     return 0;
@@ -0,0 +1,66 @@
+// Measures the per call overhead of cr_plugin_update against a direct call
+// into the guest and against the previous signal mask saving protected call.
+// Not part of the test suite, run it manually: `./crBench [iterations]`.
+#define CR_HOST
+#include "cr.h"
+#include "test_data.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+namespace fs = std::filesystem;
+
+template <typename F>
+static void bench(const char *name, unsigned int count, F &&fn,
+                  unsigned int calls = 1) {
+    for (unsigned int i = 0; i < count / 10; ++i) {
+        fn();
+    }
+    const auto start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < count; ++i) {
+        fn();
+    }
+    const auto end = std::chrono::steady_clock::now();
+    const double ns =
+        std::chrono::duration<double, std::nano>(end - start).count();
+    fprintf(stdout, "%-32s %8.2f ns/call\n", name, ns / count / calls);
+}
+
+int main(int argc, char **argv) {
+    const unsigned int count = argc > 1 ? atoi(argv[1]) : 1000000;
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+
+    using namespace test_basic;
+    cr_plugin ctx;
+    test_data data;
+    ctx.userdata = &data;
+    if (!cr_plugin_open(ctx, lib_str.c_str())) {
+        fprintf(stderr, "could not open %s\n", lib_str.c_str());
+        return 1;
+    }
+    data.test = test_id::return_version;
+    cr_plugin_update(ctx);
+
+    auto p = (cr_internal *)ctx.p;
+    bench("direct call", count, [&] { p->main(&ctx, CR_STEP); });
+#if !defined(CR_WINDOWS)
+    sigjmp_buf env;
+    bench("sigsetjmp(env, 1) + call", count, [&] {
+        if (sigsetjmp(env, 1) == 0) {
+            p->main(&ctx, CR_STEP);
+        }
+    });
+#endif
+    bench("cr_plugin_update(no reload)", count,
+          [&] { cr_plugin_update(ctx, false); });
+    bench("cr_plugin_update(reload)", count,
+          [&] { cr_plugin_update(ctx, true); });
+    int results[64];
+    bench("cr_plugin_update_n(64, reload)", count / 64,
+          [&] { cr_plugin_update_n(ctx, 64, results, true); }, 64);
+
+    cr_plugin_close(ctx);
+    return 0;
+}
@@ -1,16 +1,19 @@
 #include <gtest/gtest.h>
 
 #define CR_HOST
+// big_state_int is restored on demand, see lazy_restore
+#define CR_LAZY_MIN_SIZE (64 * 1024)
 #include "cr.h"
 #include "test_data.h"
 
 #include <filesystem>
+#include <fstream>
 namespace fs = std::filesystem;
 
 void touch(const char *filename) {
     fs::path p = filename;
     auto ftime = fs::last_write_time(p);
-    fs::last_write_time(p, ftime + std::chrono::seconds(1));
+    fs::last_write_time(p, ftime + std::chrono::milliseconds(1));
 }
 
 void delete_old_files(cr_plugin &ctx, unsigned int max_version) {
@@ -35,6 +38,8 @@ TEST(crTest, basic_flow) {
     ctx.userdata = &data;
     // version 1
     EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    // touch simulates new builds
+    cr_set_skip_identical(ctx, false);
 
     data.test = test_id::return_version;
     EXPECT_EQ(1, cr_plugin_update(ctx));
@@ -176,3 +181,1333 @@ TEST(crTest, basic_flow) {
     EXPECT_EQ(ctx.p, nullptr);
     EXPECT_EQ(0u, ctx.version);
 }
+
+TEST(crTest, skip_identical) {
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+
+    using namespace test_basic;
+    cr_plugin ctx;
+    test_data data;
+    ctx.userdata = &data;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+
+    data.test = test_id::return_version;
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+
+    // same image, only the timestamp changed
+    touch(bin);
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+    EXPECT_EQ(2u, ctx.next_version);
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+    EXPECT_EQ(ctx.p, nullptr);
+}
+
+TEST(crTest, manifest) {
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+    auto manifest = (fs::current_path() / "test_manifest.txt").string();
+    fs::remove(manifest);
+
+    using namespace test_basic;
+    cr_plugin ctx;
+    test_data data;
+    ctx.userdata = &data;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    cr_set_skip_identical(ctx, false);
+    cr_set_manifest(ctx, manifest);
+
+    data.test = test_id::return_version;
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+
+    // new build, but not listed as complete yet
+    touch(bin);
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+
+    FILE *fp = fopen(manifest.c_str(), "w");
+    fprintf(fp, "%s\n", lib_path.filename().string().c_str());
+    fclose(fp);
+    std::this_thread::sleep_for(std::chrono::milliseconds(CR_RETRY_MIN_MS * 2));
+    EXPECT_EQ(2, cr_plugin_update(ctx));
+
+    fs::remove(manifest);
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+    EXPECT_EQ(ctx.p, nullptr);
+}
+
+TEST(crTest, staging) {
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+
+    using namespace test_basic;
+    cr_plugin ctx;
+    test_data data;
+    ctx.userdata = &data;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    cr_set_skip_identical(ctx, false);
+    cr_set_staging(ctx, true);
+
+    data.test = test_id::static_global_state_int;
+    const int saved_global_static = cr_plugin_update(ctx);
+
+    // the current version keeps running while the new one is prepared
+    touch(bin);
+    data.test = test_id::return_version;
+    int version = cr_plugin_update(ctx);
+    EXPECT_EQ(1, version);
+    for (int i = 0; i < 1000 && version == 1; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        version = cr_plugin_update(ctx);
+    }
+    EXPECT_EQ(2, version);
+
+    data.test = test_id::static_global_state_int;
+    EXPECT_EQ(saved_global_static + 1, cr_plugin_update(ctx));
+
+    // a build landing while an image is staged is loaded after it
+    touch(bin);
+    data.test = test_id::return_version;
+    EXPECT_EQ(2, cr_plugin_update(ctx));
+    auto p = (cr_internal *)ctx.p;
+    for (int i = 0; i < 1000 && !p->staged_ready; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    touch(bin);
+    EXPECT_EQ(3, cr_plugin_update(ctx));
+    version = cr_plugin_update(ctx);
+    for (int i = 0; i < 1000 && version == 3; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        version = cr_plugin_update(ctx);
+    }
+    EXPECT_EQ(4, version);
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+    EXPECT_EQ(ctx.p, nullptr);
+}
+
+TEST(crTest, incremental_reload) {
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+
+    using namespace test_basic;
+    cr_plugin ctx;
+    test_data data;
+    ctx.userdata = &data;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    cr_set_skip_identical(ctx, false);
+    cr_set_reload_budget(ctx, 0);
+
+    data.test = test_id::return_version;
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+
+    // one stage per update: detect, copy, load and inspect, then swap
+    touch(bin);
+    for (int i = 0; i < 4; ++i) {
+        EXPECT_EQ(1, cr_plugin_update(ctx));
+    }
+    EXPECT_EQ(2, cr_plugin_update(ctx));
+
+    // a relink after the copy stage is loaded after the swap
+    touch(bin);
+    for (int i = 0; i < 2; ++i) {
+        EXPECT_EQ(2, cr_plugin_update(ctx));
+    }
+    touch(bin);
+    for (int i = 0; i < 2; ++i) {
+        EXPECT_EQ(2, cr_plugin_update(ctx));
+    }
+    EXPECT_EQ(3, cr_plugin_update(ctx));
+    for (int i = 0; i < 4; ++i) {
+        EXPECT_EQ(3, cr_plugin_update(ctx));
+    }
+    EXPECT_EQ(4, cr_plugin_update(ctx));
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+    EXPECT_EQ(ctx.p, nullptr);
+}
+
+TEST(crTest, staged_fingerprint) {
+    const auto dir = fs::current_path();
+    const auto lib_path = dir / CR_PLUGIN("test_fingerprint");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+    const auto over = fs::copy_options::overwrite_existing;
+    fs::copy_file(dir / CR_PLUGIN("test_basic"), lib_path, over);
+
+    using namespace test_basic;
+    cr_plugin ctx;
+    test_data data;
+    ctx.userdata = &data;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    cr_set_skip_identical(ctx, false);
+    cr_set_reload_budget(ctx, 0);
+    data.test = test_id::return_version;
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+
+    // another build lands after the copy stage, before the swap
+    touch(bin);
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+    fs::copy_file(dir / CR_PLUGIN("test_relocate_a"), lib_path, over);
+    for (int i = 0; i < 2; ++i) {
+        EXPECT_EQ(1, cr_plugin_update(ctx));
+    }
+    EXPECT_EQ(2, cr_plugin_update(ctx));
+
+    // the fingerprint is of the build running, not of the newer one
+    auto p = (cr_internal *)ctx.p;
+    EXPECT_EQ(cr_image_fingerprint(p->image.file), p->fingerprint);
+    EXPECT_NE(cr_image_fingerprint(lib_str), p->fingerprint);
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+    fs::remove(lib_path);
+}
+
+#if defined(CR_LINUX)
+// a completely written image that the loader rejects
+static void write_bad_image(const fs::path &from, const fs::path &to) {
+    std::ifstream in(from, std::ios::binary);
+    std::string image((std::istreambuf_iterator<char>(in)), {});
+    image[16] = 1; // e_type ET_REL
+    image[17] = 0;
+    std::ofstream(to, std::ios::binary | std::ios::trunc) << image;
+}
+
+TEST(crTest, bad_image) {
+    const auto dir = fs::current_path();
+    const auto lib_path = dir / CR_PLUGIN("test_bad_image");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+    const auto over = fs::copy_options::overwrite_existing;
+
+    using namespace test_basic;
+    cr_plugin ctx;
+    test_data data;
+    ctx.userdata = &data;
+    data.test = test_id::return_version;
+
+    // a first load that fails is reported
+    write_bad_image(dir / CR_PLUGIN("test_basic"), lib_path);
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    EXPECT_EQ(-2, cr_plugin_update(ctx));
+    EXPECT_EQ(CR_BAD_IMAGE, ctx.failure);
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+
+    // by default the running version is unloaded first, then rolled back to
+    fs::copy_file(dir / CR_PLUGIN("test_basic"), lib_path, over);
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    cr_set_skip_identical(ctx, false);
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+    write_bad_image(dir / CR_PLUGIN("test_basic"), lib_path);
+    touch(bin);
+    EXPECT_EQ(-2, cr_plugin_update(ctx));
+    EXPECT_EQ(CR_BAD_IMAGE, ctx.failure);
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+    EXPECT_EQ(1u, ctx.version);
+
+    // staged, the running version keeps running and the load is retried
+    cr_set_staging(ctx, true);
+    touch(bin);
+    for (int i = 0; i < 20; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        EXPECT_EQ(1, cr_plugin_update(ctx));
+    }
+    EXPECT_EQ(CR_NONE, ctx.failure);
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+    fs::remove(lib_path);
+}
+#endif // CR_LINUX
+
+TEST(crTest, standby_rollback) {
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+
+    using namespace test_basic;
+    cr_plugin ctx;
+    test_data data;
+    ctx.userdata = &data;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    cr_set_skip_identical(ctx, false);
+    cr_set_standby(ctx, 2, 0);
+
+    data.test = test_id::static_global_state_int;
+    const int saved_global_static = cr_plugin_update(ctx);
+
+    touch(bin);
+    data.test = test_id::return_version;
+    EXPECT_EQ(2, cr_plugin_update(ctx));
+
+    // the previous version is still loaded, rolling back doesn't need its file
+    auto p = (cr_internal *)ctx.p;
+    cr_del(cr_version_path(p->fullname, 1, p->temppath));
+
+    data.test = test_id::crash_update;
+    EXPECT_EQ(-1, cr_plugin_update(ctx));
+    EXPECT_EQ(CR_SEGFAULT, ctx.failure);
+
+    data.test = test_id::return_version;
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+    EXPECT_EQ(CR_NONE, ctx.failure);
+
+    data.test = test_id::static_global_state_int;
+    EXPECT_EQ(saved_global_static + 1, cr_plugin_update(ctx));
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+    EXPECT_EQ(ctx.p, nullptr);
+}
+
+TEST(crTest, update_n) {
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+
+    using namespace test_basic;
+    cr_plugin ctx;
+    test_data data;
+    ctx.userdata = &data;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    cr_set_skip_identical(ctx, false);
+
+    int results[8] = {};
+    data.test = test_id::return_version;
+    EXPECT_EQ(8, cr_plugin_update_n(ctx, 8, results));
+    EXPECT_EQ(1, results[0]);
+    EXPECT_EQ(1, results[7]);
+
+    // version 2, so there is a version to rollback to
+    touch(bin);
+    EXPECT_EQ(1, cr_plugin_update_n(ctx, 1, results));
+    EXPECT_EQ(2, results[0]);
+
+    // crashes in the 4th iteration
+    data.test = test_id::crash_countdown;
+    data.countdown = 3;
+    EXPECT_EQ(3, cr_plugin_update_n(ctx, 8, results));
+    EXPECT_EQ(CR_SEGFAULT, ctx.failure);
+    EXPECT_EQ(2, results[0]);
+    EXPECT_EQ(0, results[2]);
+    EXPECT_EQ(-1, results[3]);
+
+    // rollbacks as cr_plugin_update
+    data.test = test_id::return_version;
+    EXPECT_EQ(2, cr_plugin_update_n(ctx, 2, results));
+    EXPECT_EQ(CR_NONE, ctx.failure);
+    EXPECT_EQ(1, results[1]);
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+}
+
+TEST(crTest, concurrent_crash) {
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+
+    // each thread updates its own plugin instance, one of them crashing
+    auto run = [bin](const char *dir, test_basic::test_id::e test, int *r) {
+        using namespace test_basic;
+        auto temp = fs::temp_directory_path() / dir;
+        fs::create_directories(temp);
+        cr_plugin ctx;
+        test_data data;
+        ctx.userdata = &data;
+        cr_plugin_open(ctx, bin);
+        cr_set_temporary_path(ctx, temp.string());
+        data.test = test;
+        data.countdown = 500;
+        for (int i = 0; i < 1000; ++i) {
+            *r = cr_plugin_update(ctx, i == 0);
+            if (*r < 0) {
+                break;
+            }
+        }
+        delete_old_files(ctx, ctx.next_version);
+        cr_plugin_close(ctx);
+    };
+
+    int crashed = 0, stepped = 0;
+    using test_basic::test_id::crash_countdown;
+    using test_basic::test_id::return_version;
+    std::thread a(run, "cr_crash_a", crash_countdown, &crashed);
+    std::thread b(run, "cr_crash_b", return_version, &stepped);
+    a.join();
+    b.join();
+    EXPECT_EQ(-1, crashed);
+    EXPECT_EQ(1, stepped);
+}
+
+TEST(crTest, scheduler) {
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+
+    using namespace test_basic;
+    const int count = 4;
+    cr_plugin ctx[count];
+    test_data data[count];
+    cr_scheduler sched;
+    cr_scheduler_open(sched, 2);
+    for (int i = 0; i < count; ++i) {
+        auto temp = fs::temp_directory_path() / ("cr_sched_" + std::to_string(i));
+        fs::create_directories(temp);
+        ctx[i].userdata = &data[i];
+        EXPECT_EQ(true, cr_plugin_open(ctx[i], bin));
+        cr_set_temporary_path(ctx[i], temp.string());
+        EXPECT_EQ(i, cr_scheduler_add(sched, ctx[i]));
+    }
+    EXPECT_EQ(true, cr_scheduler_depends(sched, ctx[1], ctx[0]));
+    EXPECT_EQ(true, cr_scheduler_depends(sched, ctx[2], ctx[1]));
+    EXPECT_EQ(false, cr_scheduler_depends(sched, ctx[0], ctx[2]));
+
+    int results[count] = {};
+    EXPECT_EQ(0, cr_scheduler_update(sched, results));
+    for (int i = 0; i < count; ++i) {
+        EXPECT_EQ(1, results[i]);
+    }
+
+    // back to back frames, workers from the last one may still be around
+    for (int n = 0; n < 1000; ++n) {
+        EXPECT_EQ(0, cr_scheduler_update(sched, results, false));
+    }
+
+    // a crash only affects the crashing plugin
+    data[1].test = test_id::crash_update;
+    EXPECT_EQ(1, cr_scheduler_update(sched, results, false));
+    EXPECT_EQ(-1, results[1]);
+    EXPECT_EQ(CR_SEGFAULT, ctx[1].failure);
+    EXPECT_EQ(1, results[2]);
+    EXPECT_EQ(CR_NONE, ctx[2].failure);
+
+    cr_scheduler_close(sched);
+    for (int i = 0; i < count; ++i) {
+        delete_old_files(ctx[i], ctx[i].next_version);
+        cr_plugin_close(ctx[i]);
+    }
+}
+
+TEST(crTest, scheduler_stress) {
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+
+    using namespace test_basic;
+    const int count = 8;
+    cr_plugin ctx[count];
+    test_data data[count];
+    cr_scheduler sched;
+    cr_scheduler_open(sched, count);
+    for (int i = 0; i < count; ++i) {
+        auto temp = fs::temp_directory_path() / ("cr_stress_" + std::to_string(i));
+        fs::create_directories(temp);
+        ctx[i].userdata = &data[i];
+        EXPECT_EQ(true, cr_plugin_open(ctx[i], bin));
+        cr_set_temporary_path(ctx[i], temp.string());
+        EXPECT_EQ(i, cr_scheduler_add(sched, ctx[i]));
+    }
+    // a chain and independent plugins, most workers are idle most of the time
+    for (int i = 1; i < count / 2; ++i) {
+        EXPECT_EQ(true, cr_scheduler_depends(sched, ctx[i], ctx[i - 1]));
+    }
+
+    // many short frames back to back, the workers of the last frame are
+    // often still leaving it when the next one starts
+    int results[count] = {};
+    EXPECT_EQ(0, cr_scheduler_update(sched, results));
+    for (int n = 0; n < 20000; ++n) {
+        ASSERT_EQ(0, cr_scheduler_update(sched, results, false));
+    }
+    for (int i = 0; i < count; ++i) {
+        EXPECT_EQ(1, results[i]);
+    }
+
+    cr_scheduler_close(sched);
+    for (int i = 0; i < count; ++i) {
+        delete_old_files(ctx[i], ctx[i].next_version);
+        cr_plugin_close(ctx[i]);
+    }
+}
+
+TEST(crTest, state_remap) {
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+
+    using namespace test_basic;
+    cr_plugin ctx;
+    test_data data;
+    ctx.userdata = &data;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    cr_set_skip_identical(ctx, false);
+    cr_set_state_remap(ctx, true);
+
+    data.test = test_id::big_state_int;
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+    EXPECT_EQ(2, cr_plugin_update(ctx));
+#if defined(CR_LINUX)
+    auto p = (cr_internal *)ctx.p;
+    EXPECT_LE(0, p->remap[cr_plugin_section_type::state].fd);
+#endif
+
+    // version 2, state transferred
+    touch(bin);
+    EXPECT_EQ(3, cr_plugin_update(ctx));
+    EXPECT_EQ(4, cr_plugin_update(ctx));
+
+    // version 3, only what was written by version 2 is written back
+    touch(bin);
+    EXPECT_EQ(5, cr_plugin_update(ctx));
+
+    // rollback to version 2 restores the state as of the last unload
+    data.test = test_id::crash_update;
+    EXPECT_EQ(-1, cr_plugin_update(ctx));
+    data.test = test_id::big_state_int;
+    EXPECT_EQ(5, cr_plugin_update(ctx));
+    EXPECT_EQ(2u, ctx.version);
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+}
+
+TEST(crTest, state_remap_restore) {
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+
+    using namespace test_basic;
+    cr_plugin ctx;
+    test_data data;
+    ctx.userdata = &data;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    cr_set_skip_identical(ctx, false);
+
+    data.test = test_id::big_state_int;
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+    touch(bin);
+    EXPECT_EQ(2, cr_plugin_update(ctx));
+    cr_set_state_remap(ctx, true);
+    touch(bin);
+    EXPECT_EQ(3, cr_plugin_update(ctx));
+    touch(bin);
+    EXPECT_EQ(4, cr_plugin_update(ctx));
+
+    // an older state is copied, the memfd has the newest one
+    EXPECT_EQ(true, cr_plugin_restore(ctx, 1));
+    EXPECT_EQ(3, cr_plugin_update(ctx));
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+}
+
+#if defined(CR_LINUX) || defined(CR_OSX)
+TEST(crTest, lazy_restore) {
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+
+    using namespace test_basic;
+    cr_plugin ctx;
+    test_data data;
+    ctx.userdata = &data;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    cr_set_skip_identical(ctx, false);
+    cr_set_lazy_restore(ctx, true);
+
+    data.test = test_id::big_state_int;
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+    EXPECT_EQ(2, cr_plugin_update(ctx));
+
+    // version 2, only the pages accessed are restored
+    touch(bin);
+    EXPECT_EQ(3, cr_plugin_update(ctx));
+#if defined(CR_LINUX) || defined(CR_OSX)
+    auto p = (cr_internal *)ctx.p;
+    auto l = p->lazy[cr_plugin_section_type::state];
+    ASSERT_NE(nullptr, l);
+    size_t pending = 0;
+    for (size_t n = 0; n < l->size / l->page; ++n) {
+        pending += l->pages[n].load() == 0;
+    }
+    EXPECT_LT(0u, pending);
+#endif
+    EXPECT_EQ(4, cr_plugin_update(ctx));
+
+    // version 3, the rest is restored before storing the state
+    touch(bin);
+    EXPECT_EQ(5, cr_plugin_update(ctx));
+
+    // rollback to version 2 restores the state as of the last unload
+    data.test = test_id::crash_update;
+    EXPECT_EQ(-1, cr_plugin_update(ctx));
+    data.test = test_id::big_state_int;
+    EXPECT_EQ(5, cr_plugin_update(ctx));
+    EXPECT_EQ(2u, ctx.version);
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+}
+
+TEST(crTest, is_empty) {
+    std::vector<char> buf(1024 * 1024 + 13);
+    EXPECT_EQ(true, cr_is_empty(buf.data() + 1, buf.size() - 1));
+    for (size_t i : {size_t(1), size_t(9), size_t(4096), buf.size() - 1}) {
+        buf[i] = 1;
+        EXPECT_EQ(false, cr_is_empty(buf.data() + 1, buf.size() - 1));
+        buf[i] = 0;
+    }
+}
+#endif
+
+TEST(crTest, sparse_bss) {
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+
+    using namespace test_basic;
+    cr_plugin ctx;
+    test_data data;
+    ctx.userdata = &data;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    cr_set_skip_identical(ctx, false);
+
+    data.test = test_id::big_bss_int;
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+    EXPECT_EQ(2, cr_plugin_update(ctx));
+
+    // version 2, only the touched pages are copied
+    touch(bin);
+    EXPECT_EQ(3, cr_plugin_update(ctx));
+#if defined(CR_LINUX)
+    auto p = (cr_internal *)ctx.p;
+    const auto &bss = p->snapshots[p->snapshot_head]
+                          .sections[cr_plugin_section_type::bss];
+    ASSERT_FALSE(bss.sparse.empty());
+    EXPECT_GT(bss.sparse.size() / 4, (size_t)std::count(
+        bss.sparse.begin(), bss.sparse.end(), 1));
+#endif
+
+    // rollback restores it too
+    data.test = test_id::crash_update;
+    EXPECT_EQ(-1, cr_plugin_update(ctx));
+    data.test = test_id::big_bss_int;
+    EXPECT_EQ(3, cr_plugin_update(ctx));
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+}
+
+TEST(crTest, checkpoint) {
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+
+    using namespace test_basic;
+    cr_plugin ctx;
+    test_data data;
+    ctx.userdata = &data;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    cr_set_skip_identical(ctx, false);
+    cr_set_checkpoint(ctx, 2, 0);
+
+    data.test = test_id::big_state_int;
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+
+    // version 2, state saved at unload is 1
+    touch(bin);
+    EXPECT_EQ(2, cr_plugin_update(ctx));
+    EXPECT_EQ(3, cr_plugin_update(ctx));
+    EXPECT_EQ(4, cr_plugin_update(ctx));
+    EXPECT_EQ(5, cr_plugin_update(ctx));
+    EXPECT_EQ(6, cr_plugin_update(ctx));
+
+    // rollback restores the last checkpoint (after 5) instead
+    data.test = test_id::crash_update;
+    EXPECT_EQ(-1, cr_plugin_update(ctx));
+    data.test = test_id::big_state_int;
+    EXPECT_EQ(6, cr_plugin_update(ctx));
+    EXPECT_EQ(1u, ctx.version);
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+}
+
+TEST(crTest, checkpoint_after_load) {
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+
+    using namespace test_basic;
+    cr_plugin ctx;
+    test_data data;
+    ctx.userdata = &data;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    cr_set_skip_identical(ctx, false);
+    data.test = test_id::big_state_int;
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+    touch(bin);
+    EXPECT_EQ(2, cr_plugin_update(ctx));
+
+    // enabled once version 2 is running
+    cr_set_checkpoint(ctx, 2, 0);
+    EXPECT_EQ(3, cr_plugin_update(ctx));
+    EXPECT_EQ(4, cr_plugin_update(ctx));
+    EXPECT_EQ(5, cr_plugin_update(ctx));
+
+    data.test = test_id::crash_update;
+    EXPECT_EQ(-1, cr_plugin_update(ctx));
+    data.test = test_id::big_state_int;
+    EXPECT_EQ(5, cr_plugin_update(ctx));
+    EXPECT_EQ(1u, ctx.version);
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+}
+
+TEST(crTest, checkpoint_incremental) {
+    if (!cr_soft_dirty_probe()) {
+        GTEST_SKIP() << "soft-dirty bits not available";
+    }
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+
+    // two plugins checkpointing at different steps, each one clears the
+    // soft-dirty bits the other one needs
+    using namespace test_basic;
+    const int count = 2;
+    cr_plugin ctx[count];
+    test_data data[count];
+    for (int i = 0; i < count; ++i) {
+        auto temp = fs::temp_directory_path() / ("cr_cp_" + std::to_string(i));
+        fs::create_directories(temp);
+        ctx[i].userdata = &data[i];
+        data[i].test = test_id::big_state_int;
+        EXPECT_EQ(true, cr_plugin_open(ctx[i], bin));
+        cr_set_temporary_path(ctx[i], temp.string());
+        EXPECT_EQ(1, cr_plugin_update(ctx[i]));
+        cr_set_checkpoint(ctx[i], 2 + i, 0);
+    }
+
+    int incremental = 0;
+    for (int n = 0; n < 12; ++n) {
+        for (int i = 0; i < count; ++i) {
+            auto &cp = ((cr_internal *)ctx[i].p)->checkpoint;
+            const bool full = cp.full;
+            const auto counter = cp.counter;
+            EXPECT_EQ(n + 2, cr_plugin_update(ctx[i]));
+            if (cp.counter >= counter) {
+                continue;
+            }
+            // just checkpointed, the copy must match the running state
+            incremental += !full;
+            const auto &snap = cp.sections[cr_plugin_section_type::state];
+            EXPECT_EQ(0, std::memcmp(snap.data, snap.ptr, snap.size));
+        }
+    }
+    EXPECT_LT(0, incremental);
+
+    for (int i = 0; i < count; ++i) {
+        delete_old_files(ctx[i], ctx[i].next_version);
+        cr_plugin_close(ctx[i]);
+    }
+}
+
+TEST(crTest, snapshots) {
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+
+    using namespace test_basic;
+    cr_plugin ctx;
+    test_data data;
+    ctx.userdata = &data;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    cr_set_skip_identical(ctx, false);
+    cr_set_snapshots(ctx, 3);
+    EXPECT_EQ(false, cr_plugin_restore(ctx, 0));
+
+    data.test = test_id::big_state_int;
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+    touch(bin);
+    EXPECT_EQ(2, cr_plugin_update(ctx));
+    EXPECT_EQ(3, cr_plugin_update(ctx));
+    touch(bin);
+    EXPECT_EQ(4, cr_plugin_update(ctx));
+    EXPECT_EQ(3u, ctx.version);
+
+    // stored by the first unload, then by the last one
+    EXPECT_EQ(true, cr_plugin_restore(ctx, 1));
+    EXPECT_EQ(2, cr_plugin_update(ctx));
+    EXPECT_EQ(true, cr_plugin_restore(ctx, 0));
+    EXPECT_EQ(4, cr_plugin_update(ctx));
+    EXPECT_EQ(false, cr_plugin_restore(ctx, 2));
+
+    // shrinking keeps the newest
+    cr_set_snapshots(ctx, 1);
+    EXPECT_EQ(false, cr_plugin_restore(ctx, 1));
+    EXPECT_EQ(true, cr_plugin_restore(ctx, 0));
+    EXPECT_EQ(4, cr_plugin_update(ctx));
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+}
+
+TEST(crTest, history) {
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+
+    using namespace test_basic;
+    cr_plugin ctx;
+    test_data data;
+    ctx.userdata = &data;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    cr_set_skip_identical(ctx, false);
+    cr_set_history(ctx, 1024 * 1024);
+
+    data.test = test_id::big_state_int;
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+    for (int i = 2; i <= 5; ++i) {
+        touch(bin);
+        EXPECT_EQ(i, cr_plugin_update(ctx));
+    }
+    EXPECT_EQ(5u, ctx.version);
+
+    // versions 1 and 2 are older than the snapshots
+    EXPECT_EQ(true, cr_plugin_restore_version(ctx, 1));
+    EXPECT_EQ(2, cr_plugin_update(ctx));
+    EXPECT_EQ(true, cr_plugin_restore_version(ctx, 2));
+    EXPECT_EQ(3, cr_plugin_update(ctx));
+    EXPECT_EQ(true, cr_plugin_restore_version(ctx, 4));
+    EXPECT_EQ(5, cr_plugin_update(ctx));
+    EXPECT_EQ(false, cr_plugin_restore_version(ctx, 5));
+
+    // only the few words changed are kept
+    auto p = (cr_internal *)ctx.p;
+    EXPECT_EQ(3u, p->history.entries.size());
+    EXPECT_GT(64u * 1024, p->history.bytes);
+
+    cr_set_history(ctx, 1);
+    EXPECT_EQ(false, cr_plugin_restore_version(ctx, 1));
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+}
+
+TEST(crTest, section_policy) {
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+
+    using namespace test_basic;
+    cr_plugin ctx;
+    test_data data;
+    ctx.userdata = &data;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    cr_set_skip_identical(ctx, false);
+    cr_set_standby(ctx, 2, 0);
+    EXPECT_EQ(true, cr_set_section(ctx, "kept", CR_SECTION_PERSIST));
+    EXPECT_EQ(true, cr_set_section(ctx, "fresh", CR_SECTION_RESET));
+
+    data.test = test_id::section_policy_int;
+    EXPECT_EQ(101201, cr_plugin_update(ctx));
+    touch(bin);
+    EXPECT_EQ(102201, cr_plugin_update(ctx));
+
+    // `kept` survives the crash, the standby version 1 `fresh` is reset
+    data.countdown = 1;
+    EXPECT_EQ(-1, cr_plugin_update(ctx));
+    EXPECT_EQ(104201, cr_plugin_update(ctx));
+    EXPECT_EQ(1u, ctx.version);
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+}
+
+TEST(crTest, arena) {
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+
+    using namespace test_basic;
+    cr_plugin ctx;
+    test_data data;
+    ctx.userdata = &data;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    cr_set_skip_identical(ctx, false);
+    EXPECT_EQ(true, cr_set_arena(ctx, 64 * 1024 * 1024));
+
+    data.test = test_id::arena_int;
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+    touch(bin);
+    EXPECT_EQ(2, cr_plugin_update(ctx));
+    EXPECT_EQ(3, cr_plugin_update(ctx));
+
+    // the arena goes back to the unload of version 1, as the statics do
+    data.countdown = 1;
+    EXPECT_EQ(-1, cr_plugin_update(ctx));
+    EXPECT_EQ(2, cr_plugin_update(ctx));
+    EXPECT_EQ(1u, ctx.version);
+
+    // blocks are recycled by size
+    void *block = cr_arena_alloc(&ctx, 100);
+    EXPECT_NE(nullptr, block);
+    cr_arena_free(&ctx, block);
+    EXPECT_EQ(block, cr_arena_alloc(&ctx, 110));
+    // sizes no class holds fail
+    EXPECT_EQ(nullptr, cr_arena_alloc(&ctx, (size_t)-1));
+    EXPECT_EQ(nullptr, cr_arena_alloc(&ctx, (size_t)-1 / 2));
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+}
+
+TEST(crTest, arena_unload_point) {
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+
+    cr_plugin ctx;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    EXPECT_EQ(true, cr_set_arena(ctx, 1024 * 1024));
+    auto p = (cr_internal *)ctx.p;
+    auto value = (int *)cr_arena_alloc(&ctx, sizeof(int));
+    ASSERT_NE(nullptr, value);
+
+    // as stored by an unload, then by periodic checkpoints
+    *value = 1;
+    cr_arena_checkpoint(p, true);
+    *value = 2;
+    cr_arena_checkpoint(p, false);
+    *value = 3;
+    cr_arena_checkpoint(p, false);
+    *value = 4;
+    void *late = cr_arena_alloc(&ctx, 64);
+
+    // the state checkpoint was restored
+    cr_arena_rollback(p, true);
+    EXPECT_EQ(3, *value);
+
+    // it wasn't, the state comes from the unload
+    *value = 5;
+    cr_arena_rollback(p, false);
+    EXPECT_EQ(1, *value);
+    EXPECT_EQ(late, cr_arena_alloc(&ctx, 64));
+
+    cr_plugin_close(ctx);
+}
+
+TEST(crTest, state_file) {
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+    const auto file = (fs::current_path() / "test_basic.state").string();
+    fs::remove(file);
+
+    using namespace test_basic;
+    test_data data;
+    data.test = test_id::static_global_state_int;
+    int saved = 0;
+    for (int run = 0; run < 2; ++run) {
+        // as a new host process would
+        cr_plugin ctx;
+        ctx.userdata = &data;
+        EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+        cr_set_state_file(ctx, file);
+        const int first = cr_plugin_update(ctx);
+        if (run) {
+            // CR_CLOSE, CR_LOAD and this step
+            EXPECT_EQ(saved + 3, first);
+        }
+        saved = cr_plugin_update(ctx);
+        delete_old_files(ctx, ctx.next_version);
+        cr_plugin_close(ctx);
+    }
+
+    // a save replaces the file, the previous one is never truncated
+    size_t len = 0;
+    auto old = (const char *)cr_file_map_read(file, len);
+    ASSERT_NE(nullptr, old);
+    const std::string before(old, len);
+    {
+        cr_plugin ctx;
+        ctx.userdata = &data;
+        EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+        cr_set_state_file(ctx, file);
+        EXPECT_EQ(saved + 3, cr_plugin_update(ctx));
+        delete_old_files(ctx, ctx.next_version);
+        cr_plugin_close(ctx);
+    }
+    EXPECT_EQ(before, std::string(old, len));
+    size_t now_len = 0;
+    auto now = (const char *)cr_file_map_read(file, now_len);
+    ASSERT_NE(nullptr, now);
+    EXPECT_NE(before, std::string(now, now_len));
+    cr_file_unmap(now, now_len);
+    EXPECT_EQ(false, fs::exists(file + ".tmp"));
+    cr_file_unmap(old, len);
+    EXPECT_EQ(true, fs::remove(file));
+}
+
+#if defined(CR_LINUX)
+TEST(crTest, state_migration) {
+    const auto dir = fs::current_path();
+    const auto lib_path = dir / CR_PLUGIN("test_migrate");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+    const auto over = fs::copy_options::overwrite_existing;
+    fs::copy_file(dir / CR_PLUGIN("test_migrate_a"), lib_path, over);
+
+    cr_plugin ctx;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    cr_set_state_migration(ctx, true);
+    EXPECT_EQ(1 + 10 + 7 + 4, cr_plugin_update(ctx));
+    EXPECT_EQ(2 + 20 + 7 + 5, cr_plugin_update(ctx));
+
+    // `removed` is gone, `added` gets its initializer and the others moved.
+    // `level` changed its type (CR_STATE_VAR) and is reinitialized.
+    fs::copy_file(dir / CR_PLUGIN("test_migrate_b"), lib_path, over);
+    touch(bin);
+    EXPECT_EQ(3 + 30 + 40 + 0 + 3, cr_plugin_update(ctx));
+    EXPECT_EQ(2u, ctx.version);
+    EXPECT_EQ(4 + 40 + 40 + 1 + 5, cr_plugin_update(ctx));
+
+    // and back
+    fs::copy_file(dir / CR_PLUGIN("test_migrate_a"), lib_path, over);
+    touch(bin);
+    EXPECT_EQ(5 + 50 + 7 + 4, cr_plugin_update(ctx));
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+    fs::remove(lib_path);
+}
+
+TEST(crTest, state_migration_typed) {
+    const auto dir = fs::current_path();
+    const auto lib_path = dir / CR_PLUGIN("test_migrate");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+    const auto over = fs::copy_options::overwrite_existing;
+    fs::copy_file(dir / CR_PLUGIN("test_migrate_a"), lib_path, over);
+
+    // not enabled, the CR_STATE_VAR records force it
+    cr_plugin ctx;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    EXPECT_EQ(1 + 10 + 7 + 4, cr_plugin_update(ctx));
+    EXPECT_EQ(2 + 20 + 7 + 5, cr_plugin_update(ctx));
+
+    fs::copy_file(dir / CR_PLUGIN("test_migrate_b"), lib_path, over);
+    touch(bin);
+    EXPECT_EQ(3 + 30 + 40 + 0 + 3, cr_plugin_update(ctx));
+    EXPECT_EQ(2u, ctx.version);
+    EXPECT_EQ(CR_NONE, ctx.failure);
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+    fs::remove(lib_path);
+}
+
+TEST(crTest, relocation) {
+    const auto dir = fs::current_path();
+    const auto lib_path = dir / CR_PLUGIN("test_relocate");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+    const auto over = fs::copy_options::overwrite_existing;
+    fs::copy_file(dir / CR_PLUGIN("test_relocate_a"), lib_path, over);
+
+    cr_plugin ctx;
+    void *heap[4] = {};
+    ctx.userdata = heap;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    cr_set_skip_identical(ctx, false);
+    cr_set_state_migration(ctx, true);
+    cr_set_relocation(ctx, true);
+    cr_register_heap_range(ctx, heap, sizeof(heap));
+    EXPECT_EQ(111, cr_plugin_update(ctx));
+
+    // the old image is gone, the pointers now go to the new one
+    fs::copy_file(dir / CR_PLUGIN("test_relocate_b"), lib_path, over);
+    touch(bin);
+    EXPECT_EQ(222, cr_plugin_update(ctx));
+    EXPECT_EQ(2u, ctx.version);
+
+    // the same image loaded elsewhere
+    touch(bin);
+    EXPECT_EQ(322, cr_plugin_update(ctx));
+    EXPECT_EQ(3u, ctx.version);
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_unregister_heap_range(ctx, heap);
+    cr_plugin_close(ctx);
+    fs::remove(lib_path);
+}
+
+TEST(crTest, state_view) {
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+
+    using namespace test_basic;
+    cr_plugin ctx;
+    test_data data;
+    ctx.userdata = &data;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    data.test = test_id::watched_int;
+    cr_state_view view;
+    EXPECT_EQ(false, cr_plugin_state_find(ctx, "watched_pair", view));
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+
+    ASSERT_EQ(true, cr_plugin_state_find(ctx, "watched_pair", view));
+    EXPECT_NE(nullptr, view.seq);
+    uint64_t pair[2] = {};
+    EXPECT_EQ(true, cr_state_view_read(view, pair));
+    EXPECT_EQ(1u, pair[0]);
+    EXPECT_EQ(2u, pair[1]);
+    EXPECT_EQ(false, cr_plugin_state_find(ctx, "no_such_variable", view));
+
+    // sampled while the guest writes it, never torn
+    const auto share = (fs::current_path() / "test_state_share").string();
+    EXPECT_EQ(true, cr_set_state_share(ctx, share,
+                                       {"watched_pair", "global_int"}));
+    ASSERT_EQ(true, cr_plugin_state_find(ctx, "watched_pair", view));
+    std::atomic<bool> done{false};
+    std::atomic<int> torn{0};
+    std::thread reader([&]() {
+        uint64_t value[2];
+        while (!done) {
+            cr_state_view_read(view, value);
+            torn += value[1] != value[0] * 2;
+        }
+    });
+    int last = 0;
+    for (int i = 0; i < 1000; ++i) {
+        last = cr_plugin_update(ctx);
+    }
+    done = true;
+    reader.join();
+    EXPECT_EQ(1001, last);
+    EXPECT_EQ(0, torn.load());
+
+    // and published to other processes
+    size_t len = 0;
+    auto shared = cr_file_map_read(share, len);
+    ASSERT_NE(nullptr, shared);
+    EXPECT_EQ(true,
+              cr_state_share_read(shared, "watched_pair", pair, sizeof(pair)));
+    EXPECT_EQ(1001u, pair[0]);
+    uint32_t global = 1;
+    EXPECT_EQ(true, cr_state_share_read(shared, "global_int", &global,
+                                        sizeof(global)));
+    EXPECT_EQ(0u, global);
+    EXPECT_EQ(false, cr_state_share_read(shared, "watched_pair", pair, 4));
+    cr_file_unmap(shared, len);
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+    fs::remove(share);
+}
+
+TEST(crTest, state_view_stuck) {
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+
+    using namespace test_basic;
+    cr_plugin ctx;
+    test_data data;
+    ctx.userdata = &data;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    cr_set_skip_identical(ctx, false);
+    const auto share = (fs::current_path() / "test_state_share").string();
+    EXPECT_EQ(true, cr_set_state_share(ctx, share, {"watched_pair"}));
+    data.test = test_id::watched_int;
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+    size_t len = 0;
+    auto shared = cr_file_map_read(share, len);
+    ASSERT_NE(nullptr, shared);
+
+    // the guest returns in the middle of a write, publishing doesn't wait
+    data.test = test_id::watched_stuck;
+    EXPECT_EQ(2, cr_plugin_update(ctx));
+    cr_state_view view;
+    ASSERT_EQ(true, cr_plugin_state_find(ctx, "watched_pair", view));
+    uint64_t pair[2] = {};
+    EXPECT_EQ(false, cr_state_view_read(view, pair));
+    // and the last consistent value stays published
+    EXPECT_EQ(true,
+              cr_state_share_read(shared, "watched_pair", pair, sizeof(pair)));
+    EXPECT_EQ(1u, pair[0]);
+
+    // laid out again in a new file, the old mapping stays readable
+    EXPECT_EQ(true, cr_set_state_share(ctx, share, {"watched_pair"}));
+    data.test = test_id::watched_int;
+    data.countdown = 0;
+    cr_plugin_update(ctx);
+    EXPECT_EQ(true,
+              cr_state_share_read(shared, "watched_pair", pair, sizeof(pair)));
+    EXPECT_EQ(1u, pair[0]);
+    cr_file_unmap(shared, len);
+
+    // then crashes in the middle of a write, the state rolled back to is
+    // readable
+    touch(bin);
+    data.test = test_id::watched_stuck;
+    cr_plugin_update(ctx);
+    EXPECT_EQ(2, ctx.version);
+    data.countdown = 1;
+    EXPECT_EQ(-1, cr_plugin_update(ctx));
+    EXPECT_EQ(CR_SEGFAULT, ctx.failure);
+    data.countdown = 0;
+    data.test = test_id::return_version;
+    cr_plugin_update(ctx);
+    ASSERT_EQ(true, cr_plugin_state_find(ctx, "watched_pair", view));
+    EXPECT_EQ(true, cr_state_view_read(view, pair));
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+    fs::remove(share);
+}
+#endif
+
+TEST(crTest, state_export) {
+    const auto dir = fs::current_path();
+    const auto lib_path = dir / CR_PLUGIN("test_export");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+    const auto over = fs::copy_options::overwrite_existing;
+    fs::copy_file(dir / CR_PLUGIN("test_export_a"), lib_path, over);
+
+    cr_plugin ctx;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    cr_set_state_export(ctx, true);
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+    EXPECT_EQ(2, cr_plugin_update(ctx));
+
+    // the state shrinks, version 2 imports it instead
+    fs::copy_file(dir / CR_PLUGIN("test_export_b"), lib_path, over);
+    touch(bin);
+    EXPECT_EQ(1003, cr_plugin_update(ctx));
+    EXPECT_EQ(2u, ctx.version);
+    EXPECT_EQ(CR_NONE, ctx.failure);
+    EXPECT_EQ(1004, cr_plugin_update(ctx));
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+    fs::remove(lib_path);
+}
+
+TEST(crTest, state_export_rollback) {
+    const auto dir = fs::current_path();
+    const auto lib_path = dir / CR_PLUGIN("test_export");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+    const auto over = fs::copy_options::overwrite_existing;
+    fs::copy_file(dir / CR_PLUGIN("test_export_a"), lib_path, over);
+
+    cr_plugin ctx;
+    int fail = 0;
+    ctx.userdata = &fail;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    cr_set_state_export(ctx, true);
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+    EXPECT_EQ(2, cr_plugin_update(ctx));
+
+    // the import fails, version 1 keeps its state
+    fail = 1;
+    fs::copy_file(dir / CR_PLUGIN("test_export_b"), lib_path, over);
+    touch(bin);
+    EXPECT_EQ(-2, cr_plugin_update(ctx));
+    EXPECT_EQ(CR_USER, ctx.failure);
+    EXPECT_EQ(3, cr_plugin_update(ctx));
+    EXPECT_EQ(1u, ctx.version);
+
+    // and when it crashes
+    fail = 2;
+    touch(bin);
+    EXPECT_EQ(-2, cr_plugin_update(ctx));
+    EXPECT_EQ(CR_SEGFAULT, ctx.failure);
+    EXPECT_EQ(4, cr_plugin_update(ctx));
+    EXPECT_EQ(1u, ctx.version);
+
+    fail = 0;
+    touch(bin);
+    EXPECT_EQ(1005, cr_plugin_update(ctx));
+    EXPECT_EQ(CR_NONE, ctx.failure);
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+    fs::remove(lib_path);
+}
+
+TEST(crTest, large_copy) {
+    // misaligned on both ends, splits in uneven chunks
+    const size_t len = CR_COPY_THRESHOLD + 4099;
+    std::vector<char> src(len + 3), dst(len + 5, 0);
+    for (size_t i = 0; i < src.size(); ++i) {
+        src[i] = (char)(i * 31 + (i >> 12));
+    }
+    cr_state_memcpy(dst.data() + 5, src.data() + 3, len - 5);
+    EXPECT_EQ(0, dst[4]);
+    EXPECT_EQ(0, std::memcmp(dst.data() + 5, src.data() + 3, len - 5));
+    EXPECT_EQ(0, dst[len]);
+
+    // copies from several threads share the same workers
+    std::vector<char> other(len, 0);
+    std::thread t([&] { cr_state_memcpy(other.data(), src.data(), len); });
+    cr_state_memcpy(dst.data(), src.data() + 1, len);
+    t.join();
+    EXPECT_EQ(0, std::memcmp(other.data(), src.data(), len));
+    EXPECT_EQ(0, std::memcmp(dst.data(), src.data() + 1, len));
+    EXPECT_EQ((size_t)CR_COPY_THREADS - 1, cr_copier_get().threads.size());
+}
+
+TEST(crTest, watch_flow) {
+    auto lib_path = fs::current_path() / CR_PLUGIN("test_basic");
+    auto lib_str = lib_path.string();
+    const char *bin = lib_str.c_str();
+
+    using namespace test_basic;
+    cr_plugin ctx;
+    test_data data;
+    ctx.userdata = &data;
+    EXPECT_EQ(true, cr_plugin_open(ctx, bin));
+    cr_set_skip_identical(ctx, false);
+
+    const int fd = cr_watch_fd();
+
+    data.test = test_id::return_version;
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+
+    touch(bin);
+#if defined(CR_LINUX)
+    EXPECT_NE(-1, fd);
+    // nothing dispatched yet, the change must not be seen
+    EXPECT_EQ(1, cr_plugin_update(ctx));
+
+    struct pollfd pfd = {fd, POLLIN, 0};
+    EXPECT_EQ(1, poll(&pfd, 1, 1000));
+    cr_watch_dispatch();
+#else
+    EXPECT_EQ(-1, fd);
+#endif
+    EXPECT_EQ(2, cr_plugin_update(ctx));
+
+    delete_old_files(ctx, ctx.next_version);
+    cr_plugin_close(ctx);
+    EXPECT_EQ(ctx.p, nullptr);
+}
@@ -86,6 +86,104 @@ DEFINE_TEST(crash_unload) {
     return 0;
 }
 
+// spans many pages, see `cr_set_state_remap`
+static int CR_STATE big_state[64 * 1024] = {1};
+
+DEFINE_TEST(big_state_int) {
+    const int count = sizeof(big_state) / sizeof(big_state[0]);
+    if (operation == CR_STEP) {
+        big_state[count / 2]++;
+        big_state[count - 1]++;
+    }
+    if (big_state[count / 2] != big_state[count - 1]) {
+        return -1;
+    }
+    return big_state[0] == 1 ? big_state[count / 2] : -1;
+}
+
+// a large .bss mostly never touched
+static int big_bss[4 * 1024 * 1024];
+
+DEFINE_TEST(big_bss_int) {
+    const int count = sizeof(big_bss) / sizeof(big_bss[0]);
+    if (operation == CR_STEP) {
+        big_bss[count / 3]++;
+    }
+    return big_bss[count / 3];
+}
+
+DEFINE_TEST(crash_countdown) {
+    if (operation == CR_STEP && --data->countdown < 0) {
+        int *addr = nullptr;
+        (void)++*addr;
+    }
+    return data->countdown;
+}
+
+// see `cr_set_section`
+static int CR_SECTION(kept) kept_int = 100;
+static int CR_SECTION(fresh) fresh_int = 200;
+
+DEFINE_TEST(section_policy_int) {
+    if (operation == CR_STEP) {
+        kept_int++;
+        fresh_int++;
+        if (data->countdown && --data->countdown == 0) {
+            int *addr = nullptr;
+            (void)++*addr;
+        }
+    }
+    return kept_int * 1000 + fresh_int;
+}
+
+// the value lives in the arena, see `cr_set_arena`
+static int *CR_STATE arena_value = nullptr;
+
+DEFINE_TEST(arena_int) {
+    if (!arena_value) {
+        arena_value = (int *)cr_arena_alloc(ctx, sizeof(int));
+        if (!arena_value) {
+            return -1;
+        }
+        *arena_value = 0;
+    }
+    if (operation == CR_STEP) {
+        ++*arena_value;
+        if (data->countdown && --data->countdown == 0) {
+            int *addr = nullptr;
+            (void)++*addr;
+        }
+    }
+    return *arena_value;
+}
+
+// read by the host while it changes, see `cr_plugin_state_find`
+CR_STATE_SEQLOCK;
+static uint64_t CR_STATE watched_pair[2] = {0, 0};
+
+DEFINE_TEST(watched_int) {
+    if (operation == CR_STEP) {
+        CR_STATE_WRITE_BEGIN();
+        watched_pair[0]++;
+        watched_pair[1] = watched_pair[0] * 2;
+        CR_STATE_WRITE_END();
+    }
+    return (int)watched_pair[0];
+}
+
+// returns, or crashes with a countdown, in the middle of a write
+DEFINE_TEST(watched_stuck) {
+    if (operation == CR_STEP) {
+        CR_STATE_WRITE_BEGIN();
+        watched_pair[0]++;
+        if (data->countdown > 0) {
+            int *addr = nullptr;
+            (void)++*addr;
+        }
+    }
+    return (int)watched_pair[0];
+}
+
 CR_EXPORT int cr_main(cr_plugin *ctx, cr_op operation) {
     test_data *data = (test_data *)ctx->userdata;
     // clang-format off
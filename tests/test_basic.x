@@ -7,4 +7,11 @@ CR_TEST_LIST_BEGIN()
     CR_TEST(crash_load)
     CR_TEST(crash_update)
     CR_TEST(crash_unload)
+    CR_TEST(crash_countdown)
+    CR_TEST(big_state_int)
+    CR_TEST(big_bss_int)
+    CR_TEST(section_policy_int)
+    CR_TEST(arena_int)
+    CR_TEST(watched_int)
+    CR_TEST(watched_stuck)
 CR_TEST_LIST_END()
\ No newline at end of file
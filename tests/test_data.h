@@ -20,5 +20,6 @@ namespace test_basic {
         int static_global_state = 0;
         int *heap_data_ptr = nullptr;
         int heap_data_size = 0;
+        int countdown = 0;
     };
 }
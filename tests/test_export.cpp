@@ -0,0 +1,45 @@
+#include "cr.h"
+#include <cstdint>
+
+// A plugin whose state shrinks from test_export_a to test_export_b (built
+// with TEST_EXPORT_B), so it can't be copied and is serialized instead. The
+// host can make the import fail (1) or crash (2) with an int in userdata.
+#if !defined(TEST_EXPORT_B)
+static int64_t CR_STATE padding[64] = {1};
+#endif
+static int32_t CR_STATE counter = 0;
+
+CR_EXPORT int cr_main(cr_plugin *ctx, cr_op operation) {
+    switch (operation) {
+    case CR_STATE_EXPORT: {
+        auto p = (int32_t *)cr_buffer_write(ctx->state, sizeof(counter));
+        if (!p) {
+            return -1;
+        }
+        *p = counter;
+        return 0;
+    }
+    case CR_STATE_IMPORT: {
+        auto p = (const int32_t *)cr_buffer_read(ctx->state, sizeof(counter));
+        auto fail = (const int *)ctx->userdata;
+        counter = -1;
+        if (fail && *fail == 2) {
+            int *addr = nullptr;
+            (void)++*addr;
+        }
+        if (!p || (fail && *fail == 1)) {
+            return -1;
+        }
+        counter = *p + 1000;
+        return 0;
+    }
+    case CR_STEP:
+#if !defined(TEST_EXPORT_B)
+        return ++counter + (int)padding[0] - 1;
+#else
+        return ++counter;
+#endif
+    default:
+        return 0;
+    }
+}
@@ -0,0 +1,34 @@
+#include "cr.h"
+#include <cstdint>
+
+// Two versions of a plugin state laid out differently, built as
+// test_migrate_a and test_migrate_b (TEST_MIGRATE_B).
+#if defined(TEST_MIGRATE_B)
+static int32_t CR_STATE added = 40;
+static int64_t CR_STATE counter = 0;
+static int32_t CR_STATE total[4] = {};
+static int32_t added_bss;
+// same size, but a different type
+CR_STATE_VAR(float, level, 0.5f);
+#else
+static int32_t CR_STATE removed = 7;
+static int32_t CR_STATE total[4] = {};
+static int64_t CR_STATE counter = 0;
+CR_STATE_VAR(int32_t, level, 3);
+#endif
+
+CR_EXPORT int cr_main(cr_plugin *ctx, cr_op operation) {
+    (void)ctx;
+    if (operation != CR_STEP) {
+        return 0;
+    }
+    counter++;
+    total[3] += 10;
+    level += 1;
+#if defined(TEST_MIGRATE_B)
+    // counter and total are kept, the new ones start with their initializers
+    return (int)counter + total[3] + added + added_bss++ + (int)(level * 2);
+#else
+    return (int)counter + total[3] + removed + level;
+#endif
+}
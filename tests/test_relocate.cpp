@@ -0,0 +1,33 @@
+#include "cr.h"
+#include <cstdint>
+
+// Two versions of a plugin keeping pointers to its own code and data, built
+// as test_relocate_a and test_relocate_b (TEST_RELOCATE_B).
+#if defined(TEST_RELOCATE_B)
+static int32_t CR_STATE padding[16] = {1};
+static int answer() {
+    return padding[0] + 1;
+}
+#else
+static int answer() {
+    return 1;
+}
+#endif
+static int32_t CR_STATE value = 0;
+static int32_t *CR_STATE value_ptr = nullptr;
+static int (*CR_STATE answer_ptr)() = nullptr;
+
+CR_EXPORT int cr_main(cr_plugin *ctx, cr_op operation) {
+    // a host allocation, see cr_register_heap_range
+    auto heap = (int (**)())ctx->userdata;
+    if (operation != CR_STEP) {
+        return 0;
+    }
+    if (!value_ptr) {
+        value_ptr = &value;
+        answer_ptr = answer;
+        *heap = answer;
+    }
+    ++*value_ptr;
+    return *value_ptr * 100 + answer_ptr() * 10 + (*heap)();
+}